@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SHAREDMUTEX_H
+#define SHAREDMUTEX_H
+
+#include <pthread.h>
+
+using namespace std;
+
+/*
+ A reader/writer lock, as C++11 has none: lock() and unlock() take it for one thread alone, so it
+ works with lock_guard, while lock_shared() and unlock_shared() let any number of threads hold it
+ together (see SharedLock). Built on pthread_rwlock_t, like the rest of the file code is on POSIX.
+ */
+class SharedMutex {
+	
+	public:
+		SharedMutex() { pthread_rwlock_init(&m_lock, nullptr); }
+		~SharedMutex() { pthread_rwlock_destroy(&m_lock); }
+	
+		void lock() { pthread_rwlock_wrlock(&m_lock); }
+		void unlock() { pthread_rwlock_unlock(&m_lock); }
+	
+		void lock_shared() { pthread_rwlock_rdlock(&m_lock); }
+		void unlock_shared() { pthread_rwlock_unlock(&m_lock); }
+	
+	private:
+		pthread_rwlock_t m_lock;
+	
+		SharedMutex(const SharedMutex &);
+		SharedMutex &operator=(const SharedMutex &);
+};
+
+// holds a SharedMutex in shared mode for its lifetime, the counterpart of lock_guard
+class SharedLock {
+	
+	public:
+		SharedLock(SharedMutex &mutex) : m_mutex(mutex) { m_mutex.lock_shared(); }
+		~SharedLock() { m_mutex.unlock_shared(); }
+	
+	private:
+		SharedMutex &m_mutex;
+	
+		SharedLock(const SharedLock &);
+		SharedLock &operator=(const SharedLock &);
+};
+
+#endif // SHAREDMUTEX_H
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+/*
+ A fixed set of worker threads running the tasks they are given, in the order of submission.
+ The destructor waits for every submitted task to be done before joining the workers.
+ Tasks are not expected to throw.
+ */
+class ThreadPool {
+	
+	public:
+		ThreadPool(size_t threads = thread::hardware_concurrency()) : m_stopping(false), m_running(0) {
+			if (threads == 0)
+				threads = 1;
+			for (size_t i = 0; i < threads; i++)
+				m_workers.push_back(thread(&ThreadPool::m_work, this));
+		}
+	
+		~ThreadPool() {
+			wait();
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_stopping = true;
+			}
+			m_wake.notify_all();
+			for (thread &worker : m_workers)
+				worker.join();
+		}
+	
+		void submit(const function<void()> &task) {
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_tasks.push_back(task);
+			}
+			m_wake.notify_one();
+		}
+	
+		// blocks until every submitted task is done
+		void wait() {
+			unique_lock<mutex> lock(m_mutex);
+			m_idle.wait(lock, [this] { return m_tasks.empty() && m_running == 0; });
+		}
+	
+		size_t threads() const { return m_workers.size(); }
+	
+		// the tasks waiting for a worker or being run
+		size_t pending() const {
+			lock_guard<mutex> lock(m_mutex);
+			return m_tasks.size() + m_running;
+		}
+	
+	private:
+		vector<thread> m_workers;
+		deque<function<void()>> m_tasks;
+		bool m_stopping;
+		size_t m_running;
+		mutable mutex m_mutex;
+		condition_variable m_wake; // a task was submitted, or the pool is stopping
+		condition_variable m_idle; // a task is done
+	
+		// non-copyable: the workers point to the pool
+		ThreadPool(const ThreadPool &);
+		ThreadPool &operator=(const ThreadPool &);
+	
+		void m_work() {
+			
+			unique_lock<mutex> lock(m_mutex);
+			while (true) {
+				m_wake.wait(lock, [this] { return m_stopping || !m_tasks.empty(); });
+				if (m_tasks.empty())
+					return; // stopping, and nothing is left to do
+				
+				function<void()> task = move(m_tasks.front());
+				m_tasks.pop_front();
+				m_running++;
+				
+				lock.unlock();
+				task();
+				lock.lock();
+				
+				m_running--;
+				if (m_tasks.empty() && m_running == 0)
+					m_idle.notify_all();
+			}
+		}
+};
+
+#endif
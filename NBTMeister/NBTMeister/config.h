@@ -46,5 +46,7 @@
 // General config for compilation
 #define NBTMEISTER_FORCE_LITTLE_ENDIAN
 //#define NBTMEISTER_USE_MINECRAFT_NAMESPACE
+//#define NBTMEISTER_USE_LZ4 // registers the LZ4 chunk codec, needs liblz4
+//#define NBTMEISTER_USE_IO_URING // asynchronous reads with io_uring (Linux), needs liburing
 
 #endif
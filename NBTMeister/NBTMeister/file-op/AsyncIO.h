@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ASYNCIO_H
+#define ASYNCIO_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <unordered_set>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Parser.h"
+#include "../ThreadPool.h"
+#include "../config.h"
+
+#ifdef NBTMEISTER_USE_IO_URING
+#include <liburing.h>
+#endif // NBTMEISTER_USE_IO_URING
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// default number of reads an AsyncReader keeps in flight
+const size_t DefaultAsyncDepth = 64;
+
+// a file opened for reading, closed when the last read using it is done
+class FileHandle {
+	
+	public:
+		FileHandle(const string &path) : m_path(path), m_fd(::open(path.c_str(), O_RDONLY)) {}
+		~FileHandle() {
+			if (m_fd >= 0)
+				::close(m_fd);
+		}
+	
+		bool good() const { return m_fd >= 0; }
+		int fd() const { return m_fd; }
+		const string &path() const { return m_path; }
+	
+		// the size of the file, 0 if it cannot be known
+		size_t size() const {
+			struct stat info;
+			return m_fd >= 0 && fstat(m_fd, &info) == 0 ? static_cast<size_t>(info.st_size) : 0;
+		}
+	
+	private:
+		string m_path;
+		int m_fd;
+	
+		FileHandle(const FileHandle &);
+		FileHandle &operator=(const FileHandle &);
+};
+
+// a finished read. 'data' holds the bytes read: less than asked if the end of the file was reached
+struct AsyncRead {
+	AsyncRead() : offset(0), length(0), error(0) {}
+	
+	shared_ptr<FileHandle> file;
+	off_t offset;
+	size_t length; // what was asked
+	memblock data;
+	int error; // the errno of the failure, 0 if the read succeeded
+	
+	bool good() const { return error == 0; }
+};
+
+// called once a read is finished, on one of the threads of the reader
+typedef function<void(AsyncRead &read)> AsyncReadCallback;
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Reads files asynchronously, with many reads in flight, so that a scan keeps the disk busy instead
+ of waiting for each read before issuing the next one. There are two implementations:
+ 	- UringReader, with io_uring (Linux, NBTMEISTER_USE_IO_URING defined in config.h);
+ 	- PoolReader, with blocking preads run by a ThreadPool. It works everywhere.
+ makeAsyncReader() gives the best one available.
+ 
+ A read is given a callback, which is run once the bytes are in memory. The callbacks run on the
+ threads of the reader, several at once: this is where the next stages (inflating, parsing) are meant
+ to be done. They may issue other reads.
+ 
+ At most depth() reads are in flight (counting their callbacks): read() blocks when they are, so a
+ producer cannot queue up a whole world. A callback cannot block, as it would then wait for itself: the
+ reads it issues past the depth are queued (only their parameters, no buffer), and each finished
+ callback hands its slot to the oldest of them. Fanning out from callbacks, as WorldScan does from the
+ headers of the regions, still keeps at most depth() buffers allocated.
+ */
+class AsyncReader {
+	
+	public:
+		AsyncReader(size_t depth) : m_depth(depth ? depth : 1), m_inFlight(0) {}
+		virtual ~AsyncReader() {}
+	
+		// reads 'length' bytes at 'offset' of 'file', then calls 'done'
+		void read(const shared_ptr<FileHandle> &file, off_t offset, size_t length, const AsyncReadCallback &done) {
+			
+			unique_lock<mutex> lock(m_mutex);
+			if (m_inCallback() && m_inFlight >= m_depth) {
+				m_deferred.push_back(Deferred{file, offset, length, done});
+				return;
+			}
+			m_slotFreed.wait(lock, [this] { return m_inFlight < m_depth; });
+			m_inFlight++;
+			lock.unlock();
+			
+			m_start(file, offset, length, done);
+		}
+	
+		virtual const char *name() const = 0;
+	
+		// reads a whole file (a standalone NBT file for instance), then calls 'done'
+		void readFile(const shared_ptr<FileHandle> &file, const AsyncReadCallback &done) {
+			read(file, 0, file->size(), done);
+		}
+	
+		// blocks until every read is finished and its callback is done
+		void wait() {
+			unique_lock<mutex> lock(m_mutex);
+			m_idle.wait(lock, [this] { return m_inFlight == 0 && m_deferred.empty(); });
+		}
+	
+		size_t depth() const { return m_depth; }
+		size_t inFlight() const { lock_guard<mutex> lock(m_mutex); return m_inFlight; }
+	
+	protected:
+		// issues a read for which a slot has been taken. It must not block
+		virtual void m_start(const shared_ptr<FileHandle> &file, off_t offset, size_t length, const AsyncReadCallback &done) = 0;
+	
+		// runs the callback of a finished read, then gives its slot to a queued read, or back
+		void m_complete(AsyncRead &read, const AsyncReadCallback &done) {
+			
+			const AsyncReader *outer = m_running();
+			m_running() = this;
+			done(read);
+			m_running() = outer;
+			
+			unique_lock<mutex> lock(m_mutex);
+			if (!m_deferred.empty()) { // the slot goes on to the oldest queued read
+				Deferred next = move(m_deferred.front());
+				m_deferred.pop_front();
+				lock.unlock();
+				m_start(next.file, next.offset, next.length, next.done);
+				return;
+			}
+			m_inFlight--;
+			m_slotFreed.notify_one();
+			if (m_inFlight == 0)
+				m_idle.notify_all();
+		}
+	
+	private:
+		// a read issued by a callback while every slot was taken
+		struct Deferred {
+			shared_ptr<FileHandle> file;
+			off_t offset;
+			size_t length;
+			AsyncReadCallback done;
+		};
+	
+		size_t m_depth;
+		size_t m_inFlight;
+		deque<Deferred> m_deferred;
+		mutable mutex m_mutex;
+		condition_variable m_slotFreed;
+		condition_variable m_idle;
+	
+		// the reader whose callback the calling thread is running, if any
+		static const AsyncReader *&m_running() {
+			static thread_local const AsyncReader *running = nullptr;
+			return running;
+		}
+	
+		// true while the calling thread runs a callback of this reader
+		bool m_inCallback() const { return m_running() == this; }
+};
+
+// an AsyncReader doing blocking reads on the threads of a pool
+class PoolReader : public AsyncReader {
+	
+	public:
+		PoolReader(size_t depth = DefaultAsyncDepth, size_t threads = 16) : AsyncReader(depth), m_pool(threads) {}
+		~PoolReader() { wait(); }
+	
+		const char *name() const { return "thread pool"; }
+	
+	protected:
+		void m_start(const shared_ptr<FileHandle> &file, off_t offset, size_t length, const AsyncReadCallback &done) {
+			
+			m_pool.submit([this, file, offset, length, done] {
+				
+				AsyncRead read;
+				read.file = file;
+				read.offset = offset;
+				read.length = length;
+				read.data.resize(length);
+				
+				size_t got = 0;
+				while (got < length) {
+					ssize_t result = pread(file->fd(), &read.data[got], length - got, offset + got);
+					if (result < 0 && errno == EINTR)
+						continue;
+					if (result < 0)
+						read.error = errno;
+					if (result <= 0)
+						break;
+					got += result;
+				}
+				read.data.resize(got);
+				
+				m_complete(read, done);
+			});
+		}
+	
+	private:
+		ThreadPool m_pool;
+};
+
+#ifdef NBTMEISTER_USE_IO_URING
+/*
+ An AsyncReader submitting its reads to an io_uring. One thread reaps the completions and hands
+ them to a pool that runs the callbacks, so that a slow callback does not delay the other completions.
+ A short read is resubmitted for what is left, until the end of the file.
+ 
+ The reads submitted to the ring are kept in m_submitted until their completion is reaped. If the ring
+ itself fails (io_uring_wait_cqe giving an error other than EINTR), nothing more will be reaped: every
+ submitted read, and every read started afterwards, is then finished with the error, so that wait()
+ returns. The kernel may still write into the buffers of the reads it had taken, so these buffers are
+ kept in m_orphans until the ring is closed.
+ */
+class UringReader : public AsyncReader {
+	
+	public:
+		UringReader(size_t depth = DefaultAsyncDepth, size_t callbackThreads = thread::hardware_concurrency()) :
+		AsyncReader(depth), m_good(false), m_failure(0), m_callbacks(callbackThreads) {
+			
+			if (io_uring_queue_init(static_cast<unsigned>(depth), &m_ring, 0) < 0) {
+				cerr << "[Warning] cannot create an io_uring, use PoolReader instead" << endl;
+				return;
+			}
+			m_good = true;
+			m_reaper = thread(&UringReader::m_reap, this);
+		}
+	
+		~UringReader() {
+			
+			if (!m_good)
+				return;
+			wait();
+			
+			// an empty operation tells the reaper to stop, unless it already did because the ring failed
+			{
+				lock_guard<mutex> lock(m_submitMutex);
+				if (!m_failure) {
+					io_uring_sqe *sqe = m_sqe();
+					io_uring_prep_nop(sqe);
+					io_uring_sqe_set_data(sqe, nullptr);
+					io_uring_submit(&m_ring);
+				}
+			}
+			m_reaper.join();
+			io_uring_queue_exit(&m_ring);
+		}
+	
+		bool good() const { return m_good; }
+	
+		const char *name() const { return "io_uring"; }
+	
+	protected:
+		void m_start(const shared_ptr<FileHandle> &file, off_t offset, size_t length, const AsyncReadCallback &done) {
+			
+			Pending *pending = new Pending;
+			pending->done = done;
+			pending->got = 0;
+			pending->read.file = file;
+			pending->read.offset = offset;
+			pending->read.length = length;
+			pending->read.data.resize(length);
+			
+			if (length == 0)
+				m_finish(pending);
+			else m_submit(pending);
+		}
+	
+	private:
+		struct Pending {
+			AsyncRead read;
+			AsyncReadCallback done;
+			size_t got; // bytes already read
+		};
+	
+		bool m_good;
+		io_uring m_ring;
+		thread m_reaper;
+		mutex m_submitMutex; // also guards m_submitted, m_failure and m_orphans
+		unordered_set<Pending *> m_submitted; // the reads whose completion is not reaped yet
+		int m_failure; // the errno with which the ring failed, 0 while it works
+		vector<memblock> m_orphans; // the buffers of the reads that were in the ring when it failed
+		ThreadPool m_callbacks;
+	
+		// a free submission entry. m_submitMutex must be locked
+		io_uring_sqe *m_sqe() {
+			io_uring_sqe *sqe = io_uring_get_sqe(&m_ring);
+			while (!sqe) { // the queue is full: we give what it holds to the kernel
+				io_uring_submit(&m_ring);
+				sqe = io_uring_get_sqe(&m_ring);
+			}
+			return sqe;
+		}
+	
+		// submits what is left to read of 'pending'
+		void m_submit(Pending *pending) {
+			
+			unique_lock<mutex> lock(m_submitMutex);
+			if (m_failure) { // nothing would reap it
+				pending->read.error = m_failure;
+				lock.unlock();
+				m_finish(pending);
+				return;
+			}
+			io_uring_sqe *sqe = m_sqe();
+			AsyncRead &read = pending->read;
+			io_uring_prep_read(sqe, read.file->fd(), &read.data[pending->got],
+							   static_cast<unsigned>(read.length - pending->got), read.offset + pending->got);
+			io_uring_sqe_set_data(sqe, pending);
+			io_uring_submit(&m_ring);
+			m_submitted.insert(pending);
+		}
+	
+		void m_finish(Pending *pending) {
+			pending->read.data.resize(pending->got);
+			m_callbacks.submit([this, pending] {
+				m_complete(pending->read, pending->done);
+				delete pending;
+			});
+		}
+	
+		void m_reap() {
+			
+			while (true) {
+				
+				io_uring_cqe *cqe;
+				int result = io_uring_wait_cqe(&m_ring, &cqe);
+				if (result == -EINTR)
+					continue;
+				if (result < 0) {
+					cerr << "[Error] io_uring failed: " << -result << endl;
+					m_fail(-result);
+					return;
+				}
+				
+				Pending *pending = static_cast<Pending *>(io_uring_cqe_get_data(cqe));
+				result = cqe->res;
+				io_uring_cqe_seen(&m_ring, cqe);
+				if (!pending)
+					return; // the reader is being destroyed
+				{
+					lock_guard<mutex> lock(m_submitMutex);
+					m_submitted.erase(pending);
+				}
+				
+				if (result == -EINTR || result == -EAGAIN) {
+					m_submit(pending);
+					continue;
+				}
+				if (result < 0)
+					pending->read.error = -result;
+				else if (result > 0) {
+					pending->got += result;
+					if (pending->got < pending->read.length) {
+						m_submit(pending); // a short read
+						continue;
+					}
+				}
+				m_finish(pending);
+			}
+		}
+	
+		// finishes every submitted read with 'error', as the ring cannot complete them any more
+		void m_fail(int error) {
+			
+			unordered_set<Pending *> submitted;
+			{
+				lock_guard<mutex> lock(m_submitMutex);
+				m_failure = error;
+				submitted.swap(m_submitted);
+				for (Pending *pending : submitted) {
+					m_orphans.push_back(memblock());
+					m_orphans.back().swap(pending->read.data);
+				}
+			}
+			for (Pending *pending : submitted) {
+				pending->read.error = error;
+				pending->got = 0;
+				m_finish(pending);
+			}
+		}
+};
+#endif // NBTMEISTER_USE_IO_URING
+
+// the best AsyncReader available: io_uring if it is enabled and works, a thread pool otherwise
+inline unique_ptr<AsyncReader> makeAsyncReader(size_t depth = DefaultAsyncDepth) {
+#ifdef NBTMEISTER_USE_IO_URING
+	unique_ptr<UringReader> uring(new UringReader(depth));
+	if (uring->good())
+		return move(uring);
+#endif // NBTMEISTER_USE_IO_URING
+	return unique_ptr<AsyncReader>(new PoolReader(depth));
+}
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // ASYNCIO_H
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BLOCKHISTOGRAM_H
+#define BLOCKHISTOGRAM_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include "MinecraftRegion.h"
+#include "RegionFiles.h"
+#include "ChunkBlocks.h"
+#include "../ThreadPool.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// the blocks a histogram counts: a range of heights and, optionally, a box of chunks
+struct HistogramFilter {
+	HistogramFilter() : minY(0), maxY(ChunkHeight - 1), boxed(false), minChunkX(0), minChunkZ(0), maxChunkX(0), maxChunkZ(0) {}
+	
+	int minY; // inclusive, in blocks
+	int maxY; // inclusive, in blocks
+	bool boxed; // if false, every chunk is counted
+	int minChunkX, minChunkZ, maxChunkX, maxChunkZ; // inclusive, global chunk coordinates
+	
+	// restricts the histogram to the chunks from (minX, minZ) to (maxX, maxZ) included
+	void setChunkBox(int minX, int minZ, int maxX, int maxZ) {
+		boxed = true;
+		minChunkX = min(minX, maxX);
+		minChunkZ = min(minZ, maxZ);
+		maxChunkX = max(minX, maxX);
+		maxChunkZ = max(minZ, maxZ);
+	}
+	
+	bool containsChunk(int x, int z) const {
+		return !boxed || (x >= minChunkX && x <= maxChunkX && z >= minChunkZ && z <= maxChunkZ);
+	}
+	
+	bool intersectsRegion(int x, int z) const {
+		return !boxed || (x >= chunkToRegion(minChunkX) && x <= chunkToRegion(maxChunkX) &&
+						  z >= chunkToRegion(minChunkZ) && z <= chunkToRegion(maxChunkZ));
+	}
+};
+
+// counts the blocks of sections, on one thread. The counts are 32-bit: merge() them at least
+// once per region (a region holds 2^26 blocks)
+class BlockCounter {
+	
+	public:
+		BlockCounter() { clear(); }
+	
+		void clear() { memset(m_counts, 0, sizeof(m_counts)); }
+	
+		// counts the layers 'from' to 'to' (excluded, from 0 to SectionHeight) of a section
+		void count(const SectionArrays &section, int from = 0, int to = SectionHeight) {
+			
+			from = max(0, min(from, SectionHeight));
+			to = max(0, min(to, SectionHeight));
+			size_t begin = static_cast<size_t>(from) * ChunkWidth * ChunkWidth, end = static_cast<size_t>(to) * ChunkWidth * ChunkWidth;
+			if (begin >= end)
+				return;
+			
+			if (!section.add) {
+				// the ids are the bytes: four of them are read at once, and every one goes to its own table
+				const uint8_t *blocks = section.blocks;
+				for (size_t i = begin; i < end; i += 4) {
+					uint32_t word;
+					memcpy(&word, blocks + i, 4);
+					m_counts[0][word & 0xFF]++;
+					m_counts[1][(word >> 8) & 0xFF]++;
+					m_counts[2][(word >> 16) & 0xFF]++;
+					m_counts[3][word >> 24]++;
+				}
+				return;
+			}
+			
+			uint8_t highBits[SectionVolume];
+			uint16_t ids[SectionVolume];
+			unpackNibbles(section.add + begin / 2, highBits, end - begin);
+			combineBlockIds(section.blocks + begin, highBits, ids, end - begin);
+			for (size_t i = 0; i < end - begin; i += 4) {
+				m_counts[0][ids[i]]++;
+				m_counts[1][ids[i + 1]]++;
+				m_counts[2][ids[i + 2]]++;
+				m_counts[3][ids[i + 3]]++;
+			}
+		}
+	
+		// adds the counts to 'totals' (BlockIdCount counts) and clears them
+		void merge(uint64_t *totals) {
+			for (int id = 0; id < BlockIdCount; id++)
+				totals[id] += static_cast<uint64_t>(m_counts[0][id]) + m_counts[1][id] + m_counts[2][id] + m_counts[3][id];
+			clear();
+		}
+	
+	private:
+		uint32_t m_counts[4][BlockIdCount];
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Counts the blocks of every id in the region files of a world, or in a part of it (see HistogramFilter).
+ 
+ The region files are counted in parallel, one task of a ThreadPool per region file. A task reads
+ its chunks in the order of the file (Region::forEachChunk() in OrderSector, the chunks outside of the
+ box being not read at all), and walks every chunk with a TagReader (see forEachSection()): only the
+ Y, Blocks and Add tags of the sections are read, the rest of the chunk (entities, lights, heightmaps,
+ ...) is skipped without being decoded. The sections outside of the range of heights are not counted,
+ the ones that cross it are counted layer by layer.
+ 
+ Every task counts in its own BlockCounter, made of four interleaved tables: consecutive blocks are
+ counted in different tables, so that a run of the same id (stone, air) does not make every increment
+ wait for the previous one. When there is an Add array, the 12-bit ids are built with SSE2 first
+ (see combineBlockIds()). The counters of a task are merged into the histogram once its region is done.
+ 
+ Only the sections stored in the chunks are counted: the missing ones, made of air, are not. The
+ sections of the newer format (a palette, no Blocks array) are not counted either, see skippedSections().
+ */
+class BlockHistogram {
+	
+	public:
+		BlockHistogram() : m_counts(BlockIdCount, 0), m_regions(0), m_chunks(0), m_sections(0), m_skippedSections(0), m_failedChunks(0) {}
+	
+		// counts the blocks of the region files of a directory (usually "<world>/region"), on 'threads' threads.
+		// Returns false if there is no region file to count. A filter whose layers are all out of the world
+		// counts nothing
+		bool run(const string &regionDirectory, const HistogramFilter &filter = HistogramFilter(), size_t threads = thread::hardware_concurrency()) {
+			
+			fill(m_counts.begin(), m_counts.end(), 0);
+			m_regions = m_chunks = m_sections = m_skippedSections = m_failedChunks = 0;
+			if (filter.maxY < 0 || filter.minY >= ChunkHeight || filter.minY > filter.maxY)
+				return true;
+			
+			vector<RegionFile> files;
+			for (const RegionFile &file : listRegionFiles(regionDirectory))
+				if (filter.intersectsRegion(file.x, file.z))
+					files.push_back(file);
+			if (files.empty()) {
+				cerr << "[Error] there is no region file to count in " << regionDirectory << endl;
+				return false;
+			}
+			
+			ThreadPool pool(min(threads ? threads : 1, files.size()));
+			for (const RegionFile &file : files)
+				pool.submit([this, file, &filter] { m_countRegion(file, filter); });
+			pool.wait();
+			return true;
+		}
+	
+		// the number of blocks of the id 'id' (from 0 to BlockIdCount - 1)
+		uint64_t count(uint16_t id) const { return id < BlockIdCount ? m_counts[id] : 0; }
+		// the counts of all the ids
+		const vector<uint64_t> &counts() const { return m_counts; }
+	
+		uint64_t total() const {
+			uint64_t sum = 0;
+			for (uint64_t c : m_counts)
+				sum += c;
+			return sum;
+		}
+	
+		size_t regions() const { return m_regions; }
+		size_t chunks() const { return m_chunks; }
+		size_t sections() const { return m_sections; }
+		size_t skippedSections() const { return m_skippedSections; }
+		size_t failedChunks() const { return m_failedChunks; }
+	
+	private:
+		vector<uint64_t> m_counts;
+		size_t m_regions, m_chunks, m_sections, m_skippedSections, m_failedChunks;
+		mutex m_mutex; // guards the counts and the counters while the tasks merge
+	
+		// non-copyable: the tasks of a run point to the histogram
+		BlockHistogram(const BlockHistogram &);
+		BlockHistogram &operator=(const BlockHistogram &);
+	
+		void m_countRegion(const RegionFile &file, const HistogramFilter &filter) {
+			
+			Region region(file.path);
+			if (!region.good()) {
+				cerr << "[Warning] the region file " << file.path << " cannot be opened, it is not counted" << endl;
+				return;
+			}
+			
+			unique_ptr<BlockCounter> counter(new BlockCounter()); // too big for the stack of a worker
+			size_t chunks = 0, sections = 0, skippedSections = 0, failedChunks = 0;
+			int minSection = max(filter.minY, 0) / SectionHeight, maxSection = min(filter.maxY, ChunkHeight - 1) / SectionHeight;
+			
+			region.forEachChunk([&](int, int, const memblock &data) {
+				
+				size_t skipped = 0;
+				bool walked = forEachSection(data.data(), data.size(), [&](const SectionArrays &section) {
+					if (section.y < minSection || section.y > maxSection)
+						return true;
+					int base = section.y * SectionHeight;
+					counter->count(section, max(filter.minY - base, 0), min(filter.maxY - base + 1, SectionHeight));
+					sections++;
+					return true;
+				}, &skipped);
+				
+				skippedSections += skipped;
+				if (walked)
+					chunks++;
+				else
+					failedChunks++;
+			}, OrderSector, DefaultRunSectors, [&](int x, int z) {
+				return filter.containsChunk(file.x * 32 + x, file.z * 32 + z);
+			});
+			
+			lock_guard<mutex> lock(m_mutex);
+			counter->merge(m_counts.data());
+			m_regions++;
+			m_chunks += chunks;
+			m_sections += sections;
+			m_skippedSections += skippedSections;
+			m_failedChunks += failedChunks;
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // BLOCKHISTOGRAM_H
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BLOCKQUERY_H
+#define BLOCKQUERY_H
+
+#include <string>
+#include <vector>
+#include <bitset>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include "World.h"
+#include "MinecraftRegion.h"
+#include "RegionFiles.h"
+#include "ChunkBlocks.h"
+#include "../ThreadPool.h"
+#include "../config.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// the ids compared at once with SSE2; bigger sets are looked up one block at a time
+const size_t BlockIdSetSimdIds = 8;
+
+// a box of blocks, in global block coordinates, its bounds included
+struct BlockBox {
+	BlockBox() : minX(0), minY(0), minZ(0), maxX(-1), maxY(-1), maxZ(-1) {}
+	BlockBox(int x1, int y1, int z1, int x2, int y2, int z2) :
+	minX(min(x1, x2)), minY(min(y1, y2)), minZ(min(z1, z2)), maxX(max(x1, x2)), maxY(max(y1, y2)), maxZ(max(z1, z2)) {}
+	
+	int minX, minY, minZ, maxX, maxY, maxZ;
+	
+	bool empty() const { return minX > maxX || minY > maxY || minZ > maxZ; }
+	bool contains(int x, int y, int z) const {
+		return x >= minX && x <= maxX && y >= minY && y <= maxY && z >= minZ && z <= maxZ;
+	}
+	// the chunk (x, z), in global chunk coordinates, has blocks in the box
+	bool intersectsChunk(int x, int z) const {
+		return x * ChunkWidth <= maxX && x * ChunkWidth + ChunkWidth - 1 >= minX &&
+			   z * ChunkWidth <= maxZ && z * ChunkWidth + ChunkWidth - 1 >= minZ;
+	}
+	bool intersectsRegion(int x, int z) const {
+		return x * 32 * ChunkWidth <= maxX && (x + 1) * 32 * ChunkWidth - 1 >= minX &&
+			   z * 32 * ChunkWidth <= maxZ && (z + 1) * 32 * ChunkWidth - 1 >= minZ;
+	}
+};
+
+// a block found by a BlockQuery, in global block coordinates
+struct BlockMatch {
+	int x, y, z;
+	uint16_t id;
+	uint8_t metadata;
+};
+
+// called for every block found by a BlockQuery
+typedef function<void(const BlockMatch &match)> BlockMatchCallback;
+
+// a set of block ids, searched in the Blocks (and Add) arrays of sections
+class BlockIdSet {
+	
+	public:
+		BlockIdSet(const vector<uint16_t> &ids) {
+			for (uint16_t id : ids) {
+				if (id >= BlockIdCount || m_bits[id])
+					continue;
+				m_bits[id] = true;
+				m_ids.push_back(id);
+				if (id < 256)
+					m_lowIds.push_back(static_cast<uint8_t>(id));
+			}
+		}
+	
+		bool contains(uint16_t id) const { return id < BlockIdCount && m_bits[id]; }
+		bool empty() const { return m_ids.empty(); }
+	
+		// appends to 'indices' the indices, from 'begin' to 'end' (excluded, multiples of 16), of the
+		// blocks of 'section' whose ids are in the set. 'ids' is a buffer of SectionVolume ids
+		void match(const SectionArrays &section, size_t begin, size_t end, vector<uint16_t> &indices, uint16_t *ids) const {
+			
+			if (!section.add) {
+				// without Add, the ids are the bytes: only the ids below 256 can be there
+				if (m_lowIds.empty())
+					return;
+#ifdef __SSE2__
+				if (m_lowIds.size() <= BlockIdSetSimdIds) {
+					__m128i wanted[BlockIdSetSimdIds];
+					for (size_t k = 0; k < m_lowIds.size(); k++)
+						wanted[k] = _mm_set1_epi8(static_cast<char>(m_lowIds[k]));
+					for (size_t i = begin; i < end; i += 16) {
+						__m128i blocks = _mm_loadu_si128(reinterpret_cast<const __m128i *>(section.blocks + i));
+						__m128i equal = _mm_cmpeq_epi8(blocks, wanted[0]);
+						for (size_t k = 1; k < m_lowIds.size(); k++)
+							equal = _mm_or_si128(equal, _mm_cmpeq_epi8(blocks, wanted[k]));
+						m_collect(_mm_movemask_epi8(equal), i, indices);
+					}
+					return;
+				}
+#endif // __SSE2__
+				for (size_t i = begin; i < end; i++)
+					if (m_bits[section.blocks[i]])
+						indices.push_back(static_cast<uint16_t>(i));
+				return;
+			}
+			
+			uint8_t highBits[SectionVolume];
+			unpackNibbles(section.add + begin / 2, highBits, end - begin);
+			combineBlockIds(section.blocks + begin, highBits, ids, end - begin);
+#ifdef __SSE2__
+			if (m_ids.size() <= BlockIdSetSimdIds) {
+				__m128i wanted[BlockIdSetSimdIds];
+				for (size_t k = 0; k < m_ids.size(); k++)
+					wanted[k] = _mm_set1_epi16(static_cast<short>(m_ids[k]));
+				for (size_t i = 0; i < end - begin; i += 16) {
+					__m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ids + i));
+					__m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ids + i + 8));
+					__m128i equalLow = _mm_cmpeq_epi16(low, wanted[0]), equalHigh = _mm_cmpeq_epi16(high, wanted[0]);
+					for (size_t k = 1; k < m_ids.size(); k++) {
+						equalLow = _mm_or_si128(equalLow, _mm_cmpeq_epi16(low, wanted[k]));
+						equalHigh = _mm_or_si128(equalHigh, _mm_cmpeq_epi16(high, wanted[k]));
+					}
+					// packed to one byte per id, the 16 ids of the two halves give one 16-bit mask
+					m_collect(_mm_movemask_epi8(_mm_packs_epi16(equalLow, equalHigh)), begin + i, indices);
+				}
+				return;
+			}
+#endif // __SSE2__
+			for (size_t i = 0; i < end - begin; i++)
+				if (m_bits[ids[i]])
+					indices.push_back(static_cast<uint16_t>(begin + i));
+		}
+	
+	private:
+		bitset<BlockIdCount> m_bits;
+		vector<uint16_t> m_ids;
+		vector<uint8_t> m_lowIds;
+	
+		// appends the indices of the bits of 'mask', the bit 0 being the block 'first'
+		static void m_collect(int mask, size_t first, vector<uint16_t> &indices) {
+			while (mask) {
+				indices.push_back(static_cast<uint16_t>(first + __builtin_ctz(mask)));
+				mask &= mask - 1;
+			}
+		}
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Finds the blocks of some ids in a box of a World, and streams their coordinates to a callback.
+ 
+ Only what intersects the box is read: the region files (through World::region(), so that they stay
+ open from a query to the next), the chunks of those files (the others are not even read, see
+ Region::forEachChunk()) and the layers of the sections. The sections are walked with a TagReader
+ (see forEachSection()), the rest of the chunks being skipped, and their Blocks arrays are compared
+ with the ids 16 blocks at a time with SSE2 (see BlockIdSet). The few blocks that match are then
+ checked against the box in X and Z, and reported.
+ 
+ The region files are searched in parallel. The matches of a chunk are reported together, by one
+ thread at a time: the callback does not need to be thread-safe, but must not run a query itself.
+ The matches come chunk by chunk, in no particular order between the chunks.
+ */
+class BlockQuery {
+	
+	public:
+		BlockQuery(World &world) : m_world(world), m_regions(0), m_chunks(0), m_sections(0), m_matches(0) {}
+	
+		// reports the blocks of the box whose ids are in 'ids', searching on 'threads' threads.
+		// Returns the number of blocks found
+		size_t run(const BlockBox &box, const vector<uint16_t> &ids, const BlockMatchCallback &found,
+				   size_t threads = thread::hardware_concurrency()) {
+			
+			m_regions = m_chunks = m_sections = m_matches = 0;
+			BlockIdSet wanted(ids);
+			if (box.empty() || wanted.empty() || box.maxY < 0 || box.minY >= ChunkHeight)
+				return 0;
+			
+			vector<RegionFile> files;
+			for (const RegionFile &file : listRegionFiles(m_world.directory()))
+				if (box.intersectsRegion(file.x, file.z))
+					files.push_back(file);
+			if (files.empty())
+				return 0;
+			
+			ThreadPool pool(min(threads ? threads : 1, files.size()));
+			for (const RegionFile &file : files)
+				pool.submit([this, file, &box, &wanted, &found] { m_searchRegion(file, box, wanted, found); });
+			pool.wait();
+			return m_matches;
+		}
+	
+		// the counters of the last run
+		size_t regions() const { return m_regions; }
+		size_t chunks() const { return m_chunks; }
+		size_t sections() const { return m_sections; } // the sections searched
+		size_t matches() const { return m_matches; }
+	
+	private:
+		World &m_world;
+		size_t m_regions, m_chunks, m_sections, m_matches;
+		mutex m_mutex; // guards the callback and the counters
+	
+		// non-copyable: the tasks of a run point to the query
+		BlockQuery(const BlockQuery &);
+		BlockQuery &operator=(const BlockQuery &);
+	
+		void m_searchRegion(const RegionFile &file, const BlockBox &box, const BlockIdSet &wanted, const BlockMatchCallback &found) {
+			
+			shared_ptr<Region> region = m_world.region(file.x, file.z);
+			if (!region) {
+				cerr << "[Warning] the region file " << file.path << " cannot be opened, it is not searched" << endl;
+				return;
+			}
+			
+			int minSection = max(box.minY, 0) / SectionHeight, maxSection = min(box.maxY, ChunkHeight - 1) / SectionHeight;
+			vector<uint16_t> indices;
+			vector<BlockMatch> matches;
+			unique_ptr<uint16_t[]> ids(new uint16_t[SectionVolume]);
+			size_t chunks = 0, sections = 0;
+			
+			region->forEachChunk([&](int x, int z, const memblock &data) {
+				
+				int chunkX = (file.x * 32 + x) * ChunkWidth, chunkZ = (file.z * 32 + z) * ChunkWidth;
+				matches.clear();
+				forEachSection(data.data(), data.size(), [&](const SectionArrays &section) {
+					
+					if (section.y < minSection || section.y > maxSection)
+						return true;
+					int base = section.y * SectionHeight;
+					size_t begin = static_cast<size_t>(max(box.minY - base, 0)) * ChunkWidth * ChunkWidth;
+					size_t end = static_cast<size_t>(min(box.maxY - base + 1, SectionHeight)) * ChunkWidth * ChunkWidth;
+					
+					indices.clear();
+					wanted.match(section, begin, end, indices, ids.get());
+					sections++;
+					
+					for (uint16_t i : indices) {
+						BlockMatch match;
+						match.x = chunkX + (i & 15);
+						match.y = base + (i >> 8);
+						match.z = chunkZ + ((i >> 4) & 15);
+						if (!box.contains(match.x, match.y, match.z))
+							continue;
+						match.id = section.add ? section.blocks[i] | (((section.add[i / 2] >> ((i & 1) * 4)) & 0x0F) << 8) : section.blocks[i];
+						match.metadata = section.data ? (section.data[i / 2] >> ((i & 1) * 4)) & 0x0F : 0;
+						matches.push_back(match);
+					}
+					return true;
+				});
+				chunks++;
+				
+				if (!matches.empty()) {
+					lock_guard<mutex> lock(m_mutex);
+					for (const BlockMatch &match : matches)
+						found(match);
+					m_matches += matches.size();
+				}
+			}, OrderSector, DefaultRunSectors, [&](int x, int z) {
+				return box.intersectsChunk(file.x * 32 + x, file.z * 32 + z);
+			});
+			
+			lock_guard<mutex> lock(m_mutex);
+			m_regions++;
+			m_chunks += chunks;
+			m_sections += sections;
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // BLOCKQUERY_H
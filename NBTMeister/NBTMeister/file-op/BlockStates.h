@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BLOCKSTATES_H
+#define BLOCKSTATES_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <iostream>
+#include "../tags/Single.h"
+#include "../tags/Array.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// the first data version (20w17a, 1.16) where a packed value never spans two longs
+const int NonSpanningDataVersion = 2527;
+
+// the way the indices are packed in a long array
+enum PackedLayout {
+	LayoutSpanning, // one after the other, a value may start in a long and end in the next (up to 1.15)
+	LayoutNonSpanning // as many values as fit in a long, the remaining high bits being unused (1.16 and later)
+};
+
+// the layout used by a chunk of the specified data version
+inline PackedLayout packedLayout(int dataVersion) {
+	return dataVersion >= NonSpanningDataVersion ? LayoutNonSpanning : LayoutSpanning;
+}
+
+// the number of bits per index for a palette of 'size' entries, at least 'minBits' (4 for the block states)
+inline int paletteBits(size_t size, int minBits = 4) {
+	int bits = 1;
+	while ((static_cast<size_t>(1) << bits) < size)
+		bits++;
+	return bits < minBits ? minBits : bits;
+}
+
+// the number of longs holding 'count' indices of 'bits' bits
+inline size_t packedLongs(size_t count, int bits, PackedLayout layout) {
+	if (layout == LayoutSpanning)
+		return (count * bits + 63) / 64;
+	size_t perLong = 64 / bits;
+	return (count + perLong - 1) / perLong;
+}
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Since 1.13, the blocks of a section are indices in a palette, packed in a TAG_Long_Array with the
+ smallest number of bits that can hold them: the index of the block i (y * 256 + z * 16 + x) is
+ made of the bits [i * bits, (i + 1) * bits) of the array, long 0 holding the bits 0 to 63 from its
+ least significant bit. Since 1.16, a value never spans two longs (see PackedLayout).
+ 
+ The unpacking loops are generated for every width from 1 to 16 bits (PackedCodec<Bits>): the shifts
+ and masks are constants, the inner loop of the non-spanning layout has a constant trip count, so
+ the compiler unrolls and vectorizes them instead of computing them for every value.
+ */
+template <int Bits>
+struct PackedCodec {
+	
+	static const uint64_t Mask = (static_cast<uint64_t>(1) << Bits) - 1;
+	static const int PerLong = 64 / Bits;
+	
+	static void unpack(const uint64_t *longs, size_t longCount, uint16_t *out, size_t count, PackedLayout layout) {
+		
+		if (layout == LayoutNonSpanning) {
+			size_t full = count / PerLong, i = 0;
+			if (full > longCount)
+				full = longCount;
+			for (size_t l = 0; l < full; l++) {
+				uint64_t word = longs[l];
+				for (int k = 0; k < PerLong; k++)
+					out[l * PerLong + k] = static_cast<uint16_t>((word >> (k * Bits)) & Mask);
+			}
+			for (i = full * PerLong; i < count && i / PerLong < longCount; i++)
+				out[i] = static_cast<uint16_t>((longs[i / PerLong] >> ((i % PerLong) * Bits)) & Mask);
+			for (; i < count; i++)
+				out[i] = 0; // the array is too short
+			return;
+		}
+		
+		for (size_t i = 0; i < count; i++) {
+			size_t bit = i * Bits, word = bit / 64;
+			int shift = bit % 64;
+			if (word >= longCount) {
+				out[i] = 0;
+				continue;
+			}
+			uint64_t value = longs[word] >> shift;
+			if (shift + Bits > 64 && word + 1 < longCount)
+				value |= longs[word + 1] << (64 - shift); // the value continues in the next long
+			out[i] = static_cast<uint16_t>(value & Mask);
+		}
+	}
+	
+	static void pack(const uint16_t *in, size_t count, uint64_t *longs, PackedLayout layout) {
+		
+		if (layout == LayoutNonSpanning) {
+			for (size_t i = 0; i < count; i++)
+				longs[i / PerLong] |= (static_cast<uint64_t>(in[i]) & Mask) << ((i % PerLong) * Bits);
+			return;
+		}
+		
+		for (size_t i = 0; i < count; i++) {
+			size_t bit = i * Bits, word = bit / 64;
+			int shift = bit % 64;
+			uint64_t value = static_cast<uint64_t>(in[i]) & Mask;
+			longs[word] |= value << shift;
+			if (shift + Bits > 64)
+				longs[word + 1] |= value >> (64 - shift);
+		}
+	}
+};
+
+// expands 'count' indices of 'bits' bits (1 to 16) packed in 'longs' into 'out'.
+// The indices that are missing from a too short array are 0. Returns false if 'bits' is invalid
+inline bool unpackIndices(const uint64_t *longs, size_t longCount, int bits, uint16_t *out, size_t count, PackedLayout layout) {
+	
+	switch (bits) {
+		case 1: PackedCodec<1>::unpack(longs, longCount, out, count, layout); return true;
+		case 2: PackedCodec<2>::unpack(longs, longCount, out, count, layout); return true;
+		case 3: PackedCodec<3>::unpack(longs, longCount, out, count, layout); return true;
+		case 4: PackedCodec<4>::unpack(longs, longCount, out, count, layout); return true;
+		case 5: PackedCodec<5>::unpack(longs, longCount, out, count, layout); return true;
+		case 6: PackedCodec<6>::unpack(longs, longCount, out, count, layout); return true;
+		case 7: PackedCodec<7>::unpack(longs, longCount, out, count, layout); return true;
+		case 8: PackedCodec<8>::unpack(longs, longCount, out, count, layout); return true;
+		case 9: PackedCodec<9>::unpack(longs, longCount, out, count, layout); return true;
+		case 10: PackedCodec<10>::unpack(longs, longCount, out, count, layout); return true;
+		case 11: PackedCodec<11>::unpack(longs, longCount, out, count, layout); return true;
+		case 12: PackedCodec<12>::unpack(longs, longCount, out, count, layout); return true;
+		case 13: PackedCodec<13>::unpack(longs, longCount, out, count, layout); return true;
+		case 14: PackedCodec<14>::unpack(longs, longCount, out, count, layout); return true;
+		case 15: PackedCodec<15>::unpack(longs, longCount, out, count, layout); return true;
+		case 16: PackedCodec<16>::unpack(longs, longCount, out, count, layout); return true;
+		default:
+			cerr << "[Error] cannot unpack indices of " << bits << " bits" << endl;
+			return false;
+	}
+}
+
+// packs 'count' indices into 'longs' (resized to packedLongs()), with 'bits' bits (1 to 16) per index
+inline bool packIndices(const uint16_t *in, size_t count, int bits, vector<uint64_t> &longs, PackedLayout layout) {
+	
+	if (bits < 1 || bits > 16) {
+		cerr << "[Error] cannot pack indices of " << bits << " bits" << endl;
+		return false;
+	}
+	longs.assign(packedLongs(count, bits, layout), 0);
+	switch (bits) {
+		case 1: PackedCodec<1>::pack(in, count, longs.data(), layout); break;
+		case 2: PackedCodec<2>::pack(in, count, longs.data(), layout); break;
+		case 3: PackedCodec<3>::pack(in, count, longs.data(), layout); break;
+		case 4: PackedCodec<4>::pack(in, count, longs.data(), layout); break;
+		case 5: PackedCodec<5>::pack(in, count, longs.data(), layout); break;
+		case 6: PackedCodec<6>::pack(in, count, longs.data(), layout); break;
+		case 7: PackedCodec<7>::pack(in, count, longs.data(), layout); break;
+		case 8: PackedCodec<8>::pack(in, count, longs.data(), layout); break;
+		case 9: PackedCodec<9>::pack(in, count, longs.data(), layout); break;
+		case 10: PackedCodec<10>::pack(in, count, longs.data(), layout); break;
+		case 11: PackedCodec<11>::pack(in, count, longs.data(), layout); break;
+		case 12: PackedCodec<12>::pack(in, count, longs.data(), layout); break;
+		case 13: PackedCodec<13>::pack(in, count, longs.data(), layout); break;
+		case 14: PackedCodec<14>::pack(in, count, longs.data(), layout); break;
+		case 15: PackedCodec<15>::pack(in, count, longs.data(), layout); break;
+		default: PackedCodec<16>::pack(in, count, longs.data(), layout); break;
+	}
+	return true;
+}
+
+// the payload of a TAG_Long_Array as plain 64-bit words
+inline vector<uint64_t> longArrayWords(const vector<SINGLE_GETLONG> &array) {
+	vector<uint64_t> words(array.size());
+	for (size_t i = 0; i < array.size(); i++)
+		words[i] = static_cast<uint64_t>(static_cast<int64_t>(array[i]));
+	return words;
+}
+
+// the payload of a TAG_Long_Array holding 'words'
+inline vector<SINGLE_GETLONG> longArrayPayload(const vector<uint64_t> &words) {
+	vector<SINGLE_GETLONG> array(words.size());
+	for (size_t i = 0; i < words.size(); i++)
+		array[i] = SINGLE_LONG(static_cast<int64_t>(words[i]));
+	return array;
+}
+
+/*
+ The blocks of a paletted section (1.13 and later), the palette being reduced to the names of the
+ blocks. Both the 1.13 layout (Palette and BlockStates in the section) and the 1.18 one (palette
+ and data in the block_states compound) are read. A palette of a single entry has no data: the
+ whole section is made of that block.
+ */
+struct PalettedSection {
+	PalettedSection() : y(0), indices(4096, 0) {}
+	
+	int y;
+	vector<string> palette; // the Name of every entry
+	vector<uint16_t> indices; // 4096 indices in 'palette', by (y * 256 + z * 16 + x)
+	
+	const string &block(int x, int y, int z) const { return palette[indices[y * 256 + z * 16 + x]]; }
+	
+	// reads a section compound. Returns false if it has no palette or if its data is invalid
+	bool decode(Array *section, PackedLayout layout) {
+		
+		palette.clear();
+		fill(indices.begin(), indices.end(), 0);
+		
+		Tag *yTag = section->tag("Y");
+		if (yTag && yTag->qualificator() == QSingle && static_cast<Single *>(yTag)->tagType() == TagTypeByte)
+			y = static_cast<int8_t>(static_cast<Single *>(yTag)->toByte());
+		
+		Array *container = section;
+		Tag *paletteTag = section->tag("Palette"), *dataTag = section->tag("BlockStates");
+		Tag *blockStates = section->tag("block_states");
+		if (!paletteTag && blockStates && blockStates->qualificator() == QArray) {
+			container = static_cast<Array *>(blockStates);
+			paletteTag = container->tag("palette");
+			dataTag = container->tag("data");
+		}
+		if (!paletteTag || paletteTag->qualificator() != QArray)
+			return false;
+		
+		Array *entries = static_cast<Array *>(paletteTag);
+		for (size_t i = 0; i < entries->size(); i++) {
+			Tag *entry = entries->tag(i);
+			Tag *name = entry->qualificator() == QArray ? static_cast<Array *>(entry)->tag("Name") : nullptr;
+			if (name && name->qualificator() == QSingle && static_cast<Single *>(name)->tagType() == TagTypeString)
+				palette.push_back(static_cast<Single *>(name)->toString());
+			else palette.push_back(string());
+		}
+		if (palette.empty())
+			return false;
+		if (palette.size() == 1 && !dataTag)
+			return true;
+		if (!dataTag || dataTag->qualificator() != QSingle || static_cast<Single *>(dataTag)->tagType() != TagTypeLongArray)
+			return false;
+		
+		vector<uint64_t> words = longArrayWords(static_cast<Single *>(dataTag)->toLongArray());
+		
+		// the width is the one of the palette, but the data says better (a palette may hold unused entries)
+		int bits = paletteBits(palette.size());
+		for (int candidate = 4; candidate <= 16 && words.size() != packedLongs(indices.size(), bits, layout); candidate++)
+			bits = candidate;
+		if (words.size() != packedLongs(indices.size(), bits, layout) || !unpackIndices(words.data(), words.size(), bits, indices.data(), indices.size(), layout))
+			return false;
+		
+		for (uint16_t index : indices)
+			if (index >= palette.size())
+				return false;
+		return true;
+	}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // BLOCKSTATES_H
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <vector>
+#include "Parser.h"
+#include "StreamParser.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ The buffers and parsers needed to decode a chunk, kept from one chunk to the next so that a
+ scan does not allocate (and page-fault) a new 64 KiB+ buffer and a new parser for every chunk.
+ There is one set per thread, obtained with workerBuffers(): nothing is shared, so nothing is locked.
+ 
+ A buffer is only valid until the next chunk is decoded by the same thread. Copy what you want to keep.
+ */
+struct WorkerBuffers {
+	memblock compressed; // the payload of a chunk, as read from the file
+	memblock decompressed; // the NBT data of a chunk
+	Parser parser;
+	StreamParser streamParser;
+	
+	// gives back the memory of the buffers that grew beyond 'maxBytes', after an unusually big chunk
+	void trim(size_t maxBytes = 4 * 1024 * 1024) {
+		if (compressed.capacity() > maxBytes)
+			memblock().swap(compressed);
+		if (decompressed.capacity() > maxBytes)
+			memblock().swap(decompressed);
+	}
+};
+
+// the buffers of the calling thread
+inline WorkerBuffers &workerBuffers() {
+	static thread_local WorkerBuffers buffers;
+	return buffers;
+}
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // BUFFERPOOL_H
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CHUNKBLOCKS_H
+#define CHUNKBLOCKS_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <memory>
+#include <algorithm>
+#include <iostream>
+#include <functional>
+#include "Parser.h"
+#include "TagReader.h"
+#include "../tags/Single.h"
+#include "../tags/Array.h"
+#include "../config.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// the dimensions of a chunk, in blocks
+const int ChunkWidth = 16;
+const int ChunkHeight = 256;
+const int SectionHeight = 16;
+const int SectionCount = ChunkHeight / SectionHeight;
+const int SectionVolume = ChunkWidth * ChunkWidth * SectionHeight; // 4096
+const int ChunkVolume = SectionVolume * SectionCount; // 65536
+
+// the number of distinct block ids (Blocks + Add: 12 bits)
+const int BlockIdCount = 4096;
+
+// the byte arrays of the payloads are read as plain bytes
+static_assert(sizeof(SINGLE_GETBYTE) == 1, "a byte array payload must be an array of bytes");
+
+// unpacks 'count' 4-bit values (an even number), the low nibble of each byte first: 'out' receives
+// 'count' bytes. This is the layout of the Data, Add, BlockLight and SkyLight arrays of a section
+inline void unpackNibbles(const uint8_t *packed, uint8_t *out, size_t count) {
+	
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	for (; i + 32 <= count; i += 32) {
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(packed + i / 2));
+		__m128i low = _mm_and_si128(bytes, mask);
+		__m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+		// interleaving the low and the high nibbles gives them in the order of the blocks
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_unpacklo_epi8(low, high));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 16), _mm_unpackhi_epi8(low, high));
+	}
+#endif // __SSE2__
+	for (; i < count; i += 2) {
+		uint8_t byte = packed[i / 2];
+		out[i] = byte & 0x0F;
+		out[i + 1] = byte >> 4;
+	}
+}
+
+// builds 12-bit block ids from the 8 low bits of 'blocks' and the 4 high bits of 'add' (unpacked,
+// one byte per block, see unpackNibbles()). 'add' may be null: the ids are then the bytes of 'blocks'
+inline void combineBlockIds(const uint8_t *blocks, const uint8_t *add, uint16_t *ids, size_t count) {
+	
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= count; i += 16) {
+		__m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(blocks + i));
+		__m128i high = add ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(add + i)) : zero;
+		// interleaved, the bytes of 'blocks' and 'add' are the little-endian 16-bit ids
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(ids + i), _mm_unpacklo_epi8(low, high));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(ids + i + 8), _mm_unpackhi_epi8(low, high));
+	}
+#endif // __SSE2__
+	for (; i < count; i++)
+		ids[i] = blocks[i] | (add ? add[i] << 8 : 0);
+}
+
+// the arrays of a section, pointing into the data of its chunk. 'add' and 'data' are null if
+// the section has none; a section without 'blocks' (of a newer format) is not visited
+struct SectionArrays {
+	SectionArrays() : y(-1), blocks(nullptr), add(nullptr), data(nullptr) {}
+	
+	int y;
+	const uint8_t *blocks; // SectionVolume bytes
+	const uint8_t *add; // SectionVolume / 2 bytes
+	const uint8_t *data; // SectionVolume / 2 bytes
+};
+
+// called for every section of a chunk; returning false stops the walk
+typedef function<bool(const SectionArrays &section)> SectionVisitor;
+
+// visits the sections of a chunk from its decompressed NBT data, reading only their Y, Blocks, Add
+// and Data tags (see TagReader): the rest of the chunk is skipped without being decoded. The sections
+// come in the order of the file. Returns false if the chunk is malformed or has no Level.Sections list;
+// 'skipped' (if not null) receives the number of sections that were not visited
+inline bool forEachSection(const char *chunk, size_t size, const SectionVisitor &visitor, size_t *skipped = nullptr) {
+	
+	TagReader reader(chunk, size);
+	TagType type;
+	TagName name;
+	if (skipped)
+		*skipped = 0;
+	if (!reader.enterRoot() || !reader.seek("Level", TagTypeCompound) || !reader.seek("Sections", TagTypeList))
+		return false;
+	
+	TagType elementType;
+	int32_t length;
+	if (!reader.readListHeader(elementType, length))
+		return false;
+	if (length == 0)
+		return true;
+	if (elementType != TagTypeCompound)
+		return false;
+	
+	for (int32_t i = 0; i < length; i++) {
+		
+		SectionArrays section;
+		while (reader.next(type, name)) {
+			
+			const uint8_t *bytes;
+			int32_t count;
+			if (type == TagTypeByte && name == "Y") {
+				int8_t y;
+				if (!reader.readValue(y))
+					return false;
+				section.y = y;
+			}
+			else if (type == TagTypeByteArray && (name == "Blocks" || name == "Add" || name == "Data")) {
+				if (!reader.readByteArray(bytes, count))
+					return false;
+				if (name == "Blocks")
+					section.blocks = count == SectionVolume ? bytes : nullptr;
+				else if (name == "Add")
+					section.add = count == SectionVolume / 2 ? bytes : nullptr;
+				else
+					section.data = count == SectionVolume / 2 ? bytes : nullptr;
+			}
+			else if (!reader.skip(type))
+				return false;
+		}
+		if (reader.status() != good)
+			return false;
+		
+		if (section.y < 0 || section.y >= SectionCount || !section.blocks) {
+			if (skipped)
+				(*skipped)++;
+			continue;
+		}
+		if (!visitor(section))
+			return true;
+	}
+	return true;
+}
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ The blocks of an Anvil chunk, as one dense 16x256x16 volume: the block (x, y, z) is at the index
+ (y * 256 + z * 16 + x), like in the sections, so a section is simply copied to its place.
+ 
+ A chunk holds its blocks in the list Level.Sections, a section being 16 blocks high with:
+ 	- Y: its position, from 0 (bottom) to 15;
+ 	- Blocks: 4096 bytes, the 8 low bits of the ids;
+ 	- Add (optional): 2048 bytes, the 4 high bits of the ids, as nibbles;
+ 	- Data: 2048 bytes, the metadata, as nibbles.
+ The nibbles of a byte are the ones of two consecutive blocks, the low nibble first.
+ 
+ The missing sections are made of air (id 0). The nibbles are unpacked with SSE2 when it is
+ available (see unpackNibbles() and combineBlockIds()), with plain code otherwise.
+ */
+class BlockVolume {
+	
+	public:
+		BlockVolume() : m_ids(ChunkVolume, 0), m_metadata(ChunkVolume, 0), m_sections(0) {}
+	
+		static int index(int x, int y, int z) { return y * 256 + z * 16 + x; }
+	
+		uint16_t id(int x, int y, int z) const { return m_ids[index(x, y, z)]; }
+		uint8_t metadata(int x, int y, int z) const { return m_metadata[index(x, y, z)]; }
+	
+		// the whole volume, by index()
+		const uint16_t *ids() const { return m_ids.data(); }
+		const uint8_t *metadata() const { return m_metadata.data(); }
+	
+		// a bit for every section present in the chunk, bit 0 being the bottom section
+		uint16_t sections() const { return m_sections; }
+		bool hasSection(int y) const { return (m_sections >> y) & 1; }
+	
+		// fills the volume with air
+		void clear() {
+			fill(m_ids.begin(), m_ids.end(), 0);
+			fill(m_metadata.begin(), m_metadata.end(), 0);
+			m_sections = 0;
+		}
+	
+		// decodes the blocks of a parsed chunk (the root compound of the chunk). Returns false
+		// if the chunk has no Level.Sections list; the sections that are malformed are skipped
+		bool decode(Tag *chunk) {
+			
+			clear();
+			Array *root = m_compound(chunk);
+			Array *level = root ? m_compound(root->tag("Level")) : nullptr;
+			Tag *sections = level ? level->tag("Sections") : nullptr;
+			if (!sections || sections->qualificator() != QArray) {
+				cerr << "[Error] the chunk has no Level.Sections list" << endl;
+				return false;
+			}
+			
+			Array *list = static_cast<Array *>(sections);
+			for (size_t i = 0; i < list->size(); i++) {
+				Array *section = m_compound(list->tag(i));
+				if (!section || !m_decodeSection(section))
+					cerr << "[Warning] a section of the chunk is malformed, it is skipped" << endl;
+			}
+			return true;
+		}
+	
+		// decodes the blocks of a chunk from its decompressed NBT data, without building its tree (see
+		// forEachSection()). Returns false if the chunk is malformed or has no Level.Sections list
+		bool decode(const char *data, size_t size) {
+			
+			clear();
+			size_t skipped = 0;
+			bool walked = forEachSection(data, size, [this](const SectionArrays &section) {
+				m_copySection(section.y, section.blocks, section.add, section.data);
+				return true;
+			}, &skipped);
+			if (skipped)
+				cerr << "[Warning] " << skipped << " section(s) of the chunk are malformed, they are skipped" << endl;
+			return walked;
+		}
+	
+	private:
+		vector<uint16_t> m_ids;
+		vector<uint8_t> m_metadata;
+		uint16_t m_sections;
+	
+		// 't' if it is a compound, nullptr otherwise
+		static Array *m_compound(Tag *t) {
+			return t && t->qualificator() == QArray && static_cast<Array *>(t)->arrayType() == Compound ? static_cast<Array *>(t) : nullptr;
+		}
+	
+		// the bytes of the byte array 'name' of 'compound' if it holds exactly 'size' bytes, nullptr otherwise
+		static const uint8_t *m_bytes(Array *compound, const string &name, size_t size) {
+			
+			Tag *t = compound->tag(name);
+			if (!t || t->qualificator() != QSingle || static_cast<Single *>(t)->tagType() != TagTypeByteArray)
+				return nullptr;
+			
+			const vector<SINGLE_GETBYTE> &bytes = static_cast<Single *>(t)->toByteArray();
+			return bytes.size() == size ? reinterpret_cast<const uint8_t *>(bytes.data()) : nullptr;
+		}
+	
+		bool m_decodeSection(Array *section) {
+			
+			Tag *yTag = section->tag("Y");
+			if (!yTag || yTag->qualificator() != QSingle || static_cast<Single *>(yTag)->tagType() != TagTypeByte)
+				return false;
+			int y = static_cast<int8_t>(static_cast<Single *>(yTag)->toByte());
+			
+			const uint8_t *blocks = m_bytes(section, "Blocks", SectionVolume);
+			const uint8_t *add = m_bytes(section, "Add", SectionVolume / 2);
+			const uint8_t *data = m_bytes(section, "Data", SectionVolume / 2);
+			if (y < 0 || y >= SectionCount || !blocks)
+				return false;
+			
+			m_copySection(y, blocks, add, data);
+			return true;
+		}
+	
+		// copies a section to its place in the volume
+		void m_copySection(int y, const uint8_t *blocks, const uint8_t *add, const uint8_t *data) {
+			
+			size_t begin = static_cast<size_t>(y) * SectionVolume;
+			uint8_t highBits[SectionVolume];
+			if (add)
+				unpackNibbles(add, highBits, SectionVolume);
+			combineBlockIds(blocks, add ? highBits : nullptr, &m_ids[begin], SectionVolume);
+			if (data)
+				unpackNibbles(data, &m_metadata[begin], SectionVolume);
+			
+			m_sections |= 1 << y;
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // CHUNKBLOCKS_H
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CHUNKCACHE_H
+#define CHUNKCACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <unordered_map>
+#include "Parser.h"
+#include "Codec.h"
+#include "../tags/TagTypes.h"
+#include "../tags/Tag.h"
+#include "../tags/Single.h"
+#include "../tags/Array.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// a parsed chunk, shared between the cache and its users: an evicted tree lives as long as someone uses it
+typedef shared_ptr<Tag> ChunkTree;
+
+// default memory budget of a chunk cache
+const size_t DefaultChunkCacheBudget = 256 * 1024 * 1024;
+
+// the key of the chunk (x, z) in the caches
+inline uint64_t chunkKey(int x, int z) {
+	return (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32) | static_cast<uint32_t>(z);
+}
+
+// an estimation of the memory used by a tree: the tags, their names and their payloads
+inline size_t tagMemory(Tag *tag) {
+	
+	size_t bytes = tag->name().capacity();
+	if (tag->qualificator() == QSingle) {
+		Single *single = static_cast<Single *>(tag);
+		bytes += sizeof(Single);
+		switch (single->tagType()) {
+			case TagTypeByteArray:
+				bytes += single->toByteArray().capacity() * sizeof(SINGLE_GETBYTE);
+				break;
+			case TagTypeIntArray:
+				bytes += single->toIntArray().capacity() * sizeof(SINGLE_GETINT);
+				break;
+			case TagTypeLongArray:
+				bytes += single->toLongArray().capacity() * sizeof(SINGLE_GETLONG);
+				break;
+			case TagTypeString:
+				bytes += single->toString().capacity();
+				break;
+			default: break;
+		}
+		return bytes;
+	}
+	
+	Array *array = static_cast<Array *>(tag);
+	bytes += sizeof(Array) + array->size() * sizeof(Tag *);
+	for (size_t i = 0; i < array->size(); i++)
+		bytes += tagMemory(array->tag(i));
+	return bytes;
+}
+
+// the residency levels of a chunk in the cache, from the biggest and fastest to use to the smallest
+enum ChunkTier {
+	TierParsed, // the tree, plus the data of the lower tiers
+	TierDecompressed, // the NBT data, plus the compressed data
+	TierCompressed, // the payload of the chunk, as it is in the region file
+	ChunkTierCount
+};
+
+// a chunk held by the cache. The forms that are not resident are null
+struct CachedChunk {
+	CachedChunk() : tier(ChunkTierCount), compressionType(CompressionZlib) {}
+	
+	ChunkTier tier; // the highest form available, ChunkTierCount if none
+	uint8_t compressionType; // of 'compressed'
+	shared_ptr<const memblock> compressed;
+	shared_ptr<const memblock> decompressed;
+	ChunkTree tree;
+	
+	// sets 'tier' from the forms that are available
+	void updateTier() {
+		tier = tree ? TierParsed : decompressed ? TierDecompressed : compressed ? TierCompressed : ChunkTierCount;
+	}
+};
+
+// what happened in a cache since its creation
+struct ChunkCacheCounters {
+	ChunkCacheCounters() : misses(0), promotions(0), demotions(0), evictions(0) {
+		for (int tier = 0; tier < ChunkTierCount; tier++)
+			tierHits[tier] = 0;
+	}
+	
+	uint64_t tierHits[ChunkTierCount]; // the chunk was found, in this tier
+	uint64_t misses; // the chunk was not in the cache at all
+	uint64_t promotions; // a chunk moved up to a bigger form
+	uint64_t demotions; // a chunk moved down to a smaller form, to respect the budget of its tier
+	uint64_t evictions; // a chunk left the cache, to respect the budget of the compressed tier
+	
+	uint64_t hits() const { return tierHits[TierParsed] + tierHits[TierDecompressed] + tierHits[TierCompressed]; }
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ A cache of chunks with three residency levels (see ChunkTier). A parsed tree costs several times the
+ memory of the compressed bytes, so instead of being evicted, a cold chunk is demoted to a smaller form,
+ and it is promoted back when it is used again (the caller decompresses and parses it, outside of the lock).
+ Only the chunks that are too cold even for the compressed tier leave the cache.
+ 
+ Each tier has its own budget and accounting, and its own least-recently-used list, the most recent first.
+ A chunk is in exactly one list, the one of its highest form, and is indexed by chunkKey() in a hash map.
+ A chunk keeps its smaller forms: a demotion only drops data, it never compresses anything and never
+ takes long. The cost of a chunk in its tier is the memory of everything it holds (see tagMemory()).
+ 
+ The cache can be used by several threads at once.
+ */
+class ChunkCache {
+	
+	public:
+		// 'budget' is shared between the tiers: a quarter for the parsed chunks, a quarter for
+		// the decompressed ones and a half for the compressed ones
+		ChunkCache(size_t budget = DefaultChunkCacheBudget) {
+			for (int tier = 0; tier < ChunkTierCount; tier++)
+				m_memory[tier] = 0;
+			m_split(budget);
+		}
+	
+		// looks for the chunk (x, z). Returns false if it is not cached. 'chunk' receives the
+		// resident forms of the chunk: the caller is expected to promote it if it needs a bigger one.
+		// A lookup that is not a 'use' (a prefetch) is neither counted nor changes the eviction order
+		bool find(int x, int z, CachedChunk &chunk, bool use = true) {
+			
+			lock_guard<mutex> lock(m_mutex);
+			auto found = m_index.find(chunkKey(x, z));
+			if (found == m_index.end()) {
+				if (use)
+					m_counters.misses++;
+				return false;
+			}
+			
+			Entry &entry = *found->second;
+			if (use) {
+				m_counters.tierHits[entry.chunk.tier]++;
+				list<Entry> &tier = m_tiers[entry.chunk.tier];
+				tier.splice(tier.begin(), tier, found->second); // most recently used
+			}
+			chunk = entry.chunk;
+			return true;
+		}
+	
+		// the tier of the chunk (x, z), ChunkTierCount if it is not cached
+		ChunkTier tier(int x, int z) const {
+			lock_guard<mutex> lock(m_mutex);
+			auto found = m_index.find(chunkKey(x, z));
+			return found == m_index.end() ? ChunkTierCount : found->second->chunk.tier;
+		}
+	
+		// caches the chunk (x, z), or promotes it if it is cached in a smaller form, and returns
+		// its tree. If another thread cached a form at least as big in the meantime, it is kept
+		ChunkTree insert(int x, int z, const CachedChunk &chunk) {
+			
+			CachedChunk added = chunk;
+			added.updateTier();
+			if (added.tier == ChunkTierCount)
+				return ChunkTree();
+			size_t treeCost = added.tree ? tagMemory(added.tree.get()) : 0; // computed outside of the lock
+			
+			lock_guard<mutex> lock(m_mutex);
+			uint64_t key = chunkKey(x, z);
+			auto found = m_index.find(key);
+			
+			if (found == m_index.end()) {
+				m_tiers[added.tier].push_front(Entry(key, added, treeCost));
+				m_index[key] = m_tiers[added.tier].begin();
+				m_memory[added.tier] += m_tiers[added.tier].front().cost();
+			}
+			else {
+				Entry &entry = *found->second;
+				if (entry.chunk.tier <= added.tier)
+					return entry.chunk.tree;
+				
+				// a promotion: the forms already resident are kept
+				if (!added.compressed) {
+					added.compressed = entry.chunk.compressed;
+					added.compressionType = entry.chunk.compressionType;
+				}
+				if (!added.decompressed)
+					added.decompressed = entry.chunk.decompressed;
+				
+				m_memory[entry.chunk.tier] -= entry.cost();
+				list<Entry> &from = m_tiers[entry.chunk.tier];
+				m_tiers[added.tier].splice(m_tiers[added.tier].begin(), from, found->second);
+				entry.chunk = added;
+				entry.treeCost = treeCost;
+				m_memory[added.tier] += entry.cost();
+				m_counters.promotions++;
+			}
+			
+			m_shrink();
+			return added.tree;
+		}
+	
+		// forgets the chunk (x, z), after it has been modified
+		void erase(int x, int z) {
+			
+			lock_guard<mutex> lock(m_mutex);
+			auto found = m_index.find(chunkKey(x, z));
+			if (found == m_index.end())
+				return;
+			ChunkTier tier = found->second->chunk.tier;
+			m_memory[tier] -= found->second->cost();
+			m_tiers[tier].erase(found->second);
+			m_index.erase(found);
+		}
+	
+		void clear() {
+			lock_guard<mutex> lock(m_mutex);
+			for (int tier = 0; tier < ChunkTierCount; tier++) {
+				m_tiers[tier].clear();
+				m_memory[tier] = 0;
+			}
+			m_index.clear();
+		}
+	
+		// changing a budget demotes or evicts the chunks that do not fit anymore
+		void setBudget(size_t budget) {
+			lock_guard<mutex> lock(m_mutex);
+			m_split(budget);
+			m_shrink();
+		}
+		void setBudget(ChunkTier tier, size_t budget) {
+			lock_guard<mutex> lock(m_mutex);
+			m_budget[tier] = budget;
+			m_shrink();
+		}
+	
+		size_t budget(ChunkTier tier) const { lock_guard<mutex> lock(m_mutex); return m_budget[tier]; }
+		size_t memory(ChunkTier tier) const { lock_guard<mutex> lock(m_mutex); return m_memory[tier]; }
+		size_t size(ChunkTier tier) const { lock_guard<mutex> lock(m_mutex); return m_tiers[tier].size(); }
+		size_t memory() const { lock_guard<mutex> lock(m_mutex); return m_memory[TierParsed] + m_memory[TierDecompressed] + m_memory[TierCompressed]; }
+		size_t size() const { lock_guard<mutex> lock(m_mutex); return m_index.size(); }
+		ChunkCacheCounters counters() const { lock_guard<mutex> lock(m_mutex); return m_counters; }
+	
+	private:
+		struct Entry {
+			Entry(uint64_t k, const CachedChunk &c, size_t t) : key(k), chunk(c), treeCost(t) {}
+			
+			uint64_t key;
+			CachedChunk chunk;
+			size_t treeCost; // tagMemory() of the tree, 0 if there is none
+			
+			// the memory held by the chunk
+			size_t cost() const {
+				return treeCost + (chunk.decompressed ? chunk.decompressed->capacity() : 0) +
+					   (chunk.compressed ? chunk.compressed->capacity() : 0);
+			}
+		};
+	
+		size_t m_budget[ChunkTierCount];
+		size_t m_memory[ChunkTierCount];
+		list<Entry> m_tiers[ChunkTierCount]; // the chunks of each tier, the most recently used first
+		unordered_map<uint64_t, list<Entry>::iterator> m_index;
+		ChunkCacheCounters m_counters;
+		mutable mutex m_mutex;
+	
+		void m_split(size_t budget) {
+			m_budget[TierParsed] = budget / 4;
+			m_budget[TierDecompressed] = budget / 4;
+			m_budget[TierCompressed] = budget - 2 * (budget / 4);
+		}
+	
+		// demotes the least recently used chunks of each tier until it fits in its budget, from the
+		// biggest tier to the smallest so that the demoted chunks are accounted in their new tier
+		void m_shrink() {
+			
+			for (int tier = 0; tier < ChunkTierCount; tier++) {
+				
+				list<Entry> &from = m_tiers[tier];
+				while (m_memory[tier] > m_budget[tier] && !from.empty()) {
+					
+					list<Entry>::iterator last = prev(from.end());
+					Entry &entry = *last;
+					m_memory[tier] -= entry.cost();
+					
+					// we drop the biggest form
+					if (entry.chunk.tree) {
+						entry.chunk.tree.reset();
+						entry.treeCost = 0;
+					}
+					else if (entry.chunk.decompressed)
+						entry.chunk.decompressed.reset();
+					else entry.chunk.compressed.reset();
+					entry.chunk.updateTier();
+					
+					if (entry.chunk.tier == ChunkTierCount) {
+						m_index.erase(entry.key);
+						from.erase(last);
+						m_counters.evictions++;
+						continue;
+					}
+					
+					m_tiers[entry.chunk.tier].splice(m_tiers[entry.chunk.tier].begin(), from, last);
+					m_memory[entry.chunk.tier] += entry.cost();
+					m_counters.demotions++;
+				}
+			}
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // CHUNKCACHE_H
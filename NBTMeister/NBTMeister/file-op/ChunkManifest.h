@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CHUNKMANIFEST_H
+#define CHUNKMANIFEST_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <iostream>
+#include <functional>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Codec.h"
+#include "RegionHeader.h"
+#include "RegionFiles.h"
+#include "RegionWriter.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// 64-bit FNV-1a hash, used to tell if the compressed bytes of a chunk have changed
+inline uint64_t hashBytes(const char *data, size_t size) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= static_cast<uint8_t>(data[i]);
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// what we knew about a chunk the last time it was visited
+struct ManifestEntry {
+	ManifestEntry() : timestamp(0), offset(0), hash(0) {}
+	
+	uint32_t timestamp;
+	uint32_t offset; // in sectors
+	uint64_t hash; // of the compressed bytes
+	
+	bool empty() const { return offset == 0; } // no chunk can start in the header
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ A persistent record of the chunks seen by a previous scan, keyed by the name of the region
+ file and the index of the chunk in the location table. The file names are stored without
+ their directory, so a world can be moved without invalidating its manifest.
+ 
+ The file format is binary, every integer being big-endian:
+ 
+ 	"NBTMMAN1"
+ 	int regionCount
+ 	for each region:	short nameLength, name, short entryCount
+ 						for each entry: short index, int timestamp, int offset, int hashHigh, int hashLow
+ */
+class ChunkManifest {
+	
+	public:
+		ChunkManifest() : m_regions() {}
+	
+		// returns false if the file cannot be read or is not a manifest. A missing file gives an empty manifest
+		bool load(const string &path) {
+			
+			m_regions.clear();
+			
+			ifstream infile(path, ios::binary);
+			if (!infile.good())
+				return true;
+			
+			memblock data((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+			size_t cursor = 0;
+			
+			if (data.size() < 12 || string(data.data(), 8) != "NBTMMAN1") {
+				cerr << "[Error] " << path << " is not a chunk manifest" << endl;
+				return false;
+			}
+			cursor = 8;
+			
+			uint32_t regionCount = m_read(data, cursor, 4);
+			for (uint32_t r = 0; r < regionCount && cursor < data.size(); r++) {
+				
+				uint32_t nameLength = m_read(data, cursor, 2);
+				if (cursor + nameLength > data.size())
+					break;
+				string name(data.data() + cursor, nameLength);
+				cursor += nameLength;
+				
+				vector<ManifestEntry> &entries = m_regions[name];
+				entries.assign(RegionChunkCount, ManifestEntry());
+				
+				uint32_t entryCount = m_read(data, cursor, 2);
+				for (uint32_t e = 0; e < entryCount && cursor + 18 <= data.size(); e++) {
+					uint32_t index = m_read(data, cursor, 2) % RegionChunkCount;
+					entries[index].timestamp = m_read(data, cursor, 4);
+					entries[index].offset = m_read(data, cursor, 4);
+					entries[index].hash = static_cast<uint64_t>(m_read(data, cursor, 4)) << 32;
+					entries[index].hash |= m_read(data, cursor, 4);
+				}
+			}
+			
+			if (cursor != data.size()) {
+				cerr << "[Error] the chunk manifest " << path << " is truncated" << endl;
+				m_regions.clear();
+				return false;
+			}
+			return true;
+		}
+	
+		// saves the manifest atomically
+		bool save(const string &path) const {
+			
+			memblock data(8 + 4);
+			copy_n("NBTMMAN1", 8, data.begin());
+			writeBigEndian(&data[8], static_cast<uint32_t>(m_regions.size()), 4);
+			
+			for (const pair<const string, vector<ManifestEntry>> &region : m_regions) {
+				
+				m_append(data, static_cast<uint32_t>(region.first.size()), 2);
+				data.insert(data.end(), region.first.begin(), region.first.end());
+				
+				size_t countPosition = data.size();
+				m_append(data, 0, 2);
+				
+				uint32_t count = 0;
+				for (int index = 0; index < RegionChunkCount; index++) {
+					const ManifestEntry &entry = region.second[index];
+					if (entry.empty())
+						continue;
+					m_append(data, index, 2);
+					m_append(data, entry.timestamp, 4);
+					m_append(data, entry.offset, 4);
+					m_append(data, static_cast<uint32_t>(entry.hash >> 32), 4);
+					m_append(data, static_cast<uint32_t>(entry.hash), 4);
+					count++;
+				}
+				writeBigEndian(&data[countPosition], count, 2);
+			}
+			
+			return atomicWriteFile(path, data);
+		}
+	
+		// the entries of a region, indexed like its location table. Created empty if unknown
+		vector<ManifestEntry> &region(const string &name) {
+			vector<ManifestEntry> &entries = m_regions[name];
+			if (entries.empty())
+				entries.assign(RegionChunkCount, ManifestEntry());
+			return entries;
+		}
+	
+		void removeRegion(const string &name) { m_regions.erase(name); }
+		size_t regionCount() const { return m_regions.size(); }
+	
+	private:
+		map<string, vector<ManifestEntry>> m_regions;
+	
+		static uint32_t m_read(const memblock &data, size_t &cursor, int width) {
+			if (cursor + width > data.size()) {
+				cursor = data.size() + 1; // makes the final size check fail
+				return 0;
+			}
+			uint32_t value = readBigEndian(&data[cursor], width);
+			cursor += width;
+			return value;
+		}
+	
+		static void m_append(memblock &data, uint32_t value, int width) {
+			data.resize(data.size() + width);
+			writeBigEndian(&data[data.size() - width], value, width);
+		}
+};
+
+// called for every chunk that changed since the previous scan, with its decompressed NBT data.
+// The chunk coordinates are global
+typedef function<void(const RegionFile &region, int x, int z, const memblock &data)> ChangedChunkVisitor;
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Visits only the chunks of a world that changed since the previous scan.
+ 
+ For every region file, only the header is read at first. A chunk whose timestamp and offset
+ are the ones recorded in the manifest is skipped without reading it. Otherwise its compressed
+ bytes are read and hashed, and the chunk is visited if its timestamp or its hash changed: a chunk
+ that was only moved by a compaction is not visited again. With setHashOnly(true), a chunk whose
+ timestamp changed but whose bytes did not (it was saved again unchanged) is not visited either.
+ 
+ The manifest is saved at the end of run(), so an interrupted scan is simply done again.
+ */
+class IncrementalScan {
+	
+	public:
+		IncrementalScan(const string &manifestPath) : m_manifestPath(manifestPath), m_visited(0), m_skipped(0), m_good(true), m_hashOnly(false) {
+			m_good = m_manifest.load(manifestPath);
+		}
+	
+		// if true, only the chunks whose compressed bytes changed are visited, whatever their timestamp
+		void setHashOnly(bool hashOnly) { m_hashOnly = hashOnly; }
+	
+		// scans the region files of a directory. Returns the number of chunks visited
+		size_t run(const string &regionDirectory, const ChangedChunkVisitor &visitor) {
+			
+			m_visited = m_skipped = 0;
+			if (!m_good)
+				return 0;
+			
+			memblock &payload = m_payload, &data = m_data;
+			for (const RegionFile &file : listRegionFiles(regionDirectory)) {
+				
+				string name = file.path.substr(file.path.find_last_of('/') + 1);
+				
+				int fd = ::open(file.path.c_str(), O_RDONLY);
+				RegionHeader header;
+				char rawHeader[RegionHeaderSize];
+				if (fd < 0 || pread(fd, rawHeader, RegionHeaderSize, 0) != RegionHeaderSize || !header.parse(rawHeader, RegionHeaderSize)) {
+					cerr << "[Warning] cannot read the header of " << file.path << endl;
+					if (fd >= 0)
+						::close(fd);
+					continue;
+				}
+				
+				vector<ManifestEntry> &entries = m_manifest.region(name);
+				for (int index = 0; index < RegionChunkCount; index++) {
+					
+					const ChunkLocation &loc = header.location(index);
+					ManifestEntry &entry = entries[index];
+					
+					if (loc.empty()) {
+						entry = ManifestEntry(); // the chunk has been deleted
+						continue;
+					}
+					if (!entry.empty() && entry.timestamp == loc.timestamp && entry.offset == loc.offset) {
+						m_skipped++;
+						continue;
+					}
+					
+					uint8_t compressionType;
+					if (!readChunkPayload(fd, loc, payload, compressionType)) {
+						cerr << "[Warning] cannot read chunk " << index << " of " << file.path << endl;
+						continue;
+					}
+					
+					ManifestEntry current;
+					current.timestamp = loc.timestamp;
+					current.offset = loc.offset;
+					current.hash = hashBytes(payload.data(), payload.size());
+					bool changed = entry.empty() || entry.hash != current.hash || (!m_hashOnly && entry.timestamp != current.timestamp);
+					
+					if (!changed) {
+						entry = current;
+						m_skipped++;
+						continue;
+					}
+					
+					// the entry is left as it was until the chunk has been visited: we will try again next time
+					const Codec *codec = CodecRegistry::instance().codec(compressionType);
+					if (!codec || !codec->decompress(payload.data(), payload.size(), data)) {
+						cerr << "[Warning] cannot decompress chunk " << index << " of " << file.path << endl;
+						continue;
+					}
+					
+					visitor(file, file.x * 32 + index % 32, file.z * 32 + index / 32, data);
+					entry = current;
+					m_visited++;
+				}
+				::close(fd);
+			}
+			
+			if (!m_manifest.save(m_manifestPath))
+				cerr << "[Error] cannot save the chunk manifest " << m_manifestPath << endl;
+			return m_visited;
+		}
+	
+		bool good() const { return m_good; }
+		size_t visited() const { return m_visited; }
+		size_t skipped() const { return m_skipped; }
+		ChunkManifest &manifest() { return m_manifest; }
+	
+	private:
+		string m_manifestPath;
+		ChunkManifest m_manifest;
+		size_t m_visited;
+		size_t m_skipped;
+		bool m_good;
+		bool m_hashOnly;
+		memblock m_payload, m_data; // not the buffers of workerBuffers(): the visitor may parse or load with them
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // CHUNKMANIFEST_H
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <climits>
+#include <zlib.h>
+#include "Parser.h"
+#include "../config.h"
+#ifdef NBTMEISTER_USE_LZ4
+#include <lz4.h>
+#endif // NBTMEISTER_USE_LZ4
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// the compression type byte stored before every chunk of a region file
+enum CompressionType {
+	CompressionGZip		= 1,
+	CompressionZlib		= 2,
+	CompressionNone		= 3,
+	
+	// not a Minecraft type: LZ4 blocks, for the regions that are only read by our own tools.
+	// Only registered when NBTMEISTER_USE_LZ4 is defined (see config.h)
+	CompressionLZ4		= 0x60,
+	
+	CompressionExternal	= 0x80 // flag set by Minecraft when the chunk is stored in a separate .mcc file
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ A codec turns a compressed payload into bytes and back. Codecs are shared by every
+ thread, so they must not keep any state between two calls.
+ 
+ 'sizeHint' is the expected size of the decompressed data, when it is known. The output
+ grows as needed if the hint is too small.
+ */
+class Codec {
+	
+	public:
+		virtual ~Codec() {}
+	
+		virtual bool decompress(const char *data, size_t size, memblock &output, size_t sizeHint = 0) const = 0;
+		virtual bool compress(const char *data, size_t size, memblock &output, int level = -1) const = 0;
+		virtual const char *name() const = 0;
+};
+
+// zlib and gzip only differ by the wrapper around the deflate stream, which is selected by 'windowBits'
+class DeflateCodec : public Codec {
+	
+	public:
+		DeflateCodec(int windowBits, const char *name) : m_windowBits(windowBits), m_name(name) {}
+	
+		bool decompress(const char *data, size_t size, memblock &output, size_t sizeHint = 0) const {
+			
+			z_stream stream = z_stream();
+			if (inflateInit2(&stream, m_windowBits) != Z_OK)
+				return false;
+			
+			output.resize(sizeHint ? sizeHint : (size * 4 > 65536 ? size * 4 : 65536));
+			stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+			stream.avail_in = static_cast<uInt>(size);
+			
+			int ret = Z_OK;
+			while (ret != Z_STREAM_END) {
+				
+				if (stream.total_out == output.size())
+					output.resize(output.size() * 2); // the output is full, we make some room
+				
+				stream.next_out = reinterpret_cast<Bytef *>(&output[stream.total_out]);
+				stream.avail_out = static_cast<uInt>(output.size() - stream.total_out);
+				
+				ret = inflate(&stream, Z_NO_FLUSH);
+				if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+					break; // corrupted data
+				if (ret != Z_STREAM_END && stream.avail_in == 0 && stream.avail_out != 0) {
+					ret = Z_DATA_ERROR; // the input ended before the end of the stream
+					break;
+				}
+			}
+			
+			output.resize(stream.total_out);
+			inflateEnd(&stream);
+			return ret == Z_STREAM_END;
+		}
+	
+		bool compress(const char *data, size_t size, memblock &output, int level = -1) const {
+			
+			z_stream stream = z_stream();
+			if (deflateInit2(&stream, level, Z_DEFLATED, m_windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+				return false;
+			
+			output.resize(deflateBound(&stream, size));
+			stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+			stream.avail_in = static_cast<uInt>(size);
+			stream.next_out = reinterpret_cast<Bytef *>(&output[0]);
+			stream.avail_out = static_cast<uInt>(output.size());
+			
+			int ret = deflate(&stream, Z_FINISH);
+			output.resize(stream.total_out);
+			deflateEnd(&stream);
+			return ret == Z_STREAM_END;
+		}
+	
+		const char *name() const { return m_name; }
+	
+	private:
+		int m_windowBits;
+		const char *m_name;
+};
+
+// the payload is stored as it is
+class RawCodec : public Codec {
+	
+	public:
+		bool decompress(const char *data, size_t size, memblock &output, size_t = 0) const {
+			output.assign(data, data + size);
+			return true;
+		}
+	
+		bool compress(const char *data, size_t size, memblock &output, int = -1) const {
+			output.assign(data, data + size);
+			return true;
+		}
+	
+		const char *name() const { return "none"; }
+};
+
+#ifdef NBTMEISTER_USE_LZ4
+// a single LZ4 block, preceded by the decompressed size (4 bytes, big-endian).
+// Several times faster to decompress than zlib, at the cost of bigger files
+class LZ4Codec : public Codec {
+	
+	public:
+		bool decompress(const char *data, size_t size, memblock &output, size_t = 0) const {
+			
+			if (size < 4)
+				return false;
+			
+			uint32_t length = 0;
+			for (int i = 0; i < 4; i++)
+				length = (length << 8) | static_cast<uint8_t>(data[i]);
+			
+			// the length comes from the data: a block cannot inflate more than 255 times (a match
+			// length grows by 255 per byte), and LZ4 counts in ints
+			if (length > INT_MAX || length > (size - 4) * 255 + 16)
+				return false;
+			output.resize(length);
+			int ret = LZ4_decompress_safe(data + 4, output.data(), static_cast<int>(size - 4), static_cast<int>(length));
+			return ret == static_cast<int>(length);
+		}
+	
+		bool compress(const char *data, size_t size, memblock &output, int = -1) const {
+			
+			output.resize(4 + LZ4_compressBound(static_cast<int>(size)));
+			for (int i = 0; i < 4; i++)
+				output[i] = static_cast<char>(size >> (8 * (3 - i)));
+			
+			int ret = LZ4_compress_default(data, &output[4], static_cast<int>(size), static_cast<int>(output.size() - 4));
+			output.resize(4 + (ret > 0 ? ret : 0));
+			return ret > 0;
+		}
+	
+		const char *name() const { return "lz4"; }
+};
+#endif // NBTMEISTER_USE_LZ4
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ The codecs, indexed by the compression type byte of the chunks. gzip, zlib and
+ uncompressed chunks are always supported; other codecs can be added at start-up
+ with registerCodec(), before any region is read.
+ */
+class CodecRegistry {
+	
+	public:
+		static CodecRegistry &instance() {
+			static CodecRegistry registry;
+			return registry;
+		}
+	
+		// the registry takes the ownership of the codec
+		void registerCodec(uint8_t type, Codec *codec) { m_codecs[type].reset(codec); }
+	
+		// returns nullptr if the type is not supported
+		const Codec *codec(uint8_t type) const { return m_codecs[type].get(); }
+	
+	private:
+		unique_ptr<Codec> m_codecs[256];
+	
+		CodecRegistry() {
+			registerCodec(CompressionGZip, new DeflateCodec(15 + 16, "gzip"));
+			registerCodec(CompressionZlib, new DeflateCodec(15, "zlib"));
+			registerCodec(CompressionNone, new RawCodec());
+#ifdef NBTMEISTER_USE_LZ4
+			registerCodec(CompressionLZ4, new LZ4Codec());
+#endif // NBTMEISTER_USE_LZ4
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // CODEC_H
@@ -0,0 +1,564 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ENTITYINDEX_H
+#define ENTITYINDEX_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <iostream>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "MinecraftRegion.h"
+#include "RegionHeader.h"
+#include "RegionFiles.h"
+#include "RegionWriter.h"
+#include "TagReader.h"
+#include "../ThreadPool.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+enum EntityKind {
+	KindEntity			= 0, // Level.Entities: mobs, items, minecarts, ...
+	KindTileEntity		= 1 // Level.TileEntities: chests, hoppers, spawners, ...
+};
+
+// an entity or a tile entity of a chunk, its id pointing into the data of the chunk
+struct ChunkEntity {
+	EntityKind kind;
+	TagName id;
+	double x, y, z; // Pos for an entity, x, y, z for a tile entity
+};
+
+// called for every entity and tile entity of a chunk
+typedef function<void(const ChunkEntity &entity)> EntityVisitor;
+
+// reads the entity or tile entity whose compound the reader is in, up to its end, and visits it. The entities
+// riding it (Passengers) or ridden by it (Riding, in the older worlds) are visited too: they are stored
+// in its compound, not in the Entities of the chunk. Returns false if the compound is malformed
+inline bool readChunkEntity(TagReader &reader, EntityKind kind, const EntityVisitor &visitor, int depth = 0) {
+	
+	if (depth > TagReaderMaxDepth)
+		return false;
+	
+	ChunkEntity entity;
+	entity.kind = kind;
+	entity.x = entity.y = entity.z = 0;
+	bool entities = kind == KindEntity, tileEntities = kind == KindTileEntity;
+	TagType type;
+	TagName name;
+	while (reader.next(type, name)) {
+		
+		if (type == TagTypeString && name == "id") {
+			if (!reader.readString(entity.id))
+				return false;
+		}
+		else if (entities && type == TagTypeList && name == "Pos") {
+			TagType coordinateType;
+			int32_t count;
+			if (!reader.readListHeader(coordinateType, count))
+				return false;
+			double *coordinates[3] = {&entity.x, &entity.y, &entity.z};
+			for (int32_t c = 0; c < count; c++) {
+				double value = 0;
+				if (coordinateType == TagTypeDouble ? !reader.readValue(value) : !reader.skip(coordinateType))
+					return false;
+				if (c < 3)
+					*coordinates[c] = value;
+			}
+		}
+		else if (tileEntities && type == TagTypeInt && (name == "x" || name == "y" || name == "z")) {
+			int32_t value;
+			if (!reader.readValue(value))
+				return false;
+			(name == "x" ? entity.x : name == "y" ? entity.y : entity.z) = value;
+		}
+		else if (entities && type == TagTypeCompound && name == "Riding") {
+			if (!readChunkEntity(reader, KindEntity, visitor, depth + 1))
+				return false;
+		}
+		else if (entities && type == TagTypeList && name == "Passengers") {
+			TagType elementType;
+			int32_t length;
+			if (!reader.readListHeader(elementType, length))
+				return false;
+			for (int32_t i = 0; i < length; i++)
+				if (elementType == TagTypeCompound ? !readChunkEntity(reader, KindEntity, visitor, depth + 1) : !reader.skip(elementType))
+					return false;
+		}
+		else if (!reader.skip(type))
+			return false;
+	}
+	if (reader.status() != good)
+		return false;
+	if (entity.id.size)
+		visitor(entity);
+	return true;
+}
+
+// visits the entities and the tile entities of a chunk from its decompressed NBT data, reading only
+// their id and their position (see TagReader), the entities riding others included.
+// 'inhabitedTime' (if not null) receives Level.InhabitedTime, 0 if the chunk has none.
+// Returns false if the chunk is malformed
+inline bool forEachEntity(const char *chunk, size_t size, const EntityVisitor &visitor, int64_t *inhabitedTime = nullptr) {
+	
+	TagReader reader(chunk, size);
+	if (!reader.enterRoot() || !reader.seek("Level", TagTypeCompound))
+		return false;
+	
+	TagType type;
+	TagName name;
+	if (inhabitedTime)
+		*inhabitedTime = 0;
+	while (reader.next(type, name)) {
+		
+		if (inhabitedTime && type == TagTypeLong && name == "InhabitedTime") {
+			if (!reader.readValue(*inhabitedTime))
+				return false;
+			continue;
+		}
+		
+		bool entities = type == TagTypeList && name == "Entities", tileEntities = type == TagTypeList && name == "TileEntities";
+		if (!entities && !tileEntities) {
+			if (!reader.skip(type))
+				return false;
+			continue;
+		}
+		
+		TagType elementType;
+		int32_t length;
+		if (!reader.readListHeader(elementType, length))
+			return false;
+		if (elementType != TagTypeCompound) {
+			for (int32_t i = 0; i < length; i++)
+				if (!reader.skip(elementType))
+					return false;
+			continue;
+		}
+		
+		for (int32_t i = 0; i < length; i++)
+			if (!readChunkEntity(reader, entities ? KindEntity : KindTileEntity, visitor))
+				return false;
+	}
+	return reader.status() == good;
+}
+
+// the ids of an EntityIndex are numbered on 2 bytes
+const size_t EntityIdLimit = 65536;
+
+// the block a position read from a chunk is in. Returns false if the position is not a number,
+// or if the block is out of the range of an int32_t
+inline bool blockCoordinate(double position, int32_t &block) {
+	if (!isfinite(position))
+		return false;
+	double floored = floor(position);
+	if (floored < INT32_MIN || floored > INT32_MAX)
+		return false;
+	block = static_cast<int32_t>(floored);
+	return true;
+}
+
+// an entity or a tile entity of an EntityIndex, in global coordinates
+struct EntityRecord {
+	int32_t x, y, z; // the block it is in
+	int32_t chunkX, chunkZ; // the chunk it is stored in
+	uint16_t id; // see EntityIndex::idName()
+	uint8_t kind; // an EntityKind
+};
+
+// a cell of the grid of an EntityIndex: the records of a 16x16 column of blocks
+struct EntityCell {
+	int32_t x, z; // in chunk-sized cells: the block (x, z) is in the cell (x >> 4, z >> 4)
+	uint32_t first; // the index of its first record
+	uint32_t count;
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ An index of the entities and the tile entities of a world, built once, saved to a file, then
+ queried without reading the region files again.
+ 
+ build() scans the region files in parallel, one task of a ThreadPool per file: the chunks are read
+ in the order of the file and walked with a TagReader (see forEachEntity()), only the ids and the
+ positions being read. The records are then sorted by cell, a cell being a 16x16 column of blocks:
+ the cells form a grid, sorted by (z, x), so the records of a box are found with one binary search per
+ row of cells. Besides, every id has its posting list: the indices of its records, in the order of
+ the grid. There can be EntityIdLimit ids at most: the records of the ids past it are not indexed,
+ they are counted by skippedRecords() instead. Neither are the entities whose position cannot be
+ a block (NaN, infinite or too far), counted by failedRecords().
+ 
+ The file format is binary, every integer being big-endian:
+ 
+ 	"NBTMEIX1"
+ 	int idCount, for each id: short length, name
+ 	int recordCount, for each record: int x, int y, int z, int chunkX, int chunkZ, short id, byte kind
+ 	int cellCount, for each cell: int x, int z, int first, int count
+ 	for each id: int postingCount, int record...
+ */
+class EntityIndex {
+	
+	public:
+		EntityIndex() : m_failedChunks(0), m_failedRecords(0), m_skippedRecords(0) {}
+	
+		// indexes the entities of the region files of a directory, on 'threads' threads. Returns the number of records
+		size_t build(const string &regionDirectory, size_t threads = thread::hardware_concurrency()) {
+			
+			m_clear();
+			vector<RegionFile> files = listRegionFiles(regionDirectory);
+			{
+				ThreadPool pool(min(threads ? threads : 1, max<size_t>(files.size(), 1)));
+				for (const RegionFile &file : files)
+					pool.submit([this, file] { m_indexRegion(file); });
+				pool.wait();
+			}
+			m_finish();
+			if (m_skippedRecords)
+				cerr << "[Warning] more than " << EntityIdLimit << " entity ids, " << m_skippedRecords << " records are not indexed" << endl;
+			return m_records.size();
+		}
+	
+		bool save(const string &path) const {
+			
+			memblock data(8);
+			copy_n("NBTMEIX1", 8, data.begin());
+			m_append(data, static_cast<uint32_t>(m_ids.size()), 4);
+			for (const string &id : m_ids) {
+				m_append(data, static_cast<uint32_t>(id.size()), 2);
+				data.insert(data.end(), id.begin(), id.end());
+			}
+			m_append(data, static_cast<uint32_t>(m_records.size()), 4);
+			for (const EntityRecord &record : m_records) {
+				m_append(data, record.x, 4);
+				m_append(data, record.y, 4);
+				m_append(data, record.z, 4);
+				m_append(data, record.chunkX, 4);
+				m_append(data, record.chunkZ, 4);
+				m_append(data, record.id, 2);
+				m_append(data, record.kind, 1);
+			}
+			m_append(data, static_cast<uint32_t>(m_cells.size()), 4);
+			for (const EntityCell &cell : m_cells) {
+				m_append(data, cell.x, 4);
+				m_append(data, cell.z, 4);
+				m_append(data, cell.first, 4);
+				m_append(data, cell.count, 4);
+			}
+			for (const vector<uint32_t> &postings : m_postings) {
+				m_append(data, static_cast<uint32_t>(postings.size()), 4);
+				for (uint32_t record : postings)
+					m_append(data, record, 4);
+			}
+			return atomicWriteFile(path, data);
+		}
+	
+		// returns false if the file cannot be read or is not an entity index
+		bool load(const string &path) {
+			
+			m_clear();
+			ifstream infile(path, ios::binary);
+			memblock data((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+			if (data.size() < 12 || string(data.data(), 8) != "NBTMEIX1") {
+				cerr << "[Error] " << path << " is not an entity index" << endl;
+				return false;
+			}
+			
+			size_t cursor = 8;
+			uint32_t idCount = m_read(data, cursor, 4);
+			for (uint32_t i = 0; i < idCount && i < EntityIdLimit && cursor <= data.size(); i++) {
+				uint32_t length = m_read(data, cursor, 2);
+				if (cursor + length > data.size())
+					break;
+				m_idIndex[string(data.data() + cursor, length)] = static_cast<uint16_t>(m_ids.size());
+				m_ids.push_back(string(data.data() + cursor, length));
+				cursor += length;
+			}
+			
+			uint32_t recordCount = m_read(data, cursor, 4);
+			for (uint32_t i = 0; i < recordCount && cursor + 23 <= data.size(); i++) {
+				EntityRecord record;
+				record.x = static_cast<int32_t>(m_read(data, cursor, 4));
+				record.y = static_cast<int32_t>(m_read(data, cursor, 4));
+				record.z = static_cast<int32_t>(m_read(data, cursor, 4));
+				record.chunkX = static_cast<int32_t>(m_read(data, cursor, 4));
+				record.chunkZ = static_cast<int32_t>(m_read(data, cursor, 4));
+				record.id = static_cast<uint16_t>(m_read(data, cursor, 2));
+				record.kind = static_cast<uint8_t>(m_read(data, cursor, 1));
+				m_records.push_back(record);
+			}
+			
+			uint32_t cellCount = m_read(data, cursor, 4);
+			for (uint32_t i = 0; i < cellCount && cursor + 16 <= data.size(); i++) {
+				EntityCell cell;
+				cell.x = static_cast<int32_t>(m_read(data, cursor, 4));
+				cell.z = static_cast<int32_t>(m_read(data, cursor, 4));
+				cell.first = m_read(data, cursor, 4);
+				cell.count = m_read(data, cursor, 4);
+				m_cells.push_back(cell);
+			}
+			
+			m_postings.resize(m_ids.size());
+			for (vector<uint32_t> &postings : m_postings) {
+				uint32_t count = m_read(data, cursor, 4);
+				for (uint32_t i = 0; i < count && cursor + 4 <= data.size(); i++)
+					postings.push_back(m_read(data, cursor, 4));
+			}
+			
+			bool consistent = m_ids.size() == idCount && m_records.size() == recordCount && m_cells.size() == cellCount;
+			for (const EntityRecord &record : m_records)
+				consistent = consistent && record.id < m_ids.size();
+			for (const EntityCell &cell : m_cells)
+				consistent = consistent && static_cast<uint64_t>(cell.first) + cell.count <= m_records.size();
+			for (const vector<uint32_t> &postings : m_postings)
+				for (uint32_t record : postings)
+					consistent = consistent && record < m_records.size();
+			if (cursor != data.size() || !consistent) {
+				cerr << "[Error] the entity index " << path << " is truncated or corrupted" << endl;
+				m_clear();
+				return false;
+			}
+			return true;
+		}
+	
+		size_t size() const { return m_records.size(); }
+		const EntityRecord &record(size_t index) const { return m_records[index]; }
+		const vector<EntityRecord> &records() const { return m_records; }
+		const vector<EntityCell> &cells() const { return m_cells; }
+	
+		// the name of an id of the records ("Villager", "Hopper", ...)
+		const string &idName(uint16_t id) const { return m_ids[id]; }
+		size_t idCount() const { return m_ids.size(); }
+		// the id of a name, -1 if no record has it
+		int id(const string &name) const {
+			auto found = m_idIndex.find(name);
+			return found != m_idIndex.end() ? found->second : -1;
+		}
+	
+		// appends to 'found' the records of the id 'name'
+		void find(const string &name, vector<EntityRecord> &found) const {
+			int index = id(name);
+			if (index < 0)
+				return;
+			for (uint32_t record : m_postings[index])
+				found.push_back(m_records[record]);
+		}
+	
+		// appends to 'found' the records from (minX, minZ) to (maxX, maxZ) included, in block coordinates,
+		// of the id 'name' if it is not empty
+		void find(int minX, int minZ, int maxX, int maxZ, vector<EntityRecord> &found, const string &name = string()) const {
+			
+			int index = name.empty() ? -1 : id(name);
+			if (!name.empty() && index < 0)
+				return;
+			
+			int minCellX = minX >> 4, maxCellX = maxX >> 4;
+			for (int cellZ = minZ >> 4; cellZ <= maxZ >> 4; cellZ++) {
+				auto cell = lower_bound(m_cells.begin(), m_cells.end(), make_pair(cellZ, minCellX), [](const EntityCell &c, const pair<int, int> &key) {
+					return c.z != key.first ? c.z < key.first : c.x < key.second;
+				});
+				for (; cell != m_cells.end() && cell->z == cellZ && cell->x <= maxCellX; ++cell) {
+					for (uint32_t i = cell->first; i < cell->first + cell->count; i++) {
+						const EntityRecord &record = m_records[i];
+						if ((index < 0 || record.id == index) && record.x >= minX && record.x <= maxX && record.z >= minZ && record.z <= maxZ)
+							found.push_back(record);
+					}
+				}
+				if (cell == m_cells.end())
+					break;
+			}
+		}
+	
+		// appends to 'found' the records at most 'radius' blocks away from (x, z), horizontally
+		void findNear(int x, int z, int radius, vector<EntityRecord> &found, const string &name = string()) const {
+			vector<EntityRecord> box;
+			find(x - radius, z - radius, x + radius, z + radius, box, name);
+			for (const EntityRecord &record : box) {
+				int64_t dx = record.x - x, dz = record.z - z;
+				if (dx * dx + dz * dz <= static_cast<int64_t>(radius) * radius)
+					found.push_back(record);
+			}
+		}
+	
+		// the chunks that could not be read by the last build
+		size_t failedChunks() const { return m_failedChunks; }
+		// the entities and tile entities left out by the last build, their position not being a block
+		size_t failedRecords() const { return m_failedRecords; }
+		// the entities and tile entities left out by the last build, their ids being past EntityIdLimit
+		size_t skippedRecords() const { return m_skippedRecords; }
+	
+	private:
+		vector<string> m_ids;
+		unordered_map<string, uint16_t> m_idIndex;
+		vector<EntityRecord> m_records;
+		vector<EntityCell> m_cells;
+		vector<vector<uint32_t>> m_postings; // by id
+		size_t m_failedChunks;
+		size_t m_failedRecords;
+		size_t m_skippedRecords;
+		mutex m_mutex; // guards the records and the ids while the tasks of build() merge
+	
+		// non-copyable: the tasks of a build point to the index
+		EntityIndex(const EntityIndex &);
+		EntityIndex &operator=(const EntityIndex &);
+	
+		void m_clear() {
+			m_ids.clear();
+			m_idIndex.clear();
+			m_records.clear();
+			m_cells.clear();
+			m_postings.clear();
+			m_failedChunks = 0;
+			m_failedRecords = 0;
+			m_skippedRecords = 0;
+		}
+	
+		void m_indexRegion(const RegionFile &file) {
+			
+			Region region(file.path);
+			if (!region.good()) {
+				cerr << "[Warning] the region file " << file.path << " cannot be opened, it is not indexed" << endl;
+				return;
+			}
+			
+			// the ids are numbered by the task first, then renumbered when the records are merged
+			vector<string> ids;
+			unordered_map<string, uint16_t> idIndex;
+			vector<EntityRecord> records;
+			size_t failedChunks = 0, failedRecords = 0, skippedRecords = 0;
+			
+			region.forEachChunk([&](int x, int z, const memblock &data) {
+				int chunkX = file.x * 32 + x, chunkZ = file.z * 32 + z;
+				if (!forEachEntity(data.data(), data.size(), [&](const ChunkEntity &entity) {
+					EntityRecord record;
+					if (!blockCoordinate(entity.x, record.x) || !blockCoordinate(entity.y, record.y) || !blockCoordinate(entity.z, record.z)) {
+						failedRecords++;
+						return;
+					}
+					string name = entity.id.str();
+					auto found = idIndex.find(name);
+					if (found == idIndex.end()) {
+						if (ids.size() == EntityIdLimit) { // no number left for it
+							skippedRecords++;
+							return;
+						}
+						found = idIndex.insert(make_pair(name, static_cast<uint16_t>(ids.size()))).first;
+						ids.push_back(name);
+					}
+					record.chunkX = chunkX;
+					record.chunkZ = chunkZ;
+					record.id = found->second;
+					record.kind = entity.kind;
+					records.push_back(record);
+				}))
+					failedChunks++;
+			}, OrderSector);
+			
+			lock_guard<mutex> lock(m_mutex);
+			vector<int32_t> renumbered(ids.size(), -1); // -1 for the ids past EntityIdLimit
+			for (size_t i = 0; i < ids.size(); i++) {
+				auto found = m_idIndex.find(ids[i]);
+				if (found == m_idIndex.end()) {
+					if (m_ids.size() == EntityIdLimit)
+						continue;
+					found = m_idIndex.insert(make_pair(ids[i], static_cast<uint16_t>(m_ids.size()))).first;
+					m_ids.push_back(ids[i]);
+				}
+				renumbered[i] = found->second;
+			}
+			for (EntityRecord &record : records) {
+				if (renumbered[record.id] < 0) {
+					skippedRecords++;
+					continue;
+				}
+				record.id = static_cast<uint16_t>(renumbered[record.id]);
+				m_records.push_back(record);
+			}
+			m_failedChunks += failedChunks;
+			m_failedRecords += failedRecords;
+			m_skippedRecords += skippedRecords;
+		}
+	
+		// sorts the records into the grid and builds the posting lists
+		void m_finish() {
+			
+			sort(m_records.begin(), m_records.end(), [](const EntityRecord &a, const EntityRecord &b) {
+				if ((a.z >> 4) != (b.z >> 4))
+					return (a.z >> 4) < (b.z >> 4);
+				if ((a.x >> 4) != (b.x >> 4))
+					return (a.x >> 4) < (b.x >> 4);
+				return a.id != b.id ? a.id < b.id : a.y < b.y;
+			});
+			
+			m_postings.assign(m_ids.size(), vector<uint32_t>());
+			for (uint32_t i = 0; i < m_records.size(); i++) {
+				const EntityRecord &record = m_records[i];
+				if (m_cells.empty() || m_cells.back().x != record.x >> 4 || m_cells.back().z != record.z >> 4) {
+					EntityCell cell;
+					cell.x = record.x >> 4;
+					cell.z = record.z >> 4;
+					cell.first = i;
+					cell.count = 0;
+					m_cells.push_back(cell);
+				}
+				m_cells.back().count++;
+				m_postings[record.id].push_back(i);
+			}
+		}
+	
+		static uint32_t m_read(const memblock &data, size_t &cursor, int width) {
+			if (cursor + width > data.size()) {
+				cursor = data.size() + 1; // makes the final size check fail
+				return 0;
+			}
+			uint32_t value = readBigEndian(&data[cursor], width);
+			cursor += width;
+			return value;
+		}
+	
+		static void m_append(memblock &data, uint32_t value, int width) {
+			data.resize(data.size() + width);
+			writeBigEndian(&data[data.size() - width], value, width);
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // ENTITYINDEX_H
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HOTSPOTANALYZER_H
+#define HOTSPOTANALYZER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <iostream>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+#include <algorithm>
+#include "MinecraftRegion.h"
+#include "RegionHeader.h"
+#include "RegionFiles.h"
+#include "EntityIndex.h"
+#include "../ThreadPool.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// the number of chunks a HotspotAnalyzer reports by default
+const size_t DefaultHotspotCount = 100;
+
+// what makes a chunk worse than another
+enum HotspotRanking {
+	RankByTotal,			// entities + tile entities
+	RankByEntities,
+	RankByTileEntities,
+	RankByInhabitedTime,
+	RankByCompressedSize
+};
+
+// a chunk reported by a HotspotAnalyzer
+struct ChunkHotspot {
+	ChunkHotspot() : x(0), z(0), entities(0), tileEntities(0), inhabitedTime(0), compressedBytes(0), allocatedBytes(0) {}
+	
+	int x, z; // global chunk coordinates
+	uint32_t entities;
+	uint32_t tileEntities;
+	int64_t inhabitedTime; // in ticks
+	uint32_t compressedBytes; // the size of its compressed payload
+	uint32_t allocatedBytes; // the sectors it takes in its region file
+	vector<pair<string, uint32_t>> ids; // the number of entities and tile entities of every id, the most common first
+	
+	uint64_t score(HotspotRanking ranking) const {
+		switch (ranking) {
+			case RankByEntities: return entities;
+			case RankByTileEntities: return tileEntities;
+			case RankByInhabitedTime: return inhabitedTime > 0 ? static_cast<uint64_t>(inhabitedTime) : 0;
+			case RankByCompressedSize: return compressedBytes;
+			default: return static_cast<uint64_t>(entities) + tileEntities;
+		}
+	}
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Finds the chunks of a world that are the most likely to make a server lag: the ones packed with
+ entities (mobs, dropped items, ...) or tile entities (hoppers, furnaces, ...).
+ 
+ The region files are scanned in parallel, one task of a ThreadPool per file. The chunks are read in
+ the order of the file and walked with a TagReader (see forEachEntity()): only the ids of the entities
+ and Level.InhabitedTime are read, nothing is built. The ids are counted per chunk, and only the worst
+ chunks are kept, in a heap of bounded size per task, then in the one of the analyzer: the memory
+ does not depend on the size of the world. The totals per id of the whole world are kept as well.
+ 
+ The compressed size of a chunk is the length written in front of it, so that a chunk ranks by what it
+ really holds. The space it takes in its region file, a multiple of 4 KiB, is reported as well.
+ */
+class HotspotAnalyzer {
+	
+	public:
+		HotspotAnalyzer(HotspotRanking ranking = RankByTotal, size_t count = DefaultHotspotCount) :
+		m_ranking(ranking), m_count(count), m_chunks(0), m_failedChunks(0) {}
+	
+		// scans the region files of a directory on 'threads' threads. Returns the number of chunks scanned
+		size_t run(const string &regionDirectory, size_t threads = thread::hardware_concurrency()) {
+			
+			m_hotspots.clear();
+			m_entityTotals.clear();
+			m_tileEntityTotals.clear();
+			m_chunks = m_failedChunks = 0;
+			
+			vector<RegionFile> files = listRegionFiles(regionDirectory);
+			{
+				ThreadPool pool(min(threads ? threads : 1, max<size_t>(files.size(), 1)));
+				for (const RegionFile &file : files)
+					pool.submit([this, file] { m_scanRegion(file); });
+				pool.wait();
+			}
+			
+			sort_heap(m_hotspots.begin(), m_hotspots.end(), Worse(m_ranking)); // the worst first
+			return m_chunks;
+		}
+	
+		// the worst chunks of the last run, the worst first
+		const vector<ChunkHotspot> &hotspots() const { return m_hotspots; }
+	
+		// the number of entities and tile entities of every id in the whole world
+		const map<string, uint64_t> &entityTotals() const { return m_entityTotals; }
+		const map<string, uint64_t> &tileEntityTotals() const { return m_tileEntityTotals; }
+	
+		size_t chunks() const { return m_chunks; }
+		size_t failedChunks() const { return m_failedChunks; }
+	
+		// writes the worst chunks as a table, with their 'ids' most common ids
+		void report(ostream &out, size_t ids = 3) const {
+			
+			out << setw(8) << "chunk x" << setw(8) << "chunk z" << setw(10) << "entities" << setw(10) << "tiles"
+				<< setw(14) << "inhabited" << setw(10) << "bytes" << setw(10) << "allocated" << "  most common" << endl;
+			for (const ChunkHotspot &hotspot : m_hotspots) {
+				out << setw(8) << hotspot.x << setw(8) << hotspot.z << setw(10) << hotspot.entities << setw(10) << hotspot.tileEntities
+					<< setw(14) << hotspot.inhabitedTime << setw(10) << hotspot.compressedBytes << setw(10) << hotspot.allocatedBytes << " ";
+				for (size_t i = 0; i < hotspot.ids.size() && i < ids; i++)
+					out << " " << hotspot.ids[i].first << " x" << hotspot.ids[i].second;
+				out << endl;
+			}
+		}
+	
+	private:
+		HotspotRanking m_ranking;
+		size_t m_count;
+		vector<ChunkHotspot> m_hotspots; // a heap during a run, the best on top
+		map<string, uint64_t> m_entityTotals;
+		map<string, uint64_t> m_tileEntityTotals;
+		size_t m_chunks, m_failedChunks;
+		mutex m_mutex; // guards the results while the tasks merge
+	
+		// non-copyable: the tasks of a run point to the analyzer
+		HotspotAnalyzer(const HotspotAnalyzer &);
+		HotspotAnalyzer &operator=(const HotspotAnalyzer &);
+	
+		// orders the chunks from the worst to the best, the ties by coordinates
+		struct Worse {
+			HotspotRanking ranking;
+			Worse(HotspotRanking r) : ranking(r) {}
+			bool operator()(const ChunkHotspot &a, const ChunkHotspot &b) const {
+				uint64_t scoreA = a.score(ranking), scoreB = b.score(ranking);
+				if (scoreA != scoreB)
+					return scoreA > scoreB;
+				return a.z != b.z ? a.z < b.z : a.x < b.x;
+			}
+		};
+	
+		// adds 'hotspot' to the heap 'heap' if it is among the 'm_count' worst
+		void m_keep(vector<ChunkHotspot> &heap, ChunkHotspot &hotspot) const {
+			Worse worse(m_ranking);
+			if (heap.size() < m_count) {
+				heap.push_back(ChunkHotspot());
+				heap.back() = move(hotspot);
+				push_heap(heap.begin(), heap.end(), worse);
+			}
+			else if (!heap.empty() && worse(hotspot, heap.front())) {
+				pop_heap(heap.begin(), heap.end(), worse);
+				heap.back() = move(hotspot);
+				push_heap(heap.begin(), heap.end(), worse);
+			}
+		}
+	
+		// the chunk would be kept in 'heap'
+		bool m_wouldKeep(const vector<ChunkHotspot> &heap, const ChunkHotspot &hotspot) const {
+			return heap.size() < m_count || (!heap.empty() && Worse(m_ranking)(hotspot, heap.front()));
+		}
+	
+		void m_scanRegion(const RegionFile &file) {
+			
+			Region region(file.path);
+			if (!region.good()) {
+				cerr << "[Warning] the region file " << file.path << " cannot be opened, it is not scanned" << endl;
+				return;
+			}
+			
+			vector<ChunkHotspot> heap;
+			unordered_map<string, uint32_t> entityIds, tileEntityIds; // of the current chunk
+			map<string, uint64_t> entityTotals, tileEntityTotals;
+			size_t chunks = 0, failed = 0;
+			string id;
+			
+			region.forEachChunkWithSize([&](int x, int z, const memblock &data, uint32_t compressedSize) {
+				
+				ChunkHotspot hotspot;
+				hotspot.x = file.x * 32 + x;
+				hotspot.z = file.z * 32 + z;
+				hotspot.compressedBytes = compressedSize;
+				hotspot.allocatedBytes = static_cast<uint32_t>(region.location(x, z).sectorCount) * RegionSectorSize;
+				entityIds.clear();
+				tileEntityIds.clear();
+				
+				if (!forEachEntity(data.data(), data.size(), [&](const ChunkEntity &entity) {
+					id.assign(entity.id.data, entity.id.size);
+					if (entity.kind == KindEntity) {
+						hotspot.entities++;
+						entityIds[id]++;
+					}
+					else {
+						hotspot.tileEntities++;
+						tileEntityIds[id]++;
+					}
+				}, &hotspot.inhabitedTime)) {
+					failed++;
+					return;
+				}
+				chunks++;
+				
+				for (const pair<const string, uint32_t> &count : entityIds)
+					entityTotals[count.first] += count.second;
+				for (const pair<const string, uint32_t> &count : tileEntityIds)
+					tileEntityTotals[count.first] += count.second;
+				
+				if (!m_wouldKeep(heap, hotspot))
+					return;
+				hotspot.ids.assign(entityIds.begin(), entityIds.end());
+				hotspot.ids.insert(hotspot.ids.end(), tileEntityIds.begin(), tileEntityIds.end());
+				sort(hotspot.ids.begin(), hotspot.ids.end(), [](const pair<string, uint32_t> &a, const pair<string, uint32_t> &b) {
+					return a.second != b.second ? a.second > b.second : a.first < b.first;
+				});
+				m_keep(heap, hotspot);
+			}, OrderSector);
+			
+			lock_guard<mutex> lock(m_mutex);
+			for (ChunkHotspot &hotspot : heap)
+				m_keep(m_hotspots, hotspot);
+			for (const pair<const string, uint64_t> &count : entityTotals)
+				m_entityTotals[count.first] += count.second;
+			for (const pair<const string, uint64_t> &count : tileEntityTotals)
+				m_tileEntityTotals[count.first] += count.second;
+			m_chunks += chunks;
+			m_failedChunks += failed;
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // HOTSPOTANALYZER_H
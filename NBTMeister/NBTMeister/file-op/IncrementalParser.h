@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef INCREMENTALPARSER_H
+#define INCREMENTALPARSER_H
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include "Parser.h"
+#include "RegionHeader.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Receives the content of an NBT document as a sequence of events, in the order of the stream.
+ Compounds and lists are opened by beginArray() and closed by endArray(); the elements of a list
+ have an empty name. 'length' is the number of elements of a list, or -1 for a compound.
+ */
+class NbtEventHandler {
+	
+	public:
+		virtual ~NbtEventHandler() {}
+	
+		virtual void beginArray(const string &name, ArrayType type, TagType listType, int32_t length) = 0;
+		virtual void endArray() = 0;
+		virtual void value(const string &name, const payload_type &payload) = 0;
+};
+
+// builds a tree out of the events, the same tree as the one built by Parser
+class TreeBuilder : public NbtEventHandler {
+	
+	public:
+		TreeBuilder() : m_root(nullptr) {}
+		~TreeBuilder() { delete m_root; }
+	
+		void beginArray(const string &name, ArrayType type, TagType listType, int32_t) {
+			Array *array = new Array(name, type, listType);
+			m_attach(array);
+			m_stack.push_back(array);
+		}
+	
+		void endArray() { m_stack.pop_back(); }
+	
+		void value(const string &name, const payload_type &payload) { m_attach(new Single(name, payload)); }
+	
+		// true once the root tag has been closed
+		bool complete() const { return m_root && m_stack.empty(); }
+	
+		// gives the tree away; it is yours to delete
+		Tag *release() {
+			Tag *root = m_root;
+			m_root = nullptr;
+			m_stack.clear();
+			return root;
+		}
+	
+		// destroys the tree built so far
+		void clear() {
+			delete m_root;
+			m_root = nullptr;
+			m_stack.clear();
+		}
+	
+	private:
+		Tag *m_root;
+		vector<Array *> m_stack; // the arrays being filled, the innermost last
+	
+		// non-copyable: the builder owns its tree
+		TreeBuilder(const TreeBuilder &);
+		TreeBuilder &operator=(const TreeBuilder &);
+	
+		void m_attach(Tag *tag) {
+			if (m_stack.empty())
+				m_root = tag;
+			else m_stack.back()->addTag(tag);
+		}
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ A parser that can be fed a document in arbitrary slices (network reads, pipes, output of a
+ decompressor...). Contrary to Parser, it never needs the whole document at once: feed() consumes
+ what it is given and returns need_more_data until the root tag is complete, then good.
+ 
+ The parser is a state machine with an explicit stack of the open compounds and lists, so it can
+ stop at any byte and resume at the next call. A field cut between two slices (a number, a name,
+ the content of an array...) is accumulated in a buffer until it is complete.
+ 
+ By default, the events are turned into a tree by an internal TreeBuilder, retrieved with release().
+ A custom NbtEventHandler can be given instead, in which case no tree is built at all and the
+ memory used does not depend on the size of the document (apart from the arrays, which are
+ delivered whole).
+ */
+class IncrementalParser {
+	
+	public:
+		IncrementalParser() : m_handler(&m_builder) { reset(); }
+		IncrementalParser(NbtEventHandler &handler) : m_handler(&handler) { reset(); }
+	
+		// forgets the current document (and destroys its partial tree)
+		void reset() {
+			m_builder.clear();
+			m_frames.clear();
+			m_status = need_more_data;
+			m_consumed = 0;
+			m_expect(StateTagType, 1);
+		}
+	
+		// parses a slice of the document. Returns need_more_data if the document is not complete yet,
+		// good once it is, or the error encountered. The bytes following the end of the document are
+		// not consumed (see consumed())
+		parser_status feed(const char *data, size_t size) {
+			
+			size_t position = 0;
+			while (m_status == need_more_data) {
+				
+				size_t missing = m_need - m_buffer.size();
+				if (missing) {
+					size_t count = min(missing, size - position);
+					m_buffer.insert(m_buffer.end(), data + position, data + position + count);
+					position += count;
+					if (count < missing)
+						break; // we need the next slice
+				}
+				m_step();
+			}
+			
+			m_consumed = position;
+			return m_status;
+		}
+	
+		// the tree of the document, once feed() returned good. It is yours to delete
+		Tag *release() { return m_builder.release(); }
+	
+		parser_status status() const { return m_status; }
+		size_t consumed() const { return m_consumed; } // bytes used by the last call to feed()
+		size_t depth() const { return m_frames.size(); } // number of compounds and lists open
+	
+	private:
+		enum State {
+			StateTagType,		// 1 byte: the type of the next named tag
+			StateNameLength,	// 2 bytes
+			StateName,
+			StateStringLength,	// 2 bytes
+			StateArrayLength,	// 4 bytes, for byte and int arrays
+			StateListHeader,	// 1 byte for the type of the elements + 4 bytes for their number
+			StatePayload		// the value itself
+		};
+	
+		// an open compound or list
+		struct Frame {
+			bool isList;
+			TagType listType;
+			int32_t remaining; // elements of the list still to read
+		};
+	
+		NbtEventHandler *m_handler;
+		TreeBuilder m_builder;
+		vector<Frame> m_frames;
+		parser_status m_status;
+		size_t m_consumed;
+	
+		State m_state;
+		size_t m_need; // size of the field being read
+		memblock m_buffer; // the bytes of that field received so far
+		TagType m_tagType; // type of the tag being read
+		string m_tagName;
+	
+		// non-copyable: m_handler may point to our own m_builder
+		IncrementalParser(const IncrementalParser &);
+		IncrementalParser &operator=(const IncrementalParser &);
+	
+		void m_expect(State state, size_t size) {
+			m_state = state;
+			m_need = size;
+			m_buffer.clear();
+		}
+	
+		// the field being read is complete: we act on it and say what comes next
+		void m_step() {
+			
+			switch (m_state) {
+					
+				case StateTagType:
+					m_tagType = static_cast<TagType>(static_cast<uint8_t>(m_buffer[0]));
+					if (m_tagType == TagTypeEnd) {
+						if (m_frames.empty() || m_frames.back().isList) { // a TagEnd out of a compound
+							m_status = malformed_stream;
+							return;
+						}
+						m_frames.pop_back();
+						m_handler->endArray();
+						m_next();
+					}
+					else if (m_tagType >= TagTypeCount)
+						m_status = malformed_stream;
+					else m_expect(StateNameLength, 2);
+					break;
+					
+				case StateNameLength:
+					m_expect(StateName, decodeBigEndian<uint16_t>(&m_buffer[0]));
+					break;
+					
+				case StateName:
+					m_startPayload(m_tagType, string(m_buffer.begin(), m_buffer.end()));
+					break;
+					
+				case StateStringLength:
+					m_expect(StatePayload, decodeBigEndian<uint16_t>(&m_buffer[0]));
+					break;
+					
+				case StateArrayLength: {
+					int32_t length = decodeBigEndian<int32_t>(&m_buffer[0]);
+					if (length < 0) {
+						m_status = malformed_stream;
+						return;
+					}
+					m_expect(StatePayload, static_cast<size_t>(length) * (m_tagType == TagTypeLongArray ? 8 : m_tagType == TagTypeIntArray ? 4 : 1));
+					break;
+				}
+					
+				case StateListHeader: {
+					TagType listType = static_cast<TagType>(static_cast<uint8_t>(m_buffer[0]));
+					int32_t length = decodeBigEndian<int32_t>(&m_buffer[1]);
+					if (listType >= TagTypeCount || length < 0 || (listType == TagTypeEnd && length > 0)) {
+						m_status = malformed_stream;
+						return;
+					}
+					
+					m_handler->beginArray(m_tagName, ArrayType::List, listType, length);
+					Frame frame = { true, listType, length };
+					m_frames.push_back(frame);
+					m_next();
+					break;
+				}
+					
+				case StatePayload:
+					m_handler->value(m_tagName, m_makePayload());
+					m_next();
+					break;
+			}
+		}
+	
+		// starts reading the payload of a tag of the specified type
+		void m_startPayload(TagType tagType, const string &tagName) {
+			
+			m_tagType = tagType;
+			m_tagName = tagName;
+			
+			switch (tagType) {
+				case TagTypeByte: m_expect(StatePayload, 1); break;
+				case TagTypeShort: m_expect(StatePayload, 2); break;
+				case TagTypeInt: m_expect(StatePayload, 4); break;
+				case TagTypeLong: m_expect(StatePayload, 8); break;
+				case TagTypeFloat: m_expect(StatePayload, 4); break;
+				case TagTypeDouble: m_expect(StatePayload, 8); break;
+				case TagTypeString: m_expect(StateStringLength, 2); break;
+				case TagTypeByteArray:
+				case TagTypeIntArray:
+				case TagTypeLongArray: m_expect(StateArrayLength, 4); break;
+				case TagTypeList: m_expect(StateListHeader, 5); break;
+					
+				case TagTypeCompound: {
+					m_handler->beginArray(tagName, ArrayType::Compound, TagTypeInvalid, -1);
+					Frame frame = { false, TagTypeInvalid, 0 };
+					m_frames.push_back(frame);
+					m_expect(StateTagType, 1);
+					break;
+				}
+					
+				default:
+					m_status = what_the_fuck;
+					break;
+			}
+		}
+	
+		// a tag is complete: we go on with the next element of the innermost open array
+		void m_next() {
+			
+			while (!m_frames.empty()) {
+				
+				Frame &top = m_frames.back();
+				if (!top.isList) {
+					m_expect(StateTagType, 1);
+					return;
+				}
+				
+				if (top.remaining > 0) {
+					top.remaining--;
+					m_startPayload(top.listType, "");
+					return;
+				}
+				
+				// the list is complete, it is itself a complete tag of its parent
+				m_frames.pop_back();
+				m_handler->endArray();
+			}
+			
+			m_status = good; // the root tag is complete
+		}
+	
+		// converts the bytes of the field into the payload of a Single
+		payload_type m_makePayload() {
+			
+			switch (m_tagType) {
+				case TagTypeByte: return SINGLE_BYTE(static_cast<int8_t>(m_buffer[0]));
+				case TagTypeShort: return SINGLE_SHORT(decodeBigEndian<int16_t>(&m_buffer[0]));
+				case TagTypeInt: return SINGLE_INT(decodeBigEndian<int32_t>(&m_buffer[0]));
+				case TagTypeLong: return SINGLE_LONG(decodeBigEndian<int64_t>(&m_buffer[0]));
+				case TagTypeFloat: return SINGLE_FLOAT(decodeBigEndian<float>(&m_buffer[0]));
+				case TagTypeDouble: return SINGLE_DOUBLE(decodeBigEndian<double>(&m_buffer[0]));
+				case TagTypeString: return string(m_buffer.begin(), m_buffer.end());
+					
+				case TagTypeByteArray: {
+					vector<SINGLE_GETBYTE> array(m_buffer.size());
+					for (size_t i = 0; i < m_buffer.size(); i++)
+						array[i] = SINGLE_BYTE(m_buffer[i]);
+					return array;
+				}
+					
+				case TagTypeLongArray: {
+					vector<SINGLE_GETLONG> array(m_buffer.size() / 8);
+					for (size_t i = 0; i < array.size(); i++)
+						array[i] = SINGLE_LONG(decodeBigEndian<int64_t>(&m_buffer[i * 8]));
+					return array;
+				}
+					
+				default: { // TagTypeIntArray
+					vector<SINGLE_GETINT> array(m_buffer.size() / 4);
+					for (size_t i = 0; i < array.size(); i++)
+						array[i] = SINGLE_INT(decodeBigEndian<int32_t>(&m_buffer[i * 4]));
+					return array;
+				}
+			}
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // INCREMENTALPARSER_H
@@ -0,0 +1,671 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ITEMINDEX_H
+#define ITEMINDEX_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "MinecraftRegion.h"
+#include "RegionHeader.h"
+#include "RegionFiles.h"
+#include "RegionWriter.h"
+#include "ChunkManifest.h"
+#include "ChunkCache.h"
+#include "EntityIndex.h"
+#include "TagReader.h"
+#include "../ThreadPool.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// the deepest nesting of containers in items (a shulker box in a chest is 1) an ItemIndex follows
+const int ItemIndexMaxNesting = 4;
+
+// the container types of an ItemIndex are numbered on 2 bytes
+const size_t ItemTypeLimit = 65536;
+
+// a container holding items: a tile entity (chest, hopper, ...) or an entity (minecart, donkey, ...)
+struct ItemContainer {
+	int32_t x, y, z; // the block it is in
+	int32_t chunkX, chunkZ; // the chunk it is stored in
+	uint16_t type; // its id, see ItemIndex::typeName()
+	uint8_t kind; // an EntityKind
+};
+
+// a stack of items in a container of an ItemIndex
+struct ItemStack {
+	uint32_t container; // see ItemIndex::container()
+	int16_t damage;
+	uint8_t count;
+	uint8_t nesting; // 0 if the stack is directly in the container, 1 if it is in an item of the container, ...
+	uint64_t fingerprint; // a hash of the NBT of its "tag" compound, 0 if it has none
+};
+
+// what an ItemIndex knew about a chunk when it read it
+struct ItemChunkStamp {
+	uint32_t timestamp;
+	uint32_t offset;
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ An inverted index of the items of a world: for every item id, the stacks that hold it and the
+ containers they are in. The item ids are strings: the numeric ids of the older worlds are written
+ in decimal ("264"), the names of the newer ones are kept as they are ("minecraft:diamond").
+ 
+ The chunks are read with a TagReader, following only the paths Level.TileEntities[*].Items[*] and
+ Level.Entities[*].Items[*], and the items held by items (tag.BlockEntityTag.Items: a shulker box
+ in a chest, for instance). The fingerprint of a stack is a hash of the raw bytes of its "tag"
+ compound: two stacks with the same enchantments, name, lore, ... have the same fingerprint.
+ 
+ update() is incremental: the timestamp and the offset of every chunk read are recorded, and only
+ the chunks whose entries in the header of their region file changed are read again, the others
+ keeping their stacks. The region files are read in parallel, one task of a ThreadPool per file.
+ There can be ItemTypeLimit container types at most: the containers of the types past it are not
+ indexed, they are counted by skippedContainers() instead. Neither are the containers whose position
+ cannot be a block (see blockCoordinate()), counted by failedContainers().
+ 
+ The file format is binary, every integer being big-endian:
+ 
+ 	"NBTMITX1"
+ 	int chunkCount, for each chunk: int x, int z, int timestamp, int offset
+ 	int typeCount, for each container type: short length, name
+ 	int containerCount, for each container: int x, int y, int z, int chunkX, int chunkZ, short type, byte kind
+ 	int itemCount, for each item id: short length, name, int stackCount,
+ 		for each stack: int container, short damage, byte count, byte nesting, int fingerprintHigh, int fingerprintLow
+ */
+class ItemIndex {
+	
+	public:
+		ItemIndex() : m_readChunks(0), m_failedChunks(0), m_failedContainers(0), m_skippedContainers(0) {}
+	
+		// brings the index up to date with the region files of a directory, on 'threads' threads.
+		// Returns the number of chunks read
+		size_t update(const string &regionDirectory, size_t threads = thread::hardware_concurrency()) {
+			
+			m_readChunks = m_failedChunks = m_failedContainers = m_skippedContainers = 0;
+			
+			// the chunks to read again, by region file, and the ones that are gone
+			vector<RegionFile> files;
+			vector<vector<int>> changed;
+			unordered_map<uint64_t, ItemChunkStamp> stamps;
+			for (const RegionFile &file : listRegionFiles(regionDirectory)) {
+				RegionHeader header;
+				if (!header.load(file.path)) {
+					cerr << "[Warning] cannot read the header of " << file.path << ", its items are not updated" << endl;
+					for (int index = 0; index < RegionChunkCount; index++) {
+						auto known = m_chunks.find(chunkKey(file.x * 32 + index % 32, file.z * 32 + index / 32));
+						if (known != m_chunks.end())
+							stamps.insert(*known);
+					}
+					continue;
+				}
+				
+				vector<int> indices;
+				for (int index = 0; index < RegionChunkCount; index++) {
+					const ChunkLocation &loc = header.location(index);
+					if (loc.empty())
+						continue;
+					uint64_t key = chunkKey(file.x * 32 + index % 32, file.z * 32 + index / 32);
+					ItemChunkStamp stamp = {loc.timestamp, loc.offset};
+					auto known = m_chunks.find(key);
+					if (known == m_chunks.end() || known->second.timestamp != stamp.timestamp || known->second.offset != stamp.offset)
+						indices.push_back(index);
+					stamps[key] = stamp;
+				}
+				if (!indices.empty()) {
+					files.push_back(file);
+					changed.push_back(indices);
+				}
+			}
+			
+			// the stacks of the chunks that changed or are gone are dropped
+			unordered_set<uint64_t> dropped;
+			for (const pair<const uint64_t, ItemChunkStamp> &chunk : m_chunks)
+				if (!stamps.count(chunk.first))
+					dropped.insert(chunk.first);
+			for (size_t f = 0; f < files.size(); f++)
+				for (int index : changed[f])
+					dropped.insert(chunkKey(files[f].x * 32 + index % 32, files[f].z * 32 + index / 32));
+			m_drop(dropped);
+			m_chunks.swap(stamps);
+			
+			{
+				ThreadPool pool(min(threads ? threads : 1, max<size_t>(files.size(), 1)));
+				for (size_t f = 0; f < files.size(); f++)
+					pool.submit([this, &files, &changed, f] { m_indexRegion(files[f], changed[f]); });
+				pool.wait();
+			}
+			if (m_skippedContainers)
+				cerr << "[Warning] more than " << ItemTypeLimit << " container types, " << m_skippedContainers << " containers are not indexed" << endl;
+			return m_readChunks;
+		}
+	
+		bool save(const string &path) const {
+			
+			memblock data(8);
+			copy_n("NBTMITX1", 8, data.begin());
+			
+			// the chunks are sorted, so that the same index always gives the same file
+			map<uint64_t, ItemChunkStamp> chunks(m_chunks.begin(), m_chunks.end());
+			m_append(data, static_cast<uint32_t>(chunks.size()), 4);
+			for (const pair<const uint64_t, ItemChunkStamp> &chunk : chunks) {
+				m_append(data, static_cast<uint32_t>(chunk.first >> 32), 4);
+				m_append(data, static_cast<uint32_t>(chunk.first), 4);
+				m_append(data, chunk.second.timestamp, 4);
+				m_append(data, chunk.second.offset, 4);
+			}
+			
+			m_append(data, static_cast<uint32_t>(m_types.size()), 4);
+			for (const string &type : m_types) {
+				m_append(data, static_cast<uint32_t>(type.size()), 2);
+				data.insert(data.end(), type.begin(), type.end());
+			}
+			
+			m_append(data, static_cast<uint32_t>(m_containers.size()), 4);
+			for (const ItemContainer &container : m_containers) {
+				m_append(data, container.x, 4);
+				m_append(data, container.y, 4);
+				m_append(data, container.z, 4);
+				m_append(data, container.chunkX, 4);
+				m_append(data, container.chunkZ, 4);
+				m_append(data, container.type, 2);
+				m_append(data, container.kind, 1);
+			}
+			
+			m_append(data, static_cast<uint32_t>(m_items.size()), 4);
+			for (const pair<const string, vector<ItemStack>> &item : m_items) {
+				m_append(data, static_cast<uint32_t>(item.first.size()), 2);
+				data.insert(data.end(), item.first.begin(), item.first.end());
+				m_append(data, static_cast<uint32_t>(item.second.size()), 4);
+				for (const ItemStack &stack : item.second) {
+					m_append(data, stack.container, 4);
+					m_append(data, static_cast<uint16_t>(stack.damage), 2);
+					m_append(data, stack.count, 1);
+					m_append(data, stack.nesting, 1);
+					m_append(data, static_cast<uint32_t>(stack.fingerprint >> 32), 4);
+					m_append(data, static_cast<uint32_t>(stack.fingerprint), 4);
+				}
+			}
+			return atomicWriteFile(path, data);
+		}
+	
+		// returns false if the file cannot be read or is not an item index. A missing file gives an empty index
+		bool load(const string &path) {
+			
+			m_clear();
+			ifstream infile(path, ios::binary);
+			if (!infile.good())
+				return true;
+			
+			memblock data((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+			if (data.size() < 12 || string(data.data(), 8) != "NBTMITX1") {
+				cerr << "[Error] " << path << " is not an item index" << endl;
+				return false;
+			}
+			
+			size_t cursor = 8;
+			uint32_t chunkCount = m_read(data, cursor, 4);
+			for (uint32_t i = 0; i < chunkCount && cursor + 16 <= data.size(); i++) {
+				uint64_t key = static_cast<uint64_t>(m_read(data, cursor, 4)) << 32;
+				key |= m_read(data, cursor, 4);
+				ItemChunkStamp &stamp = m_chunks[key];
+				stamp.timestamp = m_read(data, cursor, 4);
+				stamp.offset = m_read(data, cursor, 4);
+			}
+			
+			uint32_t typeCount = m_read(data, cursor, 4);
+			uint16_t type;
+			for (uint32_t i = 0; i < typeCount && cursor <= data.size(); i++)
+				if (!m_type(m_readString(data, cursor), type))
+					break; // more types than can be numbered: caught below
+			
+			uint32_t containerCount = m_read(data, cursor, 4);
+			for (uint32_t i = 0; i < containerCount && cursor + 23 <= data.size(); i++) {
+				ItemContainer container;
+				container.x = static_cast<int32_t>(m_read(data, cursor, 4));
+				container.y = static_cast<int32_t>(m_read(data, cursor, 4));
+				container.z = static_cast<int32_t>(m_read(data, cursor, 4));
+				container.chunkX = static_cast<int32_t>(m_read(data, cursor, 4));
+				container.chunkZ = static_cast<int32_t>(m_read(data, cursor, 4));
+				container.type = static_cast<uint16_t>(m_read(data, cursor, 2));
+				container.kind = static_cast<uint8_t>(m_read(data, cursor, 1));
+				m_containers.push_back(container);
+			}
+			
+			bool consistent = m_chunks.size() == chunkCount && m_types.size() == typeCount && m_containers.size() == containerCount;
+			uint32_t itemCount = m_read(data, cursor, 4);
+			for (uint32_t i = 0; i < itemCount && cursor <= data.size(); i++) {
+				vector<ItemStack> &stacks = m_items[m_readString(data, cursor)];
+				uint32_t stackCount = m_read(data, cursor, 4);
+				for (uint32_t s = 0; s < stackCount && cursor + 16 <= data.size(); s++) {
+					ItemStack stack;
+					stack.container = m_read(data, cursor, 4);
+					stack.damage = static_cast<int16_t>(m_read(data, cursor, 2));
+					stack.count = static_cast<uint8_t>(m_read(data, cursor, 1));
+					stack.nesting = static_cast<uint8_t>(m_read(data, cursor, 1));
+					stack.fingerprint = static_cast<uint64_t>(m_read(data, cursor, 4)) << 32;
+					stack.fingerprint |= m_read(data, cursor, 4);
+					consistent = consistent && stack.container < m_containers.size();
+					stacks.push_back(stack);
+				}
+				consistent = consistent && stacks.size() == stackCount;
+			}
+			for (const ItemContainer &container : m_containers)
+				consistent = consistent && container.type < m_types.size();
+			
+			if (cursor != data.size() || !consistent) {
+				cerr << "[Error] the item index " << path << " is truncated or corrupted" << endl;
+				m_clear();
+				return false;
+			}
+			return true;
+		}
+	
+		// the stacks of the item 'id' ("264", "minecraft:diamond", ...)
+		const vector<ItemStack> &stacks(const string &id) const {
+			static const vector<ItemStack> none;
+			auto found = m_items.find(id);
+			return found != m_items.end() ? found->second : none;
+		}
+	
+		// the containers holding the item 'id', with the number of items of this id they hold
+		vector<pair<uint32_t, uint64_t>> containers(const string &id) const {
+			map<uint32_t, uint64_t> totals;
+			for (const ItemStack &stack : stacks(id))
+				totals[stack.container] += stack.count;
+			return vector<pair<uint32_t, uint64_t>>(totals.begin(), totals.end());
+		}
+	
+		// appends to 'found' the stacks of every item whose fingerprint is 'fingerprint', with their item ids
+		void findFingerprint(uint64_t fingerprint, vector<pair<string, ItemStack>> &found) const {
+			for (const pair<const string, vector<ItemStack>> &item : m_items)
+				for (const ItemStack &stack : item.second)
+					if (stack.fingerprint == fingerprint)
+						found.push_back(make_pair(item.first, stack));
+		}
+	
+		const ItemContainer &container(uint32_t index) const { return m_containers[index]; }
+		size_t containerCount() const { return m_containers.size(); }
+		const string &typeName(uint16_t type) const { return m_types[type]; }
+		size_t itemCount() const { return m_items.size(); } // the number of distinct item ids
+		size_t chunkCount() const { return m_chunks.size(); }
+	
+		// the counters of the last update
+		size_t readChunks() const { return m_readChunks; }
+		size_t failedChunks() const { return m_failedChunks; }
+		size_t failedContainers() const { return m_failedContainers; } // their position not being a block
+		size_t skippedContainers() const { return m_skippedContainers; } // their types being past ItemTypeLimit
+	
+	private:
+		unordered_map<uint64_t, ItemChunkStamp> m_chunks; // by chunkKey()
+		vector<string> m_types;
+		unordered_map<string, uint16_t> m_typeIndex;
+		vector<ItemContainer> m_containers;
+		map<string, vector<ItemStack>> m_items;
+		size_t m_readChunks, m_failedChunks, m_failedContainers, m_skippedContainers;
+		mutex m_mutex; // guards the index while the tasks of update() merge
+	
+		// non-copyable: the tasks of an update point to the index
+		ItemIndex(const ItemIndex &);
+		ItemIndex &operator=(const ItemIndex &);
+	
+		// a container and its stacks, read from a chunk
+		struct ExtractedContainer {
+			string type;
+			ItemContainer container;
+			vector<pair<string, ItemStack>> stacks;
+		};
+	
+		void m_clear() {
+			m_chunks.clear();
+			m_types.clear();
+			m_typeIndex.clear();
+			m_containers.clear();
+			m_items.clear();
+		}
+	
+		// the number of the container type 'name'. Returns false if it is new and every number is taken
+		bool m_type(const string &name, uint16_t &type) {
+			auto found = m_typeIndex.find(name);
+			if (found == m_typeIndex.end()) {
+				if (m_types.size() == ItemTypeLimit)
+					return false;
+				found = m_typeIndex.insert(make_pair(name, static_cast<uint16_t>(m_types.size()))).first;
+				m_types.push_back(name);
+			}
+			type = found->second;
+			return true;
+		}
+	
+		// removes the containers of the chunks 'dropped' and their stacks
+		void m_drop(const unordered_set<uint64_t> &dropped) {
+			
+			if (dropped.empty())
+				return;
+			
+			vector<uint32_t> renumbered(m_containers.size());
+			vector<ItemContainer> kept;
+			for (size_t i = 0; i < m_containers.size(); i++) {
+				const ItemContainer &container = m_containers[i];
+				if (dropped.count(chunkKey(container.chunkX, container.chunkZ))) {
+					renumbered[i] = UINT32_MAX;
+					continue;
+				}
+				renumbered[i] = static_cast<uint32_t>(kept.size());
+				kept.push_back(container);
+			}
+			m_containers.swap(kept);
+			
+			for (auto item = m_items.begin(); item != m_items.end();) {
+				vector<ItemStack> &stacks = item->second;
+				size_t count = 0;
+				for (const ItemStack &stack : stacks) {
+					if (renumbered[stack.container] == UINT32_MAX)
+						continue;
+					stacks[count] = stack;
+					stacks[count++].container = renumbered[stack.container];
+				}
+				stacks.resize(count);
+				item = stacks.empty() ? m_items.erase(item) : ++item;
+			}
+		}
+	
+		void m_indexRegion(const RegionFile &file, const vector<int> &indices) {
+			
+			Region region(file.path);
+			if (!region.good()) {
+				cerr << "[Warning] the region file " << file.path << " cannot be opened, its items are not updated" << endl;
+				return;
+			}
+			
+			vector<bool> pending(RegionChunkCount, false); // the chunks to read, cleared once read
+			for (int index : indices)
+				pending[index] = true;
+			
+			vector<ExtractedContainer> containers;
+			size_t read = 0, failedContainers = 0;
+			region.forEachChunk([&](int x, int z, const memblock &data) {
+				size_t before = containers.size(), failedBefore = failedContainers;
+				if (m_extractChunk(data.data(), data.size(), file.x * 32 + x, file.z * 32 + z, containers, failedContainers)) {
+					pending[RegionHeader::chunkIndex(x, z)] = false;
+					read++;
+				}
+				else {
+					containers.resize(before);
+					failedContainers = failedBefore;
+				}
+			}, OrderSector, DefaultRunSectors, [&pending](int x, int z) { return pending[RegionHeader::chunkIndex(x, z)]; });
+			
+			lock_guard<mutex> lock(m_mutex);
+			
+			// the chunks that could not be read are forgotten, so that the next update tries them again
+			for (int index : indices) {
+				if (pending[index]) {
+					m_chunks.erase(chunkKey(file.x * 32 + index % 32, file.z * 32 + index / 32));
+					m_failedChunks++;
+				}
+			}
+			for (ExtractedContainer &extracted : containers) {
+				uint32_t index = static_cast<uint32_t>(m_containers.size());
+				if (!m_type(extracted.type, extracted.container.type)) {
+					m_skippedContainers++;
+					continue;
+				}
+				m_containers.push_back(extracted.container);
+				for (pair<string, ItemStack> &stack : extracted.stacks) {
+					stack.second.container = index;
+					m_items[stack.first].push_back(stack.second);
+				}
+			}
+			m_readChunks += read;
+			m_failedContainers += failedContainers;
+		}
+	
+		// appends to 'containers' the containers of a chunk that hold items, and counts in 'failed' the ones whose
+		// position is not a block. Returns false if the chunk is malformed
+		static bool m_extractChunk(const char *data, size_t size, int chunkX, int chunkZ, vector<ExtractedContainer> &containers, size_t &failed) {
+			
+			TagReader reader(data, size);
+			if (!reader.enterRoot() || !reader.seek("Level", TagTypeCompound))
+				return false;
+			
+			TagType type;
+			TagName name;
+			while (reader.next(type, name)) {
+				
+				bool entities = type == TagTypeList && name == "Entities", tileEntities = type == TagTypeList && name == "TileEntities";
+				if (!entities && !tileEntities) {
+					if (!reader.skip(type))
+						return false;
+					continue;
+				}
+				
+				TagType elementType;
+				int32_t length;
+				if (!reader.readListHeader(elementType, length))
+					return false;
+				for (int32_t i = 0; i < length; i++) {
+					
+					if (elementType != TagTypeCompound) {
+						if (!reader.skip(elementType))
+							return false;
+						continue;
+					}
+					
+					ExtractedContainer extracted;
+					ItemContainer &container = extracted.container;
+					container.x = container.y = container.z = 0;
+					container.chunkX = chunkX;
+					container.chunkZ = chunkZ;
+					container.kind = entities ? KindEntity : KindTileEntity;
+					double position[3] = {0, 0, 0};
+					
+					while (reader.next(type, name)) {
+						if (type == TagTypeString && name == "id") {
+							TagName id;
+							if (!reader.readString(id))
+								return false;
+							extracted.type = id.str();
+						}
+						else if (type == TagTypeList && name == "Items") {
+							if (!m_readItems(reader, data, 0, extracted.stacks))
+								return false;
+						}
+						else if (entities && type == TagTypeList && name == "Pos") {
+							TagType coordinateType;
+							int32_t count;
+							if (!reader.readListHeader(coordinateType, count))
+								return false;
+							for (int32_t c = 0; c < count; c++) {
+								double value = 0;
+								if (coordinateType == TagTypeDouble ? !reader.readValue(value) : !reader.skip(coordinateType))
+									return false;
+								if (c < 3)
+									position[c] = value;
+							}
+						}
+						else if (tileEntities && type == TagTypeInt && (name == "x" || name == "y" || name == "z")) {
+							int32_t value;
+							if (!reader.readValue(value))
+								return false;
+							position[name == "x" ? 0 : name == "y" ? 1 : 2] = value;
+						}
+						else if (!reader.skip(type))
+							return false;
+					}
+					if (reader.status() != good)
+						return false;
+					
+					if (extracted.stacks.empty())
+						continue;
+					if (!blockCoordinate(position[0], container.x) || !blockCoordinate(position[1], container.y) ||
+						!blockCoordinate(position[2], container.z)) {
+						failed++;
+						continue;
+					}
+					containers.push_back(extracted);
+				}
+			}
+			return reader.status() == good;
+		}
+	
+		// reads a list of items, whose header comes next, into 'stacks'
+		static bool m_readItems(TagReader &reader, const char *data, int nesting, vector<pair<string, ItemStack>> &stacks) {
+			
+			TagType elementType, type;
+			TagName name;
+			int32_t length;
+			if (!reader.readListHeader(elementType, length))
+				return false;
+			
+			for (int32_t i = 0; i < length; i++) {
+				
+				if (elementType != TagTypeCompound) {
+					if (!reader.skip(elementType))
+						return false;
+					continue;
+				}
+				
+				string id;
+				ItemStack stack = ItemStack();
+				stack.nesting = static_cast<uint8_t>(nesting);
+				while (reader.next(type, name)) {
+					
+					if (name == "id" && type == TagTypeShort) {
+						int16_t value;
+						if (!reader.readValue(value))
+							return false;
+						id = to_string(value);
+					}
+					else if (name == "id" && type == TagTypeString) {
+						TagName value;
+						if (!reader.readString(value))
+							return false;
+						id = value.str();
+					}
+					else if (name == "Count" && type == TagTypeByte) {
+						if (!reader.readValue(stack.count))
+							return false;
+					}
+					else if (name == "Damage" && type == TagTypeShort) {
+						if (!reader.readValue(stack.damage))
+							return false;
+					}
+					else if (name == "tag" && type == TagTypeCompound) {
+						size_t begin = reader.position();
+						if (!m_readTag(reader, data, nesting, stacks))
+							return false;
+						stack.fingerprint = hashBytes(data + begin, reader.position() - begin);
+					}
+					else if (!reader.skip(type))
+						return false;
+				}
+				if (reader.status() != good)
+					return false;
+				if (!id.empty())
+					stacks.push_back(make_pair(id, stack));
+			}
+			return true;
+		}
+	
+		// reads the "tag" compound of an item, whose tags come next, following tag.BlockEntityTag.Items
+		static bool m_readTag(TagReader &reader, const char *data, int nesting, vector<pair<string, ItemStack>> &stacks) {
+			
+			if (nesting >= ItemIndexMaxNesting)
+				return reader.skip(TagTypeCompound);
+			
+			TagType type;
+			TagName name;
+			while (reader.next(type, name)) {
+				if (type != TagTypeCompound || name != "BlockEntityTag") {
+					if (!reader.skip(type))
+						return false;
+					continue;
+				}
+				while (reader.next(type, name)) {
+					if (type == TagTypeList && name == "Items") {
+						if (!m_readItems(reader, data, nesting + 1, stacks))
+							return false;
+					}
+					else if (!reader.skip(type))
+						return false;
+				}
+				if (reader.status() != good)
+					return false;
+			}
+			return reader.status() == good;
+		}
+	
+		static uint32_t m_read(const memblock &data, size_t &cursor, int width) {
+			if (cursor + width > data.size()) {
+				cursor = data.size() + 1; // makes the final size check fail
+				return 0;
+			}
+			uint32_t value = readBigEndian(&data[cursor], width);
+			cursor += width;
+			return value;
+		}
+	
+		static string m_readString(const memblock &data, size_t &cursor) {
+			uint32_t length = m_read(data, cursor, 2);
+			if (cursor + length > data.size()) {
+				cursor = data.size() + 1;
+				return string();
+			}
+			cursor += length;
+			return string(data.data() + cursor - length, length);
+		}
+	
+		static void m_append(memblock &data, uint32_t value, int width) {
+			data.resize(data.size() + width);
+			writeBigEndian(&data[data.size() - width], value, width);
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // ITEMINDEX_H
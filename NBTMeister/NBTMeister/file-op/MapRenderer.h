@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MAPRENDERER_H
+#define MAPRENDERER_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <iostream>
+#include <cstdint>
+#include <unistd.h>
+#include <zlib.h>
+#include "MinecraftRegion.h"
+#include "RegionHeader.h"
+#include "RegionFiles.h"
+#include "RegionWriter.h"
+#include "ChunkManifest.h"
+#include "Surface.h"
+#include "Codec.h"
+#include "../ThreadPool.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// encodes an image of 8-bit RGBA pixels (4 bytes per pixel, row after row) as a PNG file into 'png'
+inline bool encodePng(const uint8_t *rgba, uint32_t width, uint32_t height, memblock &png) {
+	
+	// every row starts with its filter type, 0 (none)
+	size_t rowSize = static_cast<size_t>(width) * 4;
+	memblock raw((rowSize + 1) * height);
+	for (uint32_t y = 0; y < height; y++) {
+		raw[y * (rowSize + 1)] = 0;
+		copy_n(reinterpret_cast<const char *>(rgba) + y * rowSize, rowSize, &raw[y * (rowSize + 1) + 1]);
+	}
+	memblock pixels;
+	if (!CodecRegistry::instance().codec(CompressionZlib)->compress(raw.data(), raw.size(), pixels))
+		return false;
+	
+	// a chunk is its length, its type, its data and the CRC of its type and data
+	auto appendChunk = [&png](const char *type, const char *data, size_t size) {
+		size_t begin = png.size();
+		png.resize(begin + 12 + size);
+		writeBigEndian(&png[begin], static_cast<uint32_t>(size), 4);
+		copy_n(type, 4, &png[begin + 4]);
+		copy_n(data, size, &png[begin + 8]);
+		uLong crc = crc32(0, reinterpret_cast<const Bytef *>(&png[begin + 4]), static_cast<uInt>(size + 4));
+		writeBigEndian(&png[begin + 8 + size], static_cast<uint32_t>(crc), 4);
+	};
+	
+	png.assign("\x89PNG\r\n\x1a\n", "\x89PNG\r\n\x1a\n" + 8);
+	char header[13];
+	writeBigEndian(header, width, 4);
+	writeBigEndian(header + 4, height, 4);
+	header[8] = 8; // bits per channel
+	header[9] = 6; // RGBA
+	header[10] = header[11] = header[12] = 0; // deflate, adaptive filtering, no interlace
+	appendChunk("IHDR", header, sizeof(header));
+	appendChunk("IDAT", pixels.data(), pixels.size());
+	appendChunk("IEND", nullptr, 0);
+	return true;
+}
+
+// the colors of the blocks seen from above, 0xRRGGBBAA, by block id
+class BlockPalette {
+	
+	public:
+		BlockPalette() : m_colors(BlockIdCount, 0x808080FF) {
+			
+			static const struct { uint16_t id; uint32_t color; } defaults[] = {
+				{0, 0x00000000}, {1, 0x7D7D7DFF}, {2, 0x5F9F35FF}, {3, 0x866043FF}, {4, 0x7A7A7AFF},
+				{5, 0x9C7F4EFF}, {6, 0x4F8A2FFF}, {7, 0x545454FF}, {8, 0x2F43F4FF}, {9, 0x2F43F4FF},
+				{10, 0xD45A12FF}, {11, 0xD45A12FF}, {12, 0xDBD3A0FF}, {13, 0x857F7EFF}, {14, 0x8F8C7DFF},
+				{15, 0x88827FFF}, {16, 0x737373FF}, {17, 0x665132FF}, {18, 0x3C7A1EFF}, {20, 0xC0F5FEFF},
+				{21, 0x667085FF}, {24, 0xD8CB9BFF}, {31, 0x5C9436FF}, {32, 0x7B4F19FF}, {35, 0xDDDDDDFF},
+				{37, 0xF1F902FF}, {38, 0xC50A0AFF}, {39, 0x916D55FF}, {40, 0xE21212FF}, {44, 0xA8A8A8FF},
+				{48, 0x677967FF}, {49, 0x14121EFF}, {50, 0xFFD800FF}, {52, 0x1A2733FF}, {53, 0x9C7F4EFF},
+				{54, 0x8F6A2DFF}, {56, 0x819A9AFF}, {59, 0x97A62EFF}, {60, 0x5E3A16FF}, {67, 0x7A7A7AFF},
+				{78, 0xF0FBFBFF}, {79, 0x7DADFFFF}, {80, 0xF0FBFBFF}, {81, 0x0D6418FF}, {82, 0x9FA4B1FF},
+				{83, 0x94C065FF}, {85, 0x9C7F4EFF}, {86, 0xC57918FF}, {87, 0x6F3634FF}, {88, 0x544033FF},
+				{89, 0xF9D49CFF}, {98, 0x7A7A7AFF}, {99, 0x8E6C50FF}, {100, 0xB6231FFF}, {106, 0x3C7A1EFF},
+				{110, 0x6F6369FF}, {111, 0x208030FF}, {112, 0x2C161AFF}, {121, 0xDDDFA5FF}, {159, 0xD1B2A1FF},
+				{161, 0x3C7A1EFF}, {162, 0x695D4BFF}, {172, 0x965C42FF}, {174, 0x8DB4FAFF}, {175, 0x5C9436FF}
+			};
+			for (const auto &entry : defaults)
+				m_colors[entry.id] = entry.color;
+		}
+	
+		uint32_t color(uint16_t id) const { return id < BlockIdCount ? m_colors[id] : 0; }
+		void setColor(uint16_t id, uint32_t color) {
+			if (id < BlockIdCount)
+				m_colors[id] = color;
+		}
+	
+	private:
+		vector<uint32_t> m_colors;
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Renders a top-down map of a world: one 512x512 PNG image per region file, "r.x.z.png", a pixel per
+ column of blocks. Everything is done on the CPU, without any display.
+ 
+ The regions are rendered in parallel, one task of a ThreadPool per region file. A task extracts the
+ surface of its region (see SurfaceExtractor::extractChunk()), maps the id of the top block of every
+ column to its color (see BlockPalette) and encodes the PNG with zlib. With shading, a column is
+ darker when it is lower than the one north of it and brighter when it is higher, like on the maps
+ of the game. The missing chunks are transparent.
+ 
+ The headers of the region files are recorded in a ChunkManifest saved in the output directory
+ ("render.manifest"): a region is rendered again only if the timestamp or the offset of one of its
+ chunks changed since the previous render, or if its image is missing.
+ */
+class MapRenderer {
+	
+	public:
+		MapRenderer(const string &regionDirectory, const string &outputDirectory) :
+		m_regionDirectory(regionDirectory), m_outputDirectory(outputDirectory), m_shading(true), m_rendered(0), m_skipped(0), m_failed(0) {}
+	
+		// renders the regions that changed since the previous render (all of them if 'force'), on
+		// 'threads' threads. Returns the number of images written
+		size_t render(bool force = false, size_t threads = thread::hardware_concurrency()) {
+			
+			m_rendered = m_skipped = m_failed = 0;
+			string manifestPath = m_outputDirectory + "/render.manifest";
+			ChunkManifest manifest;
+			if (!manifest.load(manifestPath))
+				force = true;
+			
+			// which regions changed is decided here, before the workers start
+			vector<RegionFile> files;
+			vector<RegionHeader> headers;
+			for (const RegionFile &file : listRegionFiles(m_regionDirectory)) {
+				RegionHeader header;
+				if (!header.load(file.path)) {
+					cerr << "[Warning] cannot read the header of " << file.path << ", it is not rendered" << endl;
+					m_failed++;
+					continue;
+				}
+				if (!force && !m_changed(header, manifest.region(m_name(file.path))) && access(m_imagePath(file).c_str(), F_OK) == 0) {
+					m_skipped++;
+					continue;
+				}
+				files.push_back(file);
+				headers.push_back(header);
+			}
+			
+			vector<char> rendered(files.size(), 0); // not a vector<bool>: written by several threads
+			{
+				ThreadPool pool(min(threads ? threads : 1, max<size_t>(files.size(), 1)));
+				for (size_t i = 0; i < files.size(); i++)
+					pool.submit([this, &files, &rendered, i] { rendered[i] = m_renderRegion(files[i]); });
+				pool.wait();
+			}
+			
+			for (size_t i = 0; i < files.size(); i++) {
+				if (!rendered[i]) {
+					m_failed++;
+					continue;
+				}
+				vector<ManifestEntry> &entries = manifest.region(m_name(files[i].path));
+				for (int index = 0; index < RegionChunkCount; index++) {
+					const ChunkLocation &loc = headers[i].location(index);
+					entries[index] = ManifestEntry();
+					if (loc.empty())
+						continue;
+					entries[index].timestamp = loc.timestamp;
+					entries[index].offset = loc.offset; // the bytes are not hashed, the header is enough here
+				}
+				m_rendered++;
+			}
+			
+			if (!manifest.save(manifestPath))
+				cerr << "[Error] cannot save the render manifest " << manifestPath << endl;
+			return m_rendered;
+		}
+	
+		BlockPalette &palette() { return m_palette; }
+		void setShading(bool shading) { m_shading = shading; }
+	
+		// the counters of the last render
+		size_t rendered() const { return m_rendered; }
+		size_t skipped() const { return m_skipped; } // unchanged regions
+		size_t failed() const { return m_failed; }
+	
+		// the image of 'tile', 512x512 8-bit RGBA pixels
+		void colorize(const SurfaceTile &tile, vector<uint8_t> &rgba) const {
+			
+			rgba.assign(RegionWidth * RegionWidth * 4, 0);
+			for (int z = 0; z < RegionWidth; z++) {
+				for (int x = 0; x < RegionWidth; x++) {
+					
+					if (!tile.hasChunk(x / ChunkWidth, z / ChunkWidth))
+						continue;
+					uint32_t color = m_palette.color(tile.id(x, z));
+					int shade = 255;
+					if (m_shading && z > 0) {
+						int height = tile.height(x, z), north = tile.height(x, z - 1);
+						shade = height > north ? 255 : height == north ? 220 : 180;
+					}
+					
+					uint8_t *pixel = &rgba[(z * RegionWidth + x) * 4];
+					pixel[0] = ((color >> 24) & 0xFF) * shade / 255;
+					pixel[1] = ((color >> 16) & 0xFF) * shade / 255;
+					pixel[2] = ((color >> 8) & 0xFF) * shade / 255;
+					pixel[3] = color & 0xFF;
+				}
+			}
+		}
+	
+	private:
+		string m_regionDirectory;
+		string m_outputDirectory;
+		BlockPalette m_palette;
+		bool m_shading;
+		size_t m_rendered, m_skipped, m_failed;
+	
+		static string m_name(const string &path) { return path.substr(path.find_last_of('/') + 1); }
+		string m_imagePath(const RegionFile &file) const { return m_outputDirectory + "/r." + to_string(file.x) + "." + to_string(file.z) + ".png"; }
+	
+		static bool m_changed(const RegionHeader &header, const vector<ManifestEntry> &entries) {
+			for (int index = 0; index < RegionChunkCount; index++) {
+				const ChunkLocation &loc = header.location(index);
+				if (loc.empty() ? !entries[index].empty() : loc.timestamp != entries[index].timestamp || loc.offset != entries[index].offset)
+					return true;
+			}
+			return false;
+		}
+	
+		bool m_renderRegion(const RegionFile &file) const {
+			
+			Region region(file.path);
+			if (!region.good())
+				return false;
+			
+			SurfaceTile tile(file.x, file.z);
+			region.forEachChunk([&tile](int x, int z, const memblock &data) {
+				tile.setChunk(x, z, true);
+				SurfaceExtractor::extractChunk(data.data(), data.size(), tile, x, z);
+			}, OrderSector);
+			
+			vector<uint8_t> rgba;
+			colorize(tile, rgba);
+			memblock png;
+			if (!encodePng(rgba.data(), RegionWidth, RegionWidth, png) || !atomicWriteFile(m_imagePath(file), png)) {
+				cerr << "[Error] cannot write the image " << m_imagePath(file) << endl;
+				return false;
+			}
+			return true;
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // MAPRENDERER_H
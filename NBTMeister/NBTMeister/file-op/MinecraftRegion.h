@@ -32,8 +32,22 @@
 #include <vector>
 #include <fstream>
 #include <iomanip>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <algorithm>
 #include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "Parser.h"
+#include "RegionHeader.h"
+#include "RegionWriter.h"
+#include "Codec.h"
+#include "RegionStats.h"
+#include "StreamParser.h"
+#include "BufferPool.h"
+#include "../SharedMutex.h"
 #include "../config.h"
 #include "../libs/zlib-contrib/zfstream.h"
 
@@ -44,140 +58,438 @@ namespace Minecraft {
 #endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
 
 
+// called for every chunk of a region with its decompressed NBT data, the coordinates being relative to the region
+typedef function<void(int x, int z, const memblock &data)> RegionChunkVisitor;
+
+// same, also given the size of the compressed payload of the chunk (see Region::compressedSize())
+typedef function<void(int x, int z, const memblock &data, uint32_t compressedSize)> RegionChunkSizeVisitor;
+
+// says if the chunk (x, z) of a region is to be visited, before it is read
+typedef function<bool(int x, int z)> RegionChunkFilter;
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ A region file (.mca), shared by as many threads as needed.
+ 
+ Nothing but the header is kept in memory: the chunks are read with positional reads (pread)
+ on a single file descriptor, so concurrent readers never move a shared file cursor. Everything
+ that is needed to decode a chunk is local to the call (or to the calling thread, see BufferPool.h).
+ 
+ Locking:
+ 	- the header is protected by a mutex that is only held to copy or update an entry;
+ 	- every chunk has its own mutex, held while its bytes are read or written. A write only
+ 	  waits for the readers of the same chunk, and a reader only waits for a write of its chunk;
+ 	- writes go through a RegionWriter, one at a time. The compression is done before taking any lock;
+ 	- the write lock is a reader/writer lock: forEachChunk() holds it shared while it reads a run of
+ 	  sectors, so the writers are held off but the other readers, sector order or not, are not.
+ 
+ compact() needs the region for itself: it waits for every other operation to finish.
+ */
 class Region {
 	
 	public:
-		Region() : m_rawData(), m_chunks(), m_good(false) {}
-		Region(const string &path) : m_rawData(), m_chunks(), m_good(false) { open(path); }
+		Region() : m_good(false), m_fd(-1) {}
+		Region(const string &path) : m_good(false), m_fd(-1) { open(path); }
+		~Region() { close(); }
 	
-		// open the file and read all of the bytes from it
+		// open the file and read its header
 		void open(const string &path) {
 			
+			close();
+			
 			// we start by opening the file
-			ifstream infile(path, ios::binary);
-			m_good = infile.good();
+			m_path = path;
+			m_fd = ::open(path.c_str(), O_RDONLY);
+			m_good = m_fd >= 0;
 			if (!m_good)
 				return;
 			
-			// the file opened correctly, we fill the raw data table
-			// with the contents of the file
-			infile.seekg(0, infile.end);
-			size_t length = infile.tellg(); // we get the length of the file
+			// the location and timestamp tables are needed by everything else
+			char header[RegionHeaderSize];
+			m_good = pread(m_fd, header, RegionHeaderSize, 0) == RegionHeaderSize && m_header.parse(header, RegionHeaderSize);
+		}
+	
+		// commits the pending writes and closes the file
+		void close() {
 			
-			m_rawData.resize(length); // we resize the vector so it can contain the file bytes
-			infile.seekg(0, infile.beg);
-			infile.read(&m_rawData[0], length); // we fill the vector with the data
+			lock_guard<SharedMutex> writeLock(m_writeMutex);
+			m_writer.reset(); // the writer commits when it is destroyed
+			if (m_fd >= 0)
+				::close(m_fd);
+			m_fd = -1;
+			m_good = false;
 		}
 	
-		void mapChunks() {
-			// we don't want to process the file if it has not been opened correctly
+		// reads the compressed payload of the chunk (x, z) and its compression type
+		bool readChunk(int x, int z, memblock &payload, uint8_t &compressionType) const {
+			
 			if (!m_good)
-				return;
-			m_process(); // we read the compressed data
+				return false;
+			
+			int index = RegionHeader::chunkIndex(x, z);
+			lock_guard<mutex> chunkLock(m_chunkMutexes[index]);
+			return readChunkPayload(m_fd, location(index), payload, compressionType);
 		}
 	
-		bool good() { return m_good; }
+		// the size of the compressed payload of the chunk (x, z), from the length written in front of it.
+		// 0 if the chunk is absent or if its length does not match its sectors. It costs a read: when every
+		// chunk is visited anyway, forEachChunkWithSize() gives it for free
+		uint32_t compressedSize(int x, int z) const {
+			
+			if (!m_good)
+				return 0;
+			
+			int index = RegionHeader::chunkIndex(x, z);
+			lock_guard<mutex> chunkLock(m_chunkMutexes[index]);
+			ChunkLocation loc = location(index);
+			char chunkHeader[RegionChunkHeaderSize];
+			if (loc.empty() || pread(m_fd, chunkHeader, RegionChunkHeaderSize, static_cast<off_t>(loc.offset) * RegionSectorSize) != RegionChunkHeaderSize)
+				return 0;
+			
+			uint32_t length = readBigEndian(chunkHeader, 4); // counts the compression type byte
+			return length == 0 || length + 4 > static_cast<uint32_t>(loc.sectorCount) * RegionSectorSize ? 0 : length - 1;
+		}
 	
-	private:
-		bool m_good;
-		memblock m_rawData;
-		vector<memblock> m_chunks;
+		// reads and decompresses the chunk (x, z) into 'data'. 'compressedSize', if given, receives the size
+		// of its compressed payload
+		bool chunkData(int x, int z, memblock &data, uint32_t *compressedSize = nullptr) const {
+			
+			memblock &payload = workerBuffers().compressed;
+			uint8_t compressionType;
+			if (!readChunk(x, z, payload, compressionType))
+				return false;
+			if (compressedSize)
+				*compressedSize = static_cast<uint32_t>(payload.size());
+			
+			const Codec *codec = CodecRegistry::instance().codec(compressionType);
+			return codec && codec->decompress(payload.data(), payload.size(), data);
+		}
 	
-		// reads the header and the compressed chunk data, then decompress it
-		void m_process() {
+		// parses the chunk (x, z) while inflating it: the decompressed chunk is never held in memory.
+		// Returns nullptr if the chunk is absent or corrupted. The tree is yours to delete
+		Tag *parseChunk(int x, int z) const {
 			
-			const int locationTableSize = 4096;
-			const int sectorSizeInBytes = 4096;
+			WorkerBuffers &buffers = workerBuffers();
+			memblock &payload = buffers.compressed;
+			uint8_t compressionType;
+			if (!readChunk(x, z, payload, compressionType))
+				return nullptr;
 			
-			if (m_rawData.size() < locationTableSize * 2) { // x2 for the timestamp table
-				m_good = false;
-				return;
+			StreamParser &parser = buffers.streamParser;
+			if (compressionType == CompressionZlib || compressionType == CompressionGZip) {
+				InflateSource source(payload.data(), payload.size());
+				return parser.build(source);
 			}
 			
-			// the array long enough to not need to check out of bounds
-			int index = 0;
-			while(index < locationTableSize) {
-				
-				// we get the first 3 bytes of the table : the offset
-				vector<int8_t> buff;
-				buff.push_back(m_rawData[index]); index++; // 1
-				buff.push_back(m_rawData[index]); index++; // 2
-				buff.push_back(m_rawData[index]); index++; // 3
-				
-				// we make the endianess match the machine's
-				// warning ugly-ass code below for 3 lines
-				SINGLE_GETINT offset = 0;
-				// this ugly code below switches the endianness of the int if needed
-				if (HostEndianness().isBig()) for (int j = 0; j < 3; ++j) (reinterpret_cast<char *>(&offset))[j] = buff[j]; // yes this is ugly-ass code speaking,
-				else for (int j = 0; j < 3; ++j) (reinterpret_cast<char *>(&offset))[j] = buff[(3 - 1) - j];				// what can I do for you today?
+			// the other codecs cannot be streamed, the chunk is decompressed first
+			const Codec *codec = CodecRegistry::instance().codec(compressionType);
+			memblock &decompressed = buffers.decompressed;
+			if (!codec || !codec->decompress(payload.data(), payload.size(), decompressed))
+				return nullptr;
+			MemorySource source(decompressed.data(), decompressed.size());
+			return parser.build(source);
+		}
+	
+		// calls 'visitor' for every chunk of the region, with its decompressed data. In OrderSector,
+		// the chunks are visited in the order of the file and the ones that follow each other are read
+		// at once, up to 'maxRunSectors' sectors per read. The chunks rejected by 'filter' are not read.
+		// The data given to the visitor is not a buffer of the thread, so the visitor may read other
+		// chunks (chunkData(), parseChunk()...). Returns the number of chunks visited
+		size_t forEachChunk(const RegionChunkVisitor &visitor, ChunkOrder order = OrderIndex, uint32_t maxRunSectors = DefaultRunSectors,
+							const RegionChunkFilter &filter = RegionChunkFilter()) const {
+			return forEachChunkWithSize([&visitor](int x, int z, const memblock &data, uint32_t) {
+				visitor(x, z, data);
+			}, order, maxRunSectors, filter);
+		}
+	
+		// same as forEachChunk(), the visitor also being given the size of the compressed payload of the
+		// chunk, known once the chunk is read
+		size_t forEachChunkWithSize(const RegionChunkSizeVisitor &visitor, ChunkOrder order = OrderIndex, uint32_t maxRunSectors = DefaultRunSectors,
+									const RegionChunkFilter &filter = RegionChunkFilter()) const {
+			
+			if (!m_good)
+				return 0;
+			
+			size_t visited = 0;
+			memblock data; // reused from one chunk to the next
+			uint32_t compressedSize;
+			if (order == OrderIndex) {
+				for (int index = 0; index < RegionChunkCount; index++) {
+					if (location(index).empty() || (filter && !filter(index % 32, index / 32)))
+						continue;
+					if (!chunkData(index % 32, index / 32, data, &compressedSize)) {
+						cerr << "[Warning] chunk " << index << " of " << m_path << " cannot be read" << endl;
+						continue;
+					}
+					visitor(index % 32, index / 32, data, compressedSize);
+					visited++;
+				}
+				return visited;
+			}
+			
+			RegionHeader snapshot = header();
+			if (filter) {
+				for (int index = 0; index < RegionChunkCount; index++)
+					if (!filter(index % 32, index / 32))
+						snapshot.location(index) = ChunkLocation(); // not part of any run
+			}
+			vector<int> moved; // chunks rewritten elsewhere since the snapshot, read on their own at the end
+			memblock sectors; // not a buffer of the thread either
+			
+			for (const SectorRun &run : sectorRuns(snapshot, maxRunSectors)) {
 				
+				// the writers are held off while the run is read, so that its chunks are not moved
+				// or rewritten under our feet. The other readers, in sector order or not, are not
+				{
+					SharedLock writeLock(m_writeMutex);
+					sectors.resize(static_cast<size_t>(run.sectorCount) * RegionSectorSize);
+					ssize_t got = pread(m_fd, sectors.data(), sectors.size(), static_cast<off_t>(run.offset) * RegionSectorSize);
+					sectors.resize(got > 0 ? got : 0);
+					
+					lock_guard<mutex> headerLock(m_headerMutex);
+					for (int index : run.chunks) {
+						const ChunkLocation &now = m_header.location(index), &then = snapshot.location(index);
+						if (now.offset != then.offset || now.sectorCount != then.sectorCount)
+							moved.push_back(index);
+					}
+				}
 				
-				// ------
-				// we get the next byte : the length
-				int8_t length = m_rawData[index]; // index is already incremented from the index++ above
-				index++;
+				for (int index : run.chunks) {
+					
+					if (find(moved.begin(), moved.end(), index) != moved.end())
+						continue;
+					
+					const char *payload;
+					size_t payloadSize, begin = static_cast<size_t>(snapshot.location(index).offset - run.offset) * RegionSectorSize;
+					uint8_t compressionType;
+					const Codec *codec = nullptr;
+					size_t length = static_cast<size_t>(snapshot.location(index).sectorCount) * RegionSectorSize; // its own sectors, not the run
+					if (begin >= sectors.size() ||
+						!locateChunkPayload(&sectors[begin], min(sectors.size() - begin, length), payload, payloadSize, compressionType) ||
+						!(codec = CodecRegistry::instance().codec(compressionType)) ||
+						!codec->decompress(payload, payloadSize, data)) {
+						cerr << "[Warning] chunk " << index << " of " << m_path << " cannot be read" << endl;
+						continue;
+					}
+					
+					visitor(index % 32, index / 32, data, static_cast<uint32_t>(payloadSize));
+					visited++;
+				}
+			}
+			
+			for (int index : moved) {
+				if (chunkData(index % 32, index / 32, data, &compressedSize)) {
+					visitor(index % 32, index / 32, data, compressedSize);
+					visited++;
+				}
+			}
+			return visited;
+		}
+	
+		// compresses 'data' (an uncompressed NBT structure) and writes it as the chunk (x, z).
+		// The change is durable once commit() has been called
+		bool writeChunk(int x, int z, const memblock &data, uint32_t timestamp = 0, uint8_t compressionType = CompressionZlib) {
+			
+			if (!m_good)
+				return false;
+			
+			const Codec *codec = CodecRegistry::instance().codec(compressionType);
+			memblock &compressed = workerBuffers().compressed;
+			if (!codec || !codec->compress(data.data(), data.size(), compressed)) {
+				cerr << "[Error] cannot compress chunk (" << x << ", " << z << ")" << endl;
+				return false;
+			}
+			
+			int index = RegionHeader::chunkIndex(x, z);
+			lock_guard<SharedMutex> writeLock(m_writeMutex);
+			if (!m_openWriter())
+				return false;
+			
+			lock_guard<mutex> chunkLock(m_chunkMutexes[index]);
+			if (!m_writer->writeCompressedChunk(x, z, compressed.data(), compressed.size(), compressionType, timestamp))
+				return false;
+			
+			lock_guard<mutex> headerLock(m_headerMutex);
+			m_header.location(index) = m_writer->header().location(index);
+			return true;
+		}
+	
+		// removes the chunk (x, z) from the region. Returns false if the file cannot be written
+		bool removeChunk(int x, int z) {
+			
+			if (!m_good)
+				return false;
+			
+			int index = RegionHeader::chunkIndex(x, z);
+			lock_guard<SharedMutex> writeLock(m_writeMutex);
+			if (!m_openWriter())
+				return false;
+			
+			lock_guard<mutex> chunkLock(m_chunkMutexes[index]);
+			m_writer->removeChunk(x, z);
+			
+			lock_guard<mutex> headerLock(m_headerMutex);
+			m_header.location(index) = ChunkLocation();
+			return true;
+		}
+	
+		// makes the writes durable (see RegionWriter::commit())
+		bool commit() {
+			lock_guard<SharedMutex> writeLock(m_writeMutex);
+			return !m_writer || m_writer->commit();
+		}
+	
+		bool good() const { return m_good; }
+		const string &path() const { return m_path; }
+	
+		// a copy of the header, or of one of its entries, as it is at the time of the call
+		RegionHeader header() const {
+			lock_guard<mutex> headerLock(m_headerMutex);
+			return m_header;
+		}
+		ChunkLocation location(int index) const {
+			lock_guard<mutex> headerLock(m_headerMutex);
+			return m_header.location(index);
+		}
+		ChunkLocation location(int x, int z) const { return location(RegionHeader::chunkIndex(x, z)); }
+	
+		// the current size of the file
+		size_t fileSize() const {
+			struct stat info;
+			return m_fd >= 0 && fstat(m_fd, &info) == 0 ? static_cast<size_t>(info.st_size) : 0;
+		}
+	
+		// statistics of the file computed from the header, without decompressing anything
+		RegionStats stats(int oversizedSectors = RegionOversizedSectors) const {
+			RegionStats stats;
+			stats.compute(header(), fileSize(), oversizedSectors);
+			return stats;
+		}
+	
+		// measures how much of the file is wasted, using only the header
+		RegionFragmentation fragmentation() const {
+			
+			RegionHeader snapshot = header();
+			RegionFragmentation frag;
+			frag.fileSectors = (fileSize() + RegionSectorSize - 1) / RegionSectorSize;
+			
+			SectorAllocator allocator;
+			allocator.build(snapshot, frag.fileSectors);
+			
+			for (size_t sector = RegionHeaderSectors; sector < allocator.size(); sector++) {
+				if (allocator.used(sector))
+					frag.usedSectors++;
+				else if (sector == RegionHeaderSectors || allocator.used(sector - 1))
+					frag.holes++; // the first free sector of a hole
+			}
+			frag.freeSectors = allocator.size() - RegionHeaderSectors - frag.usedSectors;
+			
+			// a compacted file has its chunks one after the other, in the order of the location table
+			uint32_t expected = RegionHeaderSectors;
+			for (int index = 0; index < RegionChunkCount; index++) {
+				const ChunkLocation &loc = snapshot.location(index);
+				if (loc.empty())
+					continue;
+				if (loc.offset != expected)
+					frag.misplacedChunks++;
+				expected = loc.offset + loc.sectorCount;
+			}
+			
+			return frag;
+		}
+	
+		// rewrites the file with its chunks contiguous and in spatial order (the order of the location table).
+		// The compressed payloads are copied as they are. The new file replaces the old one atomically
+		bool compact() {
+			
+			if (!m_good)
+				return false;
+			
+			// we wait for every reader and writer to finish
+			lock_guard<SharedMutex> writeLock(m_writeMutex);
+			vector<unique_lock<mutex>> chunkLocks;
+			for (int index = 0; index < RegionChunkCount; index++)
+				chunkLocks.push_back(unique_lock<mutex>(m_chunkMutexes[index]));
+			
+			if (m_writer && !m_writer->commit())
+				return false;
+			m_writer.reset();
+			
+			RegionHeader header = m_header;
+			memblock compacted(RegionHeaderSize, 0);
+			
+			for (int index = 0; index < RegionChunkCount; index++) {
 				
-//				cout << "Building chunks... (" << setprecision(1) << fixed << (((float)index / 4) / 1024) * 100 << "% completed)" << endl;
+				ChunkLocation &loc = header.location(index);
+				if (loc.empty())
+					continue;
 				
-				// if both length and offset are 0, the chunk are not yet loaded into the file so we skip this loop
-				if ((length | offset) == 0) {
-					m_chunks.push_back(memblock(0)); // put an empty chunk into the array for future reference
+				size_t available = static_cast<size_t>(loc.sectorCount) * RegionSectorSize;
+				size_t begin = compacted.size();
+				compacted.resize(begin + available);
+				if (pread(m_fd, &compacted[begin], available, static_cast<off_t>(loc.offset) * RegionSectorSize) != static_cast<ssize_t>(available)) {
+					cerr << "[Warning] chunk " << index << " of " << m_path << " is outside of the file, it is dropped" << endl;
+					compacted.resize(begin);
+					loc = ChunkLocation();
 					continue;
 				}
 				
+				// we only keep the bytes really used by the chunk, unless its length is corrupted
+				size_t length = readBigEndian(&compacted[begin], 4) + 4;
+				if (length <= 4 || length > available)
+					length = available;
 				
-				// ------
-				// we need to get the exact remaining length of compressed data (4 bytes) then the type of compression (1 byte)
-				buff.clear();
-				for (int8_t i = 0; i < 4; i++)
-					buff.push_back(m_rawData[(offset * sectorSizeInBytes) + i]);
-				
-				// we make the endianess match the machine's
-				// warning ugly-ass code below for 3 lines
-				SINGLE_GETINT remainingLength = 0;
-				// this ugly code below switches the endianness of the int if needed
-				if (HostEndianness().isBig()) for (int j = 0; j < 4; ++j) (reinterpret_cast<char *>(&remainingLength))[j] = buff[j];
-				else for (int j = 0; j < 4; ++j) (reinterpret_cast<char *>(&remainingLength))[j] = buff[(4 - 1) - j];
-				
-				// we skip the next byte (compression type)
-				// the gzip compression type is never used, but it would be good to support it IF one day it is used
-				// TODO: Support GZip
+				uint32_t sectors = static_cast<uint32_t>((length + RegionSectorSize - 1) / RegionSectorSize);
+				loc.offset = static_cast<uint32_t>(begin / RegionSectorSize);
+				loc.sectorCount = static_cast<uint8_t>(sectors);
 				
-				
-				// ------
-				// we can read the chunk data here
-				// we get all the bytes in the range [offset, offset + length]
-				memblock compressedBytes;
-				for (unsigned long int currentByte = 0; currentByte < remainingLength; currentByte++)
-					compressedBytes.push_back(m_rawData[(offset * sectorSizeInBytes) + currentByte + 5]); // the "+ 5" is to skip the chunk header (5 bytes wide)
-				
-				// we decompress the chunk data
-				uLongf outputSize = 65536;
-				memblock decompressedBytes(outputSize);
-				while (m_decompressChunk(compressedBytes, decompressedBytes) == Z_BUF_ERROR) {
-					outputSize += 4096;
-					decompressedBytes.resize(outputSize);
-				}
-				
-				m_chunks.push_back(decompressedBytes);
+				compacted.resize(begin + sectors * RegionSectorSize);
+				fill(compacted.begin() + begin + length, compacted.end(), 0); // padding up to the end of the sector
 			}
 			
-			Parser parser;
+			header.serialize(&compacted[0]);
+			if (!atomicWriteFile(m_path, compacted)) {
+				cerr << "[Error] cannot save the compacted region " << m_path << endl;
+				return false;
+			}
 			
-//			ofstream outbitch("outbitch", ios::binary);
-//			for (int fj = 0; fj < m_chunks[8].size(); fj++)
-//				outbitch.put(m_chunks[8][fj]);
+			// the file has been replaced, we read the new one
+			int fd = ::open(m_path.c_str(), O_RDONLY);
+			if (fd < 0) {
+				m_good = false;
+				return false;
+			}
+			::close(m_fd);
+			m_fd = fd;
 			
-			Array *bestial = (Array *)parser.build(m_chunks[8].begin(), m_chunks[8].end());
-			if (bestial)
-				bestial->print();
-			else cout << "lolilel" << endl;
+			lock_guard<mutex> headerLock(m_headerMutex);
+			m_header = header;
+			return true;
 		}
 	
-		int m_decompressChunk(memblock &compressed, memblock &output) {
-			const Bytef *input = reinterpret_cast<const Bytef *>(compressed.data());
-			uLongf inlen = output.size();
-			return uncompress((Bytef *)(&output.front()), &inlen, input, compressed.size());
+	private:
+		bool m_good;
+		string m_path;
+		int m_fd;
+		RegionHeader m_header;
+	
+		unique_ptr<RegionWriter> m_writer; // opened at the first write
+		mutable mutex m_headerMutex;
+		mutable mutex m_chunkMutexes[RegionChunkCount];
+		mutable SharedMutex m_writeMutex; // shared by the sector reads of forEachChunk()
+	
+		// non-copyable: the object owns a file descriptor and its locks
+		Region(const Region &);
+		Region &operator=(const Region &);
+	
+		// must be called with m_writeMutex locked
+		bool m_openWriter() {
+			if (!m_writer)
+				m_writer.reset(new RegionWriter(m_path));
+			return m_writer->good();
 		}
 };
 	
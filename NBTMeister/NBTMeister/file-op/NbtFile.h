@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NBTFILE_H
+#define NBTFILE_H
+
+#include <string>
+#include <algorithm>
+#include <memory>
+#include <functional>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Parser.h"
+#include "Codec.h"
+#include "StreamParser.h"
+#include "BufferPool.h"
+#include "AsyncIO.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// the ways a standalone NBT file can be stored
+enum NbtContainer {
+	ContainerRaw,	// uncompressed NBT
+	ContainerGZip,	// level.dat, villages.dat, most .nbt files
+	ContainerZlib
+};
+
+// the ISIZE trailer of a gzip file is only trusted up to this many times the size of the file:
+// NBT rarely inflates past 20:1, and the codec grows its output if the hint is too small
+const size_t MaxGZipExpansion = 32;
+
+// guesses the container from the first bytes of a file
+inline NbtContainer detectContainer(const char *data, size_t size) {
+	
+	if (size < 2)
+		return ContainerRaw;
+	
+	uint8_t first = static_cast<uint8_t>(data[0]), second = static_cast<uint8_t>(data[1]);
+	if (first == 0x1f && second == 0x8b)
+		return ContainerGZip;
+	
+	// a zlib header: deflate method (8) in the low nibble, and a checksum making the 16 bits a multiple of 31.
+	// An uncompressed NBT file starts with a tag type, and a root String (8) can pass that test. Its
+	// window would be 256 bytes, which zlib has not written since 1.2.9 (a window of 8 bits becomes 9),
+	// so we only accept the windows of 512 bytes and more
+	if ((first & 0x0f) == 8 && first != TagTypeString && (first >> 4) <= 7 && ((first << 8) | second) % 31 == 0)
+		return ContainerZlib;
+	
+	return ContainerRaw;
+}
+
+// inflates (if needed) and parses a standalone NBT file already in memory.
+// Returns nullptr on error, 'status' receiving the reason when given. The tree is yours to delete
+inline Tag *decodeNbt(const char *data, size_t size, parser_status *status = nullptr) {
+	
+	if (status)
+		*status = malformed_stream;
+	
+	WorkerBuffers &buffers = workerBuffers();
+	memblock &decompressed = buffers.decompressed;
+	NbtContainer container = detectContainer(data, size);
+	bool inflated = true;
+	if (container == ContainerGZip) {
+		size_t sizeHint = 0;
+		if (size >= 4) {
+			const uint8_t *trailer = reinterpret_cast<const uint8_t *>(data + size - 4);
+			sizeHint = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | static_cast<uint32_t>(trailer[3]) << 24;
+			sizeHint = min(sizeHint, size * MaxGZipExpansion); // the trailer comes from the file, it can lie
+		}
+		inflated = CodecRegistry::instance().codec(CompressionGZip)->decompress(data, size, decompressed, sizeHint);
+	}
+	else if (container == ContainerZlib)
+		inflated = CodecRegistry::instance().codec(CompressionZlib)->decompress(data, size, decompressed);
+	
+	// we parse the (decompressed) data
+	Tag *root = nullptr;
+	if (inflated) {
+		StreamParser &parser = buffers.streamParser;
+		if (container == ContainerRaw) {
+			MemorySource source(data, size);
+			root = parser.build(source);
+		}
+		else {
+			MemorySource source(decompressed.data(), decompressed.size());
+			root = parser.build(source);
+		}
+		if (status)
+			*status = parser.status();
+	}
+	
+	return root;
+}
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Loads a standalone NBT file, whatever its container, in a single pass:
+ 
+ 	1) the file is mapped in memory (or read at once if it cannot be mapped);
+ 	2) its container is detected from its first bytes;
+ 	3) it is inflated in one go. For gzip files, the size of the decompressed data is known
+ 	   in advance thanks to the ISIZE field of the trailer (the last 4 bytes, little-endian),
+ 	   so the output buffer is allocated once. The hint is capped (see MaxGZipExpansion), as a
+ 	   corrupt trailer could otherwise ask for 4 GiB;
+ 	4) the decompressed data is parsed.
+ 
+ Returns nullptr on error, 'status' receiving the reason when given. The tree is yours to delete.
+ */
+inline Tag *loadNbtFile(const string &path, parser_status *status = nullptr) {
+	
+	if (status)
+		*status = malformed_stream;
+	
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+	
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		return nullptr;
+	}
+	size_t size = static_cast<size_t>(info.st_size);
+	
+	// 1) we map the file, or read it if it cannot be mapped
+	memblock fileData;
+	const char *data = nullptr;
+	void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapping != MAP_FAILED)
+		data = static_cast<const char *>(mapping);
+	else {
+		fileData.resize(size);
+		size_t done = 0;
+		while (done < size) {
+			ssize_t got = pread(fd, &fileData[done], size - done, done);
+			if (got <= 0)
+				break;
+			done += got;
+		}
+		fileData.resize(done);
+		size = done;
+		data = fileData.data();
+	}
+	close(fd);
+	
+	// 2), 3) & 4)
+	Tag *root = decodeNbt(data, size, status);
+	
+	if (mapping != MAP_FAILED)
+		munmap(mapping, info.st_size);
+	return root;
+}
+
+// called once a file loaded by loadNbtFileAsync() is decoded, with its tree (nullptr on error, yours to delete)
+typedef function<void(const string &path, Tag *root, parser_status status)> NbtFileCallback;
+
+// reads a standalone NBT file with an AsyncReader (see AsyncIO.h), then decodes it like loadNbtFile()
+// does. 'done' is called on one of the threads of the reader, or right away if the file cannot be opened
+inline void loadNbtFileAsync(AsyncReader &reader, const string &path, const NbtFileCallback &done) {
+	
+	shared_ptr<FileHandle> file(new FileHandle(path));
+	if (!file->good() || file->size() == 0) {
+		done(path, nullptr, malformed_stream);
+		return;
+	}
+	
+	reader.readFile(file, [path, done](AsyncRead &read) {
+		parser_status status = malformed_stream;
+		Tag *root = read.good() ? decodeNbt(read.data.data(), read.data.size(), &status) : nullptr;
+		done(path, root, status);
+	});
+}
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // NBTFILE_H
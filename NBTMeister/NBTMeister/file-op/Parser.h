@@ -28,6 +28,7 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <algorithm>
 #include <string>
 #include <vector>
 #include "../config.h"
@@ -48,7 +49,8 @@ enum parser_status {
 	range_illegal,
 	malformed_stream,
 	null_iterator,
-	what_the_fuck
+	what_the_fuck,
+	need_more_data // only used by the IncrementalParser: the document is not complete yet
 };
 
 /*
@@ -61,10 +63,11 @@ enum parser_status {
 class Parser {
 	
 	public:
-		Parser() : m_status(good) {}
+		Parser() : m_blockSize(0), m_status(good) {}
 	
 		Tag *build(memblock::iterator cursor, memblock::iterator end, feedback_fct feedback = nullptr) {
 			
+			reset(); // a parser can be used for several documents
 			if (cursor == end)
 				return nullptr;
 			
@@ -75,10 +78,19 @@ class Parser {
 		// returns the 'status' of the parser
 		parser_status status() { return m_status; }
 	
+		// forgets the previous document. The scratch buffer keeps its capacity, so a parser
+		// that is reused does not allocate anything for the numbers it reads
+		void reset() {
+			m_blockSize = 0;
+			m_status = good;
+			m_buffer.clear();
+		}
+	
 	private:
 		size_t m_blockSize;
 		typedef char byte;
 		parser_status m_status;
+		vector<byte> m_buffer; // scratch buffer for the bytes of the number being read
 	
 		// this function builds a tree from the data passed.
 		// it creates an object on the heap, so don't forget to free it!
@@ -91,6 +103,11 @@ class Parser {
 				m_status = range_illegal;
 				return nullptr; // return NULL. error checking is your friend
 			}
+			else if (m_status != good || cursor == end) { // a truncated document, or an error in a sibling
+				if (m_status == good)
+					m_status = null_iterator;
+				return nullptr;
+			}
 			
 			// we parse all of the data, one byte at time
 			while (true) {
@@ -117,7 +134,7 @@ class Parser {
 				// get the length of the name
 				SINGLE_GETSHORT tagNameLength;
 				m_secureIncrement(cursor, end, reassign, feedback);
-				vector<byte> buff = m_makeBuffer<typeof(tagNameLength)>(cursor, end, reassign, feedback);
+				vector<byte> &buff = m_makeBuffer<typeof(tagNameLength)>(cursor, end, reassign, feedback);
 				if (m_status != good)
 					return nullptr;
 				m_rehostEndianness<typeof(tagNameLength)>(tagNameLength, buff);
@@ -186,7 +203,7 @@ class Parser {
 					// we get the length of the list
 					SINGLE_GETINT tagPayloadLength;
 					typedef typeof(tagPayloadLength) mtype;
-					vector<byte> buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
+					vector<byte> &buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
 					if (m_status != good)
 						return nullptr;
 					m_rehostEndianness<mtype>(tagPayloadLength, buff);
@@ -229,7 +246,7 @@ class Parser {
 				// the desired type
 				SINGLE_GETSHORT tagPayloadLength;
 				typedef typeof(tagPayloadLength) mtype;
-				vector<byte> buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
+				vector<byte> &buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
 				if (m_status != good)
 					return nullptr;
 				m_rehostEndianness<mtype>(tagPayloadLength, buff);
@@ -253,13 +270,13 @@ class Parser {
 			// ====================================================================
 			// ====================================================================
 			// ====================================================================
-			// BOOKMARK: Byte & Int arrays
-			else if (tagType == TagTypeByteArray || tagType == TagTypeIntArray) { // we need to read 4 bytes to get the length
+			// BOOKMARK: Byte, Int & Long arrays
+			else if (tagType == TagTypeByteArray || tagType == TagTypeIntArray || tagType == TagTypeLongArray) { // we need to read 4 bytes to get the length
 				
 				
 				SINGLE_GETINT tagPayloadLength;
 				typedef typeof(tagPayloadLength) mtype;
-				vector<byte> buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
+				vector<byte> &buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
 				if (m_status != good)
 					return nullptr;
 				m_rehostEndianness<mtype>(tagPayloadLength, buff);
@@ -267,6 +284,7 @@ class Parser {
 				if (tagType == TagTypeByteArray) { // we need to read 'size' bytes
 					
 					vector<SINGLE_GETBYTE> tagPayload;
+					tagPayload.reserve(m_reservable(tagPayloadLength, 1, cursor, end));
 					for (int i = 0; i < tagPayloadLength; i++) {
 						
 						m_secureIncrement(cursor, end, reassign, feedback);
@@ -277,16 +295,37 @@ class Parser {
 					
 					return new Single(tagName, tagPayload);
 				}
+				else if (tagType == TagTypeLongArray) { // we need to read 'size' * 8 bytes (we are reading long's)
+					
+					vector<SINGLE_GETLONG> array;
+					array.reserve(m_reservable(tagPayloadLength, 8, cursor, end));
+					for (int i = 0; i < tagPayloadLength; i++) {
+						
+						m_secureIncrement(cursor, end, reassign, feedback);
+						
+						SINGLE_GETLONG tagPayload;
+						typedef typeof(tagPayload) mtype;
+						vector<byte> &buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
+						if (m_status != good)
+							return nullptr;
+						m_rehostEndianness<mtype>(tagPayload, buff);
+						
+						array.push_back(tagPayload);
+					}
+					
+					return new Single(tagName, array);
+				}
 				else { // we need to read 'size' * 4 bytes (we are reading int's)
 					
 					vector<SINGLE_GETINT> array;
+					array.reserve(m_reservable(tagPayloadLength, 4, cursor, end));
 					for (int i = 0; i < tagPayloadLength; i++) {
 						
 						m_secureIncrement(cursor, end, reassign, feedback);
 						
 						SINGLE_GETINT tagPayload;
 						typedef typeof(tagPayload) mtype;
-						vector<byte> buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
+						vector<byte> &buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
 						if (m_status != good)
 							return nullptr;
 						m_rehostEndianness<mtype>(tagPayload, buff);
@@ -327,7 +366,7 @@ class Parser {
 						// the desired type
 						SINGLE_GETSHORT tagPayload;
 						typedef typeof(tagPayload) mtype;
-						vector<byte> buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
+						vector<byte> &buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
 						if (m_status != good)
 							return nullptr;
 						m_rehostEndianness<mtype>(tagPayload, buff);
@@ -344,7 +383,7 @@ class Parser {
 						// the desired type
 						SINGLE_GETINT tagPayload;
 						typedef typeof(tagPayload) mtype;
-						vector<byte> buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
+						vector<byte> &buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
 						if (m_status != good)
 							return nullptr;
 						m_rehostEndianness<mtype>(tagPayload, buff);
@@ -361,7 +400,7 @@ class Parser {
 						// the desired type
 						SINGLE_GETLONG tagPayload;
 						typedef typeof(tagPayload) mtype;
-						vector<byte> buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
+						vector<byte> &buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
 						if (m_status != good)
 							return nullptr;
 						m_rehostEndianness<mtype>(tagPayload, buff);
@@ -378,7 +417,7 @@ class Parser {
 						// the desired type
 						SINGLE_GETFLOAT tagPayload;
 						typedef typeof(tagPayload) mtype;
-						vector<byte> buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
+						vector<byte> &buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
 						if (m_status != good)
 							return nullptr;
 						m_rehostEndianness<mtype>(tagPayload, buff);
@@ -395,7 +434,7 @@ class Parser {
 						// the desired type
 						SINGLE_GETDOUBLE tagPayload;
 						typedef typeof(tagPayload) mtype;
-						vector<byte> buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
+						vector<byte> &buff = m_makeBuffer<mtype>(cursor, end, reassign, feedback);
 						if (m_status != good)
 							return nullptr;
 						m_rehostEndianness<mtype>(tagPayload, buff);
@@ -413,25 +452,36 @@ class Parser {
 		// increment the iterator if possible, and send feedback
 		void m_secureIncrement(memblock::iterator &mov, memblock::iterator lim, memblock::iterator &reassign, feedback_fct feedback) {
 			
-			if (mov == lim)
+			// the last byte of a document is its final TagEnd: reaching the end of the block means
+			// it was truncated, and we never dereference the end iterator
+			if (mov == lim || ++mov == lim)
 				m_status = null_iterator;
-			mov++;
 			reassign = mov;
 			
 			if (feedback)
 				feedback((m_blockSize - distance(mov, lim)) / (double)m_blockSize);
 		}
 	
+		// the length of an array comes from the document itself: we never reserve more elements than the
+		// bytes left in the block can hold, so a corrupt length ends with null_iterator instead of bad_alloc
+		size_t m_reservable(int32_t length, size_t elementSize, memblock::iterator cursor, memblock::iterator end) const {
+			
+			if (length <= 0 || cursor >= end)
+				return 0;
+			return min(static_cast<size_t>(length), static_cast<size_t>(distance(cursor, end)) / elementSize);
+		}
+	
+		// the returned buffer is reused by the next call
 		template <typename T>
-		vector<byte> m_makeBuffer(memblock::iterator &mov, memblock::iterator lim, memblock::iterator &reassign, feedback_fct feedback) {
+		vector<byte> &m_makeBuffer(memblock::iterator &mov, memblock::iterator lim, memblock::iterator &reassign, feedback_fct feedback) {
 			
-			vector<byte> buff;
-			for (int i = 0; i < sizeof(T); i++) {
-				buff.push_back(*mov);
+			m_buffer.clear();
+			for (int i = 0; i < sizeof(T) && m_status == good; i++) {
+				m_buffer.push_back(*mov);
 				if (i < sizeof(T) - 1) m_secureIncrement(mov, lim, reassign, feedback);
 			}
 			
-			return buff;
+			return m_buffer;
 		}
 	
 		// assign to a buffer bytes in correct endian-type
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <mutex>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <condition_variable>
+#include <unordered_set>
+#include "World.h"
+#include "../ThreadPool.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// number of missing chunks a prefetcher remembers
+const size_t PrefetchMissingMemory = 4096;
+
+// what a prefetcher did since its creation
+struct PrefetchCounters {
+	PrefetchCounters() : issued(0), completed(0), missing(0), skipped(0), dropped(0) {}
+	
+	uint64_t issued; // chunks given to the thread pool
+	uint64_t completed; // chunks loaded into the cache
+	uint64_t missing; // chunks that do not exist or cannot be decoded
+	uint64_t skipped; // chunks already cached, already being prefetched or known to be missing
+	uint64_t dropped; // chunks not prefetched because the in-flight budget was used
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Loads the chunks of a World ahead of their use, for one viewer moving in the world (a player,
+ a renderer sweeping tiles...). Every chunk requested by the viewer is observed: its direction
+ of travel is a moving average of the steps between two requests, rounded to one of the 8 directions.
+ 
+ 	- when the viewer moves, the chunks ahead of it are prefetched, up to 'distance' chunks away,
+ 	  along with their two neighbours on each side of the path;
+ 	- when it does not move, or jumps far away, its 8 neighbours are prefetched.
+ 
+ The chunks are read, inflated and parsed (or only brought to 'tier') by the threads of a ThreadPool,
+ never by the thread of the viewer. When the path crosses a region border, the next region file is
+ opened by the pool too. At most 'maxInFlight' chunks are being prefetched at a time: what does not
+ fit is dropped rather than queued, so the pool never lags behind the viewer and the foreground loads
+ never wait for stale prefetches. Give the pool fewer threads than there are cores to leave room for them.
+ 
+ The destructor waits for the chunks being prefetched.
+ */
+class Prefetcher {
+	
+	public:
+		Prefetcher(World &world, ThreadPool &pool, size_t maxInFlight = 8, int distance = 3, ChunkTier tier = TierParsed) :
+		m_world(world), m_pool(pool), m_maxInFlight(maxInFlight), m_distance(distance), m_tier(tier),
+		m_hasLast(false), m_lastX(0), m_lastZ(0), m_velocityX(0), m_velocityZ(0) {}
+	
+		~Prefetcher() { wait(); }
+	
+		// the chunk (x, z), loaded by the calling thread after the prefetch of what lies ahead has been scheduled
+		ChunkTree chunk(int x, int z) {
+			observe(x, z);
+			return m_world.chunk(x, z);
+		}
+	
+		// records a request of the viewer for the chunk (x, z) and prefetches what it will need next
+		void observe(int x, int z) {
+			
+			lock_guard<mutex> lock(m_mutex);
+			m_track(x, z);
+			
+			int directionX = m_round(m_velocityX);
+			int directionZ = m_round(m_velocityZ);
+			
+			// the chunks are scheduled the nearest first, so that a full budget drops the farthest ones
+			if (directionX == 0 && directionZ == 0) {
+				for (int dz = -1; dz <= 1; dz++)
+					for (int dx = -1; dx <= 1; dx++)
+						if (dx != 0 || dz != 0)
+							m_schedule(x + dx, z + dz);
+				return;
+			}
+			
+			for (int step = 1; step <= m_distance; step++) {
+				int aheadX = x + directionX * step;
+				int aheadZ = z + directionZ * step;
+				m_schedule(aheadX, aheadZ);
+				m_schedule(aheadX - directionZ, aheadZ + directionX);
+				m_schedule(aheadX + directionZ, aheadZ - directionX);
+			}
+		}
+	
+		// blocks until the chunks being prefetched are loaded
+		void wait() {
+			unique_lock<mutex> lock(m_mutex);
+			m_done.wait(lock, [this] { return m_inFlight.empty(); });
+		}
+	
+		// the predicted direction of travel, each component being -1, 0 or 1
+		int directionX() const { lock_guard<mutex> lock(m_mutex); return m_round(m_velocityX); }
+		int directionZ() const { lock_guard<mutex> lock(m_mutex); return m_round(m_velocityZ); }
+	
+		size_t inFlight() const { lock_guard<mutex> lock(m_mutex); return m_inFlight.size(); }
+		PrefetchCounters counters() const { lock_guard<mutex> lock(m_mutex); return m_counters; }
+	
+	private:
+		World &m_world;
+		ThreadPool &m_pool;
+		size_t m_maxInFlight;
+		int m_distance;
+		ChunkTier m_tier;
+	
+		bool m_hasLast; // false until the first request
+		int m_lastX;
+		int m_lastZ;
+		float m_velocityX; // chunks per request
+		float m_velocityZ;
+	
+		unordered_set<uint64_t> m_inFlight; // the keys (see chunkKey()) of the chunks being prefetched
+		unordered_set<uint64_t> m_missing; // the chunks found missing, not to be tried again and again
+		PrefetchCounters m_counters;
+		mutable mutex m_mutex;
+		condition_variable m_done;
+	
+		// non-copyable: the tasks of the pool point to the prefetcher
+		Prefetcher(const Prefetcher &);
+		Prefetcher &operator=(const Prefetcher &);
+	
+		// updates the velocity with the step from the last request. m_mutex must be locked
+		void m_track(int x, int z) {
+			
+			int stepX = x - m_lastX;
+			int stepZ = z - m_lastZ;
+			bool jumped = abs(stepX) > m_distance || abs(stepZ) > m_distance;
+			
+			if (!m_hasLast || jumped) {
+				m_velocityX = 0;
+				m_velocityZ = 0;
+			}
+			else {
+				m_velocityX = (m_velocityX + stepX) / 2;
+				m_velocityZ = (m_velocityZ + stepZ) / 2;
+			}
+			
+			m_hasLast = true;
+			m_lastX = x;
+			m_lastZ = z;
+		}
+	
+		// a component of the velocity, as a component of one of the 8 directions
+		static int m_round(float velocity) {
+			return velocity >= 0.25f ? 1 : velocity <= -0.25f ? -1 : 0;
+		}
+	
+		// gives the chunk (x, z) to the pool, unless it is not needed or the budget is used. m_mutex must be locked
+		void m_schedule(int x, int z) {
+			
+			uint64_t key = chunkKey(x, z);
+			if (m_world.residency(x, z) <= m_tier || m_inFlight.count(key) || m_missing.count(key)) {
+				m_counters.skipped++;
+				return;
+			}
+			if (m_inFlight.size() >= m_maxInFlight) {
+				m_counters.dropped++;
+				return;
+			}
+			
+			m_inFlight.insert(key);
+			m_counters.issued++;
+			m_pool.submit([this, x, z, key] {
+				
+				bool loaded = m_world.prefetch(x, z, m_tier);
+				
+				lock_guard<mutex> lock(m_mutex);
+				if (loaded)
+					m_counters.completed++;
+				else {
+					m_counters.missing++;
+					if (m_missing.size() >= PrefetchMissingMemory)
+						m_missing.clear(); // the chunks may have been generated since
+					m_missing.insert(key);
+				}
+				m_inFlight.erase(key);
+				if (m_inFlight.empty())
+					m_done.notify_all();
+			});
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // PREFETCHER_H
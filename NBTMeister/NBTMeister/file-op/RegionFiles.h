@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef REGIONFILES_H
+#define REGIONFILES_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <algorithm>
+#include <dirent.h>
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// a region file of a world directory, with its region coordinates
+struct RegionFile {
+	string path;
+	int x;
+	int z;
+};
+
+// the name of the file holding the region (x, z): "r.x.z.mca"
+inline string regionFileName(int x, int z) {
+	return "r." + to_string(x) + "." + to_string(z) + ".mca";
+}
+
+// the region that holds the chunk (x, z), chunk coordinates being global
+inline int chunkToRegion(int chunkCoord) { return chunkCoord >> 5; }
+
+// reads the region coordinates from a file name. Returns false if the name is not the one of a region file
+inline bool parseRegionFileName(const string &name, int &x, int &z) {
+	
+	int consumed = 0;
+	if (sscanf(name.c_str(), "r.%d.%d.mca%n", &x, &z, &consumed) != 2)
+		return false;
+	return consumed == static_cast<int>(name.size());
+}
+
+// lists the region files of a directory (usually "<world>/region"), sorted by coordinates
+inline vector<RegionFile> listRegionFiles(const string &directory) {
+	
+	vector<RegionFile> files;
+	DIR *dir = opendir(directory.c_str());
+	if (!dir)
+		return files;
+	
+	while (dirent *entry = readdir(dir)) {
+		RegionFile file;
+		if (parseRegionFileName(entry->d_name, file.x, file.z)) {
+			file.path = directory + "/" + entry->d_name;
+			files.push_back(file);
+		}
+	}
+	closedir(dir);
+	
+	sort(files.begin(), files.end(), [](const RegionFile &a, const RegionFile &b) {
+		return a.z != b.z ? a.z < b.z : a.x < b.x;
+	});
+	return files;
+}
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // REGIONFILES_H
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef REGIONHEADER_H
+#define REGIONHEADER_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include "../config.h"
+#include "../fixedendian.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// constants of the region file format (.mca)
+const int RegionChunkCount = 1024; // 32 x 32 chunks per region
+const int RegionSectorSize = 4096; // every offset in the file is expressed in sectors of 4 KiB
+const int RegionTableSize = RegionChunkCount * 4; // the location table and the timestamp table are both 4 KiB
+const int RegionHeaderSize = RegionTableSize * 2; // location table + timestamp table
+const int RegionHeaderSectors = RegionHeaderSize / RegionSectorSize;
+const int RegionChunkHeaderSize = 5; // 4 bytes for the length of the chunk + 1 byte for the compression type
+
+// reads a big-endian unsigned integer of 'width' bytes (1 to 4)
+inline uint32_t readBigEndian(const char *bytes, int width) {
+	uint32_t value = 0;
+	for (int i = 0; i < width; i++)
+		value = (value << 8) | static_cast<uint8_t>(bytes[i]);
+	return value;
+}
+
+// converts the sizeof(T) big-endian bytes of a number (an integer or a floating-point number) to a value in the host order
+template <typename T>
+inline T decodeBigEndian(const char *bytes) {
+	char copy[sizeof(T)];
+	memcpy(copy, bytes, sizeof(T));
+	if (HostEndianness().isLittle())
+		reverse(copy, copy + sizeof(T));
+	T value;
+	memcpy(&value, copy, sizeof(T));
+	return value;
+}
+
+// writes a big-endian unsigned integer of 'width' bytes (1 to 4)
+inline void writeBigEndian(char *bytes, uint32_t value, int width) {
+	for (int i = width - 1; i >= 0; i--) {
+		bytes[i] = static_cast<char>(value & 0xFF);
+		value >>= 8;
+	}
+}
+
+// an entry of the location table, along with its timestamp
+struct ChunkLocation {
+	ChunkLocation() : offset(0), sectorCount(0), timestamp(0) {}
+	
+	uint32_t offset; // offset of the chunk in the file, in sectors (3 bytes on disk)
+	uint8_t sectorCount; // number of sectors used by the chunk (1 byte on disk)
+	uint32_t timestamp; // last modification time of the chunk, in seconds since epoch
+	
+	// if both length and offset are 0, the chunk is not yet present in the file
+	bool empty() const { return (offset | sectorCount) == 0; }
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ The first 8 KiB of a region file are made of two tables of 1024 big-endian entries:
+ 
+ 	1) the location table: 3 bytes for the offset (in sectors) and 1 byte for the sector count;
+ 	2) the timestamp table: 4 bytes for the last modification time of the chunk.
+ 
+ The entry of the chunk (x, z) is at index (x + z * 32), x and z being relative to the region.
+ This class decodes both tables into ChunkLocation objects and can encode them back, so
+ the readers and the writers of region files share the same representation.
+ */
+class RegionHeader {
+	
+	public:
+		RegionHeader() : m_locations(RegionChunkCount) {}
+	
+		// decodes the header from the first RegionHeaderSize bytes of 'data'.
+		// returns false if the data is too short to contain a header
+		bool parse(const char *data, size_t size) {
+			
+			if (size < RegionHeaderSize)
+				return false;
+			
+			for (int index = 0; index < RegionChunkCount; index++) {
+				const char *entry = data + index * 4;
+				m_locations[index].offset = readBigEndian(entry, 3);
+				m_locations[index].sectorCount = static_cast<uint8_t>(entry[3]);
+				m_locations[index].timestamp = readBigEndian(entry + RegionTableSize, 4);
+			}
+			return true;
+		}
+	
+		// reads only the header of a region file. 'fileSize' receives the size of the whole file
+		bool load(const string &path, size_t *fileSize = nullptr) {
+			
+			ifstream infile(path, ios::binary);
+			if (!infile.good())
+				return false;
+			
+			char header[RegionHeaderSize];
+			infile.read(header, RegionHeaderSize);
+			if (infile.gcount() != RegionHeaderSize)
+				return false;
+			
+			if (fileSize) {
+				infile.seekg(0, infile.end);
+				*fileSize = static_cast<size_t>(infile.tellg());
+			}
+			return parse(header, RegionHeaderSize);
+		}
+	
+		// encodes the header into 'data', which must be at least RegionHeaderSize bytes wide
+		void serialize(char *data) const {
+			
+			for (int index = 0; index < RegionChunkCount; index++) {
+				char *entry = data + index * 4;
+				writeBigEndian(entry, m_locations[index].offset, 3);
+				entry[3] = static_cast<char>(m_locations[index].sectorCount);
+				writeBigEndian(entry + RegionTableSize, m_locations[index].timestamp, 4);
+			}
+		}
+	
+		// empties both tables
+		void clear() {
+			m_locations.assign(RegionChunkCount, ChunkLocation());
+		}
+	
+		// the index of a chunk in the tables. Coordinates may be global, only their
+		// position inside the region is kept
+		static int chunkIndex(int x, int z) { return (x & 31) + (z & 31) * 32; }
+	
+		ChunkLocation &location(int index) { return m_locations[index]; }
+		const ChunkLocation &location(int index) const { return m_locations[index]; }
+		ChunkLocation &location(int x, int z) { return m_locations[chunkIndex(x, z)]; }
+		const ChunkLocation &location(int x, int z) const { return m_locations[chunkIndex(x, z)]; }
+	
+	private:
+		vector<ChunkLocation> m_locations;
+};
+
+// reads the compressed payload of a chunk from an open region file, along with its compression type.
+// Returns false if the chunk is absent or if its length does not match its sectors
+inline bool readChunkPayload(int fd, const ChunkLocation &loc, vector<char> &payload, uint8_t &compressionType) {
+	
+	if (loc.empty())
+		return false;
+	
+	off_t position = static_cast<off_t>(loc.offset) * RegionSectorSize;
+	char chunkHeader[RegionChunkHeaderSize];
+	if (pread(fd, chunkHeader, RegionChunkHeaderSize, position) != RegionChunkHeaderSize)
+		return false;
+	
+	uint32_t length = readBigEndian(chunkHeader, 4); // counts the compression type byte
+	if (length == 0 || length + 4 > static_cast<uint32_t>(loc.sectorCount) * RegionSectorSize)
+		return false;
+	
+	compressionType = static_cast<uint8_t>(chunkHeader[4]);
+	payload.resize(length - 1);
+	size_t done = 0;
+	while (done < payload.size()) {
+		ssize_t got = pread(fd, &payload[done], payload.size() - done, position + RegionChunkHeaderSize + done);
+		if (got <= 0)
+			return false;
+		done += got;
+	}
+	return true;
+}
+
+// finds the payload of a chunk in the bytes of its sectors, read in one go from the file. 'size' must not
+// go past the sectors of the chunk, even when they were read with the following ones.
+// 'payload' points into 'sectors'. Returns false if the chunk length does not fit in them
+inline bool locateChunkPayload(const char *sectors, size_t size, const char *&payload, size_t &payloadSize, uint8_t &compressionType) {
+	
+	if (size < RegionChunkHeaderSize)
+		return false;
+	
+	uint32_t length = readBigEndian(sectors, 4); // counts the compression type byte
+	if (length == 0 || length + 4 > size)
+		return false;
+	
+	compressionType = static_cast<uint8_t>(sectors[4]);
+	payload = sectors + RegionChunkHeaderSize;
+	payloadSize = length - 1;
+	return true;
+}
+
+// the orders in which the chunks of a region can be visited
+enum ChunkOrder {
+	OrderIndex, // the order of the location table: x, then z
+	OrderSector // the order of the chunks in the file, their reads being coalesced (see sectorRuns())
+};
+
+// default size limit of a coalesced read: 1 MiB
+const uint32_t DefaultRunSectors = 256;
+
+// chunks stored one after the other in a region file, to be read in one go
+struct SectorRun {
+	SectorRun() : offset(0), sectorCount(0) {}
+	
+	uint32_t offset; // in sectors
+	uint32_t sectorCount;
+	vector<int> chunks; // indexes in the location table, in the order of the file
+};
+
+// sorts the chunks of a region by offset and groups the ones that follow each other into runs of
+// at most 'maxSectors' sectors (unless a chunk is bigger by itself). Two chunks separated by up to
+// 'maxGap' free sectors are grouped as well: reading a few unused sectors costs less than a seek
+inline vector<SectorRun> sectorRuns(const RegionHeader &header, uint32_t maxSectors = DefaultRunSectors, uint32_t maxGap = 0) {
+	
+	vector<int> chunks;
+	for (int index = 0; index < RegionChunkCount; index++)
+		if (!header.location(index).empty())
+			chunks.push_back(index);
+	sort(chunks.begin(), chunks.end(), [&header](int a, int b) {
+		return header.location(a).offset < header.location(b).offset;
+	});
+	
+	vector<SectorRun> runs;
+	for (int index : chunks) {
+		
+		const ChunkLocation &loc = header.location(index);
+		uint32_t end = loc.offset + loc.sectorCount;
+		
+		if (!runs.empty()) {
+			SectorRun &run = runs.back();
+			uint32_t runEnd = run.offset + run.sectorCount;
+			if (loc.offset <= runEnd + maxGap && max(end, runEnd) - run.offset <= maxSectors) {
+				run.sectorCount = max(end, runEnd) - run.offset; // overlapping chunks are corrupted, but still read once
+				run.chunks.push_back(index);
+				continue;
+			}
+		}
+		
+		runs.push_back(SectorRun());
+		runs.back().offset = loc.offset;
+		runs.back().sectorCount = loc.sectorCount;
+		runs.back().chunks.push_back(index);
+	}
+	return runs;
+}
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // REGIONHEADER_H
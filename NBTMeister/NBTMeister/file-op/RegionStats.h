@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef REGIONSTATS_H
+#define REGIONSTATS_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <iostream>
+#include <cstdint>
+#include "RegionHeader.h"
+#include "RegionFiles.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// chunks using at least this many sectors (512 KiB) are reported as oversized.
+// Minecraft cannot store more than 255 sectors (1 MiB) in a region file
+const int RegionOversizedSectors = 128;
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Statistics of a region file, computed from its header only: nothing is decompressed and
+ only the first 8 KiB of the file are read. The sizes of the chunks are the sizes of their
+ sectors, so they are rounded up to 4 KiB.
+ */
+struct RegionStats {
+	RegionStats() : fileSize(0), occupiedChunks(0), usedSectors(0), oldestTimestamp(0), newestTimestamp(0), chunkBytes(RegionChunkCount, 0) {}
+	
+	size_t fileSize;
+	size_t occupiedChunks;
+	size_t usedSectors; // sectors used by the chunks, header excluded
+	uint32_t oldestTimestamp; // 0 if there is no chunk, which occupiedChunks tells apart
+	uint32_t newestTimestamp;
+	vector<uint32_t> chunkBytes; // compressed size of each chunk, by index in the location table (0 if absent)
+	vector<int> oversizedChunks; // indexes of the chunks using at least RegionOversizedSectors sectors
+	
+	size_t fileSectors() const { return (fileSize + RegionSectorSize - 1) / RegionSectorSize; }
+	size_t usedBytes() const { return usedSectors * RegionSectorSize; }
+	
+	// fills the statistics from a header and the size of its file
+	void compute(const RegionHeader &header, size_t size, int oversizedSectors = RegionOversizedSectors) {
+		
+		*this = RegionStats();
+		fileSize = size;
+		
+		for (int index = 0; index < RegionChunkCount; index++) {
+			
+			const ChunkLocation &loc = header.location(index);
+			if (loc.empty())
+				continue;
+			
+			occupiedChunks++;
+			usedSectors += loc.sectorCount;
+			chunkBytes[index] = static_cast<uint32_t>(loc.sectorCount) * RegionSectorSize;
+			
+			if (loc.sectorCount >= oversizedSectors)
+				oversizedChunks.push_back(index);
+			
+			if (occupiedChunks == 1 || loc.timestamp < oldestTimestamp) // a timestamp of 0 is a real one
+				oldestTimestamp = loc.timestamp;
+			if (loc.timestamp > newestTimestamp)
+				newestTimestamp = loc.timestamp;
+		}
+	}
+	
+	// reads the header of a region file and computes its statistics
+	bool load(const string &path, int oversizedSectors = RegionOversizedSectors) {
+		
+		RegionHeader header;
+		size_t size = 0;
+		if (!header.load(path, &size))
+			return false;
+		
+		compute(header, size, oversizedSectors);
+		return true;
+	}
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Sums up the statistics of every region file of a directory. Each file costs a single
+ 8 KiB read, so a whole world is scanned at the speed of the file system.
+ */
+class WorldStats {
+	
+	public:
+		WorldStats() : m_fileBytes(0), m_occupiedChunks(0), m_usedSectors(0), m_oldest(0), m_newest(0), m_oversized(0) {}
+		WorldStats(const string &regionDirectory, int oversizedSectors = RegionOversizedSectors) :
+		m_fileBytes(0), m_occupiedChunks(0), m_usedSectors(0), m_oldest(0), m_newest(0), m_oversized(0) {
+			scan(regionDirectory, oversizedSectors);
+		}
+	
+		// reads the header of every region file of the directory. Returns the number of regions read
+		size_t scan(const string &regionDirectory, int oversizedSectors = RegionOversizedSectors) {
+			
+			*this = WorldStats();
+			for (const RegionFile &file : listRegionFiles(regionDirectory)) {
+				
+				RegionStats stats;
+				if (!stats.load(file.path, oversizedSectors)) {
+					cerr << "[Warning] cannot read the header of " << file.path << endl;
+					continue;
+				}
+				add(file, stats);
+			}
+			return m_regions.size();
+		}
+	
+		// adds the statistics of one region to the totals
+		void add(const RegionFile &file, const RegionStats &stats) {
+			
+			bool first = m_occupiedChunks == 0; // the first chunk seen sets the oldest timestamp, even to 0
+			m_fileBytes += stats.fileSize;
+			m_occupiedChunks += stats.occupiedChunks;
+			m_usedSectors += stats.usedSectors;
+			m_oversized += stats.oversizedChunks.size();
+			
+			if (stats.occupiedChunks) {
+				if (first || stats.oldestTimestamp < m_oldest)
+					m_oldest = stats.oldestTimestamp;
+				if (stats.newestTimestamp > m_newest)
+					m_newest = stats.newestTimestamp;
+			}
+			
+			m_regions.push_back(make_pair(file, stats));
+		}
+	
+		// ----------------------------------------
+		// Getters
+		// ----------------------------------------
+		const vector<pair<RegionFile, RegionStats>> &regions() const { return m_regions; }
+		size_t fileBytes() const { return m_fileBytes; }
+		size_t usedBytes() const { return m_usedSectors * RegionSectorSize; }
+		size_t wastedBytes() const {
+			size_t needed = m_regions.size() * RegionHeaderSize + usedBytes();
+			return m_fileBytes > needed ? m_fileBytes - needed : 0;
+		}
+		size_t occupiedChunks() const { return m_occupiedChunks; }
+		size_t oversizedChunks() const { return m_oversized; }
+		uint32_t oldestTimestamp() const { return m_oldest; }
+		uint32_t newestTimestamp() const { return m_newest; }
+	
+	private:
+		vector<pair<RegionFile, RegionStats>> m_regions;
+		size_t m_fileBytes;
+		size_t m_occupiedChunks;
+		size_t m_usedSectors;
+		uint32_t m_oldest;
+		uint32_t m_newest;
+		size_t m_oversized;
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // REGIONSTATS_H
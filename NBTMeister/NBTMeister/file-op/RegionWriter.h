@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef REGIONWRITER_H
+#define REGIONWRITER_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Parser.h"
+#include "RegionHeader.h"
+#include "Codec.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// how much of a region file is wasted, computed from its header
+struct RegionFragmentation {
+	RegionFragmentation() : fileSectors(0), usedSectors(0), freeSectors(0), holes(0), misplacedChunks(0) {}
+	
+	size_t fileSectors; // size of the file, header included
+	size_t usedSectors; // sectors referenced by the location table, header excluded
+	size_t freeSectors; // sectors of the file that no chunk uses
+	size_t holes; // number of runs of free sectors
+	size_t misplacedChunks; // chunks that do not directly follow the previous chunk of the location table
+	
+	// the part of the chunk area of the file that is wasted, from 0 to 1
+	double ratio() const { return usedSectors + freeSectors ? static_cast<double>(freeSectors) / (usedSectors + freeSectors) : 0.0; }
+};
+
+// writes 'data' into a temporary file next to 'path', then renames it over 'path' and flushes the directory.
+// Either the old or the new content is on the disk if the process dies in between. The file keeps the
+// permissions it had, a new one gets 0644
+inline bool atomicWriteFile(const string &path, const memblock &data) {
+	
+	struct stat info;
+	mode_t mode = stat(path.c_str(), &info) == 0 ? info.st_mode & 07777 : 0644;
+	
+	string temporary = path + ".XXXXXX";
+	int fd = mkstemp(&temporary[0]);
+	if (fd < 0)
+		return false;
+	
+	const char *cursor = data.data();
+	size_t remaining = data.size();
+	while (remaining > 0) {
+		ssize_t written = write(fd, cursor, remaining);
+		if (written <= 0)
+			break;
+		cursor += written;
+		remaining -= written;
+	}
+	
+	bool success = remaining == 0 && fchmod(fd, mode) == 0 && fsync(fd) == 0;
+	success = ::close(fd) == 0 && success;
+	if (!success || rename(temporary.c_str(), path.c_str()) != 0) {
+		unlink(temporary.c_str());
+		return false;
+	}
+	
+	// the rename itself is only durable once the directory is flushed
+	size_t slash = path.find_last_of('/');
+	string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	int directoryFd = ::open(directory.c_str(), O_RDONLY);
+	if (directoryFd < 0)
+		return false;
+	success = fsync(directoryFd) == 0;
+	::close(directoryFd);
+	return success;
+}
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ A bitmap of the sectors of a region file, built from its location table.
+ A sector is 'used' if it belongs to the header or to a chunk referenced by the table.
+ Allocation is first-fit: the first hole large enough is taken, otherwise the run is
+ appended at the end of the file.
+ */
+class SectorAllocator {
+	
+	public:
+		SectorAllocator() : m_used() {}
+	
+		// marks the header sectors and the sectors of every chunk of the header as used
+		void build(const RegionHeader &header, size_t fileSectors) {
+			
+			m_used.assign(fileSectors > RegionHeaderSectors ? fileSectors : RegionHeaderSectors, false);
+			reserve(0, RegionHeaderSectors);
+			
+			for (int index = 0; index < RegionChunkCount; index++) {
+				const ChunkLocation &loc = header.location(index);
+				if (!loc.empty())
+					reserve(loc.offset, loc.sectorCount);
+			}
+		}
+	
+		// finds 'count' contiguous free sectors, marks them as used and returns the offset of the first one
+		uint32_t allocate(uint32_t count) {
+			
+			uint32_t run = 0;
+			for (uint32_t sector = RegionHeaderSectors; sector < m_used.size(); sector++) {
+				
+				if (m_used[sector]) {
+					run = 0;
+					continue;
+				}
+				
+				if (++run == count) {
+					uint32_t offset = sector - count + 1;
+					reserve(offset, count);
+					return offset;
+				}
+			}
+			
+			// no hole is big enough: we grow the file, reusing the free sectors at its end if there are some
+			uint32_t offset = static_cast<uint32_t>(m_used.size()) - run;
+			reserve(offset, count);
+			return offset;
+		}
+	
+		void reserve(uint32_t offset, uint32_t count) {
+			if (offset + count > m_used.size())
+				m_used.resize(offset + count, false);
+			for (uint32_t i = 0; i < count; i++)
+				m_used[offset + i] = true;
+		}
+	
+		void release(uint32_t offset, uint32_t count) {
+			for (uint32_t i = 0; i < count && offset + i < m_used.size(); i++)
+				m_used[offset + i] = false;
+		}
+	
+		bool used(uint32_t sector) const { return sector < m_used.size() && m_used[sector]; }
+		size_t size() const { return m_used.size(); } // number of sectors tracked (at least the size of the file)
+	
+	private:
+		vector<bool> m_used;
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Writes chunks into an existing (or new) region file without rewriting the whole file.
+ 
+ Every chunk passed to writeChunk() is compressed and written right away in new sectors: the first
+ hole of the file that is large enough, or the end of the file. The header is only updated in memory
+ until commit() is called.
+ 
+ commit() makes the changes durable in a crash-safe order: the chunk data is flushed to the disk
+ first, then the header is written and flushed. Until the header is written, the file still describes
+ the previous version of every chunk, since the sectors it leaves are not given back to the allocator
+ before the new header is on the disk. A chunk written twice between two commits reuses the sectors of
+ its first write if it still fits in them: the header on the disk does not refer to them.
+ 
+ setInPlace(true) rewrites a chunk in its current sectors whenever it still fits in them, which keeps
+ the file from growing but gives up the guarantee above: such a chunk is lost if the process dies in
+ the middle of its write.
+ 
+ Chunks bigger than 255 sectors (1 MiB) cannot be described by the location table and are refused.
+ */
+class RegionWriter {
+	
+	public:
+		RegionWriter() : m_fd(-1), m_good(false), m_dirty(false), m_inPlace(false), m_compressionLevel(Z_DEFAULT_COMPRESSION) {}
+		RegionWriter(const string &path) : m_fd(-1), m_good(false), m_dirty(false), m_inPlace(false), m_compressionLevel(Z_DEFAULT_COMPRESSION) { open(path); }
+		~RegionWriter() { close(); }
+	
+		// opens (or creates) the region file and reads its header
+		bool open(const string &path) {
+			
+			close();
+			
+			m_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+			m_good = m_fd >= 0;
+			if (!m_good) {
+				cerr << "[Error] cannot open region file " << path << " for writing" << endl;
+				return false;
+			}
+			
+			struct stat info;
+			fstat(m_fd, &info);
+			size_t length = static_cast<size_t>(info.st_size);
+			
+			m_header.clear();
+			if (length >= RegionHeaderSize) {
+				
+				char header[RegionHeaderSize];
+				m_good = pread(m_fd, header, RegionHeaderSize, 0) == RegionHeaderSize && m_header.parse(header, RegionHeaderSize);
+				if (!m_good) {
+					cerr << "[Error] cannot read the header of " << path << endl;
+					return false;
+				}
+			}
+			else m_dirty = true; // a new file: the empty header will be written by commit()
+			
+			m_allocator.build(m_header, (length + RegionSectorSize - 1) / RegionSectorSize);
+			m_pendingFree.clear();
+			m_uncommitted.assign(RegionChunkCount, false);
+			return true;
+		}
+	
+		// compresses 'data' (an uncompressed NBT structure) and writes it as the chunk (x, z).
+		// 'timestamp' defaults to the current time
+		bool writeChunk(int x, int z, const memblock &data, uint32_t timestamp = 0, uint8_t compressionType = CompressionZlib) {
+			
+			if (!m_good)
+				return false;
+			
+			const Codec *codec = CodecRegistry::instance().codec(compressionType);
+			if (!codec) {
+				cerr << "[Error] unsupported compression type (" << (int)compressionType << ")" << endl;
+				return false;
+			}
+			
+			if (!codec->compress(data.data(), data.size(), m_compressed, m_compressionLevel)) {
+				cerr << "[Error] cannot compress chunk (" << x << ", " << z << ")" << endl;
+				return false;
+			}
+			
+			return writeCompressedChunk(x, z, m_compressed.data(), m_compressed.size(), compressionType, timestamp);
+		}
+	
+		// writes an already compressed chunk payload, 'compressionType' being the byte stored before the payload
+		bool writeCompressedChunk(int x, int z, const char *payload, size_t size, uint8_t compressionType, uint32_t timestamp = 0) {
+			
+			if (!m_good)
+				return false;
+			
+			size_t length = size + RegionChunkHeaderSize;
+			uint32_t sectors = static_cast<uint32_t>((length + RegionSectorSize - 1) / RegionSectorSize);
+			if (sectors > 255) {
+				cerr << "[Error] chunk (" << x << ", " << z << ") is too big for a region file (" << length << " bytes)" << endl;
+				return false;
+			}
+			
+			// we find where the chunk goes: its current sectors are only reused if the header on the disk
+			// does not refer to them, or if we were asked to
+			int index = RegionHeader::chunkIndex(x, z);
+			ChunkLocation &loc = m_header.location(index);
+			uint32_t offset;
+			if (!loc.empty() && sectors <= loc.sectorCount && (m_inPlace || m_uncommitted[index])) {
+				offset = loc.offset;
+				if (sectors < loc.sectorCount)
+					m_pendingFree.push_back(make_pair(loc.offset + sectors, loc.sectorCount - sectors));
+			}
+			else {
+				offset = m_allocator.allocate(sectors);
+				if (!loc.empty())
+					m_pendingFree.push_back(make_pair(loc.offset, static_cast<uint32_t>(loc.sectorCount)));
+				m_uncommitted[index] = true;
+			}
+			
+			// the chunk header (length of the payload + 1 for the compression type, then the compression type),
+			// the payload, then zeroes up to the end of the last sector
+			m_sectorBuffer.assign(sectors * RegionSectorSize, 0);
+			writeBigEndian(&m_sectorBuffer[0], static_cast<uint32_t>(size + 1), 4);
+			m_sectorBuffer[4] = static_cast<char>(compressionType);
+			copy(payload, payload + size, m_sectorBuffer.begin() + RegionChunkHeaderSize);
+			
+			if (!m_writeAll(m_sectorBuffer.data(), m_sectorBuffer.size(), static_cast<off_t>(offset) * RegionSectorSize)) {
+				cerr << "[Error] cannot write chunk (" << x << ", " << z << ")" << endl;
+				m_good = false;
+				return false;
+			}
+			
+			loc.offset = offset;
+			loc.sectorCount = static_cast<uint8_t>(sectors);
+			loc.timestamp = timestamp ? timestamp : static_cast<uint32_t>(time(nullptr));
+			m_dirty = true;
+			return true;
+		}
+	
+		// removes the chunk (x, z) from the location table. Its sectors become free after the commit
+		void removeChunk(int x, int z) {
+			
+			ChunkLocation &loc = m_header.location(x, z);
+			if (loc.empty())
+				return;
+			
+			m_pendingFree.push_back(make_pair(loc.offset, static_cast<uint32_t>(loc.sectorCount)));
+			loc = ChunkLocation();
+			m_dirty = true;
+		}
+	
+		// makes every change durable: the data first, then the header
+		bool commit() {
+			
+			if (!m_good)
+				return false;
+			if (!m_dirty)
+				return true;
+			
+			char header[RegionHeaderSize];
+			m_header.serialize(header);
+			
+			if (fsync(m_fd) != 0 || !m_writeAll(header, RegionHeaderSize, 0) || fsync(m_fd) != 0) {
+				cerr << "[Error] cannot commit the region header" << endl;
+				m_good = false;
+				return false;
+			}
+			
+			// the new header is on the disk, nothing refers to the old sectors anymore
+			for (const pair<uint32_t, uint32_t> &run : m_pendingFree)
+				m_allocator.release(run.first, run.second);
+			m_pendingFree.clear();
+			m_uncommitted.assign(RegionChunkCount, false);
+			
+			m_dirty = false;
+			return true;
+		}
+	
+		// commits the pending changes and closes the file
+		void close() {
+			if (m_fd < 0)
+				return;
+			commit();
+			::close(m_fd);
+			m_fd = -1;
+			m_good = false;
+		}
+	
+		// if true, a chunk that still fits in its sectors is rewritten in them (see above)
+		void setInPlace(bool inPlace) { m_inPlace = inPlace; }
+	
+		// the compression level used by writeChunk(), from 0 to 9 for gzip and zlib
+		void setCompressionLevel(int level) { m_compressionLevel = level; }
+	
+		bool good() const { return m_good; }
+		const RegionHeader &header() const { return m_header; }
+	
+	private:
+		int m_fd;
+		bool m_good;
+		bool m_dirty;
+		bool m_inPlace;
+		int m_compressionLevel;
+		RegionHeader m_header;
+		SectorAllocator m_allocator;
+		vector<pair<uint32_t, uint32_t>> m_pendingFree; // runs of sectors (offset, count) to free once the header is committed
+		vector<bool> m_uncommitted; // the chunks written in new sectors since the last commit, by index
+		memblock m_compressed;
+		memblock m_sectorBuffer;
+	
+		bool m_writeAll(const char *data, size_t size, off_t position) {
+			while (size > 0) {
+				ssize_t written = pwrite(m_fd, data, size, position);
+				if (written <= 0)
+					return false;
+				data += written;
+				size -= written;
+				position += written;
+			}
+			return true;
+		}
+		
+		// non-copyable: the object owns a file descriptor
+		RegionWriter(const RegionWriter &);
+		RegionWriter &operator=(const RegionWriter &);
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // REGIONWRITER_H
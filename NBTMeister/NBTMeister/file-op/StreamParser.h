@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef STREAMPARSER_H
+#define STREAMPARSER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <zlib.h>
+#include "Parser.h"
+#include "RegionHeader.h"
+#include "../config.h"
+#include "../libs/zlib-contrib/zfstream.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// where the StreamParser pulls its bytes from
+class ByteSource {
+	
+	public:
+		virtual ~ByteSource() {}
+	
+		// copies up to 'size' bytes into 'buffer' and returns how many were copied.
+		// 0 means that there is no more data
+		virtual size_t read(char *buffer, size_t size) = 0;
+};
+
+// bytes that are already in memory (uncompressed data)
+class MemorySource : public ByteSource {
+	
+	public:
+		MemorySource(const char *data, size_t size) : m_data(data), m_size(size), m_position(0) {}
+	
+		size_t read(char *buffer, size_t size) {
+			size_t count = min(size, m_size - m_position);
+			memcpy(buffer, m_data + m_position, count);
+			m_position += count;
+			return count;
+		}
+	
+	private:
+		const char *m_data;
+		size_t m_size;
+		size_t m_position;
+};
+
+// inflates a zlib or gzip stream held in memory (the format is detected by zlib),
+// only producing the bytes asked for by each read() call
+class InflateSource : public ByteSource {
+	
+	public:
+		InflateSource(const char *data, size_t size) : m_stream(), m_good(true), m_finished(false) {
+			m_stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+			m_stream.avail_in = static_cast<uInt>(size);
+			m_good = inflateInit2(&m_stream, 15 + 32) == Z_OK; // + 32: automatic zlib/gzip header detection
+		}
+		~InflateSource() { inflateEnd(&m_stream); }
+	
+		size_t read(char *buffer, size_t size) {
+			
+			if (!m_good || m_finished)
+				return 0;
+			
+			m_stream.next_out = reinterpret_cast<Bytef *>(buffer);
+			m_stream.avail_out = static_cast<uInt>(size);
+			
+			while (m_stream.avail_out > 0) {
+				int ret = inflate(&m_stream, Z_NO_FLUSH);
+				if (ret == Z_STREAM_END) {
+					m_finished = true;
+					break;
+				}
+				if (ret != Z_OK) { // corrupted or truncated data
+					m_good = false;
+					break;
+				}
+			}
+			return size - m_stream.avail_out;
+		}
+	
+		bool good() const { return m_good; }
+	
+	private:
+		z_stream m_stream;
+		bool m_good;
+		bool m_finished;
+	
+		InflateSource(const InflateSource &);
+		InflateSource &operator=(const InflateSource &);
+};
+
+// a gzip file (level.dat, villages.dat...) read through gzifstream. Uncompressed files are read as they are
+class GzStreamSource : public ByteSource {
+	
+	public:
+		GzStreamSource(const string &path) : m_stream(path.c_str(), ios::binary) {}
+	
+		size_t read(char *buffer, size_t size) {
+			m_stream.read(buffer, size);
+			return static_cast<size_t>(m_stream.gcount());
+		}
+	
+		bool good() { return m_stream.is_open(); }
+	
+	private:
+		gzifstream m_stream;
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ This class builds the same tree as Parser, but it pulls its bytes from a ByteSource through a
+ window of a few KiB instead of walking a complete memblock. Fed by an InflateSource, a chunk
+ is parsed while it is being inflated: the decompressed chunk never exists in memory as a whole,
+ and the memory used by the parser stays the same whatever the size of the chunk.
+ 
+ Each tag is built as soon as its bytes arrive. On error, the partial tree is destroyed and
+ nullptr is returned, the reason being available through status().
+ */
+class StreamParser {
+	
+	public:
+		StreamParser(size_t windowSize = 16384) : m_status(good), m_window(windowSize), m_position(0), m_end(0), m_source(nullptr) {}
+	
+		Tag *build(ByteSource &source) {
+			
+			m_source = &source;
+			m_position = m_end = 0;
+			m_status = good;
+			
+			TagType tagType;
+			Tag *root = m_readNamed(tagType);
+			if (!root && m_status == good)
+				m_status = malformed_stream; // the stream starts with a TagEnd
+			return root;
+		}
+	
+		// returns the 'status' of the parser
+		parser_status status() { return m_status; }
+	
+	private:
+		parser_status m_status;
+		memblock m_window;
+		size_t m_position; // next byte to read in the window
+		size_t m_end; // number of valid bytes in the window
+		ByteSource *m_source;
+	
+		// reads the next named tag. Returns nullptr for a TagEnd (tagType is then TagTypeEnd) or on error
+		Tag *m_readNamed(TagType &tagType) {
+			
+			uint8_t type;
+			if (!m_readValue(type))
+				return nullptr;
+			
+			tagType = static_cast<TagType>(type);
+			if (tagType == TagTypeEnd)
+				return nullptr;
+			if (tagType >= TagTypeCount) {
+				m_status = malformed_stream;
+				return nullptr;
+			}
+			
+			string tagName;
+			if (!m_readString(tagName))
+				return nullptr;
+			
+			return m_readPayload(tagType, tagName);
+		}
+	
+		// reads the payload of a tag of the specified type
+		Tag *m_readPayload(TagType tagType, const string &tagName) {
+			
+			switch (tagType) {
+					
+				case TagTypeByte: {
+					int8_t value;
+					return m_readValue(value) ? new Single(tagName, SINGLE_BYTE(value)) : nullptr;
+				}
+				case TagTypeShort: {
+					int16_t value;
+					return m_readValue(value) ? new Single(tagName, SINGLE_SHORT(value)) : nullptr;
+				}
+				case TagTypeInt: {
+					int32_t value;
+					return m_readValue(value) ? new Single(tagName, SINGLE_INT(value)) : nullptr;
+				}
+				case TagTypeLong: {
+					int64_t value;
+					return m_readValue(value) ? new Single(tagName, SINGLE_LONG(value)) : nullptr;
+				}
+				case TagTypeFloat: {
+					float value;
+					return m_readValue(value) ? new Single(tagName, SINGLE_FLOAT(value)) : nullptr;
+				}
+				case TagTypeDouble: {
+					double value;
+					return m_readValue(value) ? new Single(tagName, SINGLE_DOUBLE(value)) : nullptr;
+				}
+				case TagTypeString: {
+					string value;
+					return m_readString(value) ? new Single(tagName, value) : nullptr;
+				}
+					
+				case TagTypeByteArray: {
+					int32_t length;
+					vector<SINGLE_GETBYTE> array;
+					if (!m_readLength(length) || !m_readArray<int8_t>(array, length))
+						return nullptr;
+					return new Single(tagName, array);
+				}
+					
+				case TagTypeIntArray: {
+					int32_t length;
+					vector<SINGLE_GETINT> array;
+					if (!m_readLength(length) || !m_readArray<int32_t>(array, length))
+						return nullptr;
+					return new Single(tagName, array);
+				}
+					
+				case TagTypeLongArray: {
+					int32_t length;
+					vector<SINGLE_GETLONG> array;
+					if (!m_readLength(length) || !m_readArray<int64_t>(array, length))
+						return nullptr;
+					return new Single(tagName, array);
+				}
+					
+				case TagTypeList: {
+					uint8_t type;
+					int32_t length;
+					if (!m_readValue(type) || !m_readLength(length))
+						return nullptr;
+					
+					TagType listTagType = static_cast<TagType>(type);
+					if (listTagType >= TagTypeCount || (listTagType == TagTypeEnd && length > 0)) {
+						m_status = malformed_stream;
+						return nullptr;
+					}
+					
+					// the elements of a list are unnamed; they only contain their payload
+					unique_ptr<Array> root(new Array(tagName, ArrayType::List, listTagType));
+					for (int32_t i = 0; i < length; i++) {
+						Tag *element = m_readPayload(listTagType, "");
+						if (!element)
+							return nullptr;
+						root->addTag(element);
+					}
+					return root.release();
+				}
+					
+				case TagTypeCompound: {
+					unique_ptr<Array> root(new Array(tagName, ArrayType::Compound));
+					TagType childType;
+					while (Tag *child = m_readNamed(childType))
+						root->addTag(child);
+					
+					if (m_status != good)
+						return nullptr;
+					return root.release();
+				}
+					
+				default:
+					m_status = what_the_fuck;
+					return nullptr;
+			}
+		}
+	
+		// refills the window from the source. Returns false at the end of the data
+		bool m_fill() {
+			m_position = 0;
+			m_end = m_source->read(&m_window[0], m_window.size());
+			return m_end > 0;
+		}
+	
+		// copies the next 'size' bytes of the stream, refilling the window as often as needed
+		bool m_readBytes(char *output, size_t size) {
+			
+			while (size > 0) {
+				
+				if (m_position == m_end && !m_fill()) {
+					m_status = null_iterator; // the stream ended in the middle of a tag
+					return false;
+				}
+				
+				size_t count = min(size, m_end - m_position);
+				memcpy(output, &m_window[m_position], count);
+				m_position += count;
+				output += count;
+				size -= count;
+			}
+			return true;
+		}
+	
+		// reads a big-endian value and converts it to the host order
+		template <typename T>
+		bool m_readValue(T &value) {
+			
+			char bytes[sizeof(T)];
+			if (!m_readBytes(bytes, sizeof(T)))
+				return false;
+			value = decodeBigEndian<T>(bytes);
+			return true;
+		}
+	
+		// reads 'length' big-endian values into the payload of an array. The length comes from the
+		// document, so the array grows one window at a time as the bytes arrive: a corrupt length
+		// runs out of data long before it runs out of memory
+		template <typename T, typename Payload>
+		bool m_readArray(vector<Payload> &array, int32_t length) {
+			
+			static_assert(sizeof(Payload) == sizeof(T), "an array is read directly into its payload");
+			size_t step = max<size_t>(1, m_window.size() / sizeof(T));
+			
+			for (size_t done = 0; done < static_cast<size_t>(length); ) {
+				
+				size_t count = min(step, static_cast<size_t>(length) - done);
+				array.resize(done + count);
+				char *bytes = reinterpret_cast<char *>(&array[done]);
+				if (!m_readBytes(bytes, count * sizeof(T)))
+					return false;
+				
+				// converted in place
+				if (sizeof(T) > 1)
+					for (size_t i = 0; i < count; i++)
+						array[done + i] = Payload(decodeBigEndian<T>(bytes + i * sizeof(T)));
+				done += count;
+			}
+			return true;
+		}
+	
+		// reads the length of an array or a list, which cannot be negative
+		bool m_readLength(int32_t &length) {
+			if (!m_readValue(length))
+				return false;
+			if (length < 0) {
+				m_status = malformed_stream;
+				return false;
+			}
+			return true;
+		}
+	
+		// a string is a 2-byte length followed by that many bytes
+		bool m_readString(string &value) {
+			uint16_t length;
+			if (!m_readValue(length))
+				return false;
+			value.resize(length);
+			return m_readBytes(&value[0], length);
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // STREAMPARSER_H
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SURFACE_H
+#define SURFACE_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <functional>
+#include <thread>
+#include <cstdint>
+#include <algorithm>
+#include "MinecraftRegion.h"
+#include "RegionFiles.h"
+#include "RegionWriter.h"
+#include "ChunkBlocks.h"
+#include "Codec.h"
+#include "../ThreadPool.h"
+#include "../config.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// the width of a region, in blocks
+const int RegionWidth = 32 * ChunkWidth;
+
+// a bit for every block of the row 'z' of the layer 'y' of a section that is not air, the bit 0 being x = 0
+inline uint16_t nonAirRow(const SectionArrays &section, int y, int z) {
+	
+	size_t begin = static_cast<size_t>(y) * ChunkWidth * ChunkWidth + z * ChunkWidth;
+	uint16_t mask = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	__m128i blocks = _mm_loadu_si128(reinterpret_cast<const __m128i *>(section.blocks + begin));
+	mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(blocks, zero));
+	if (section.add) {
+		uint8_t highBits[ChunkWidth];
+		unpackNibbles(section.add + begin / 2, highBits, ChunkWidth);
+		__m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(highBits));
+		mask |= ~_mm_movemask_epi8(_mm_cmpeq_epi8(high, zero));
+	}
+#else
+	for (int x = 0; x < ChunkWidth; x++) {
+		size_t i = begin + x;
+		if (section.blocks[i] || (section.add && (section.add[i / 2] >> ((i & 1) * 4)) & 0x0F))
+			mask |= 1 << x;
+	}
+#endif // __SSE2__
+	return mask;
+}
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ The surface of a region: for every one of its 512x512 columns, the height and the id of its highest
+ block that is not air. A column without any block has the id 0 (air). The chunks present in the
+ region are recorded as well, so that a missing chunk can be told from an empty one.
+ 
+ The columns are indexed (z * 512 + x), x and z being relative to the region. The ids are kept as
+ two planes (the low bytes, then the high bytes), which compresses better.
+ 
+ The file format is binary, every integer being big-endian:
+ 
+ 	"NBTMSRF1"
+ 	int x, int z (the region)
+ 	zlib-compressed: 1024 bytes (1 if the chunk is present), 512x512 heights, 512x512 low bytes of the ids,
+ 	512x512 high bytes of the ids
+ */
+class SurfaceTile {
+	
+	public:
+		SurfaceTile(int x = 0, int z = 0) : m_x(x), m_z(z), m_chunks(RegionChunkCount, 0), m_heights(RegionWidth * RegionWidth, 0),
+		m_idLow(RegionWidth * RegionWidth, 0), m_idHigh(RegionWidth * RegionWidth, 0) {}
+	
+		// the name of the file of the surface of the region (x, z): "s.x.z.surface"
+		static string fileName(int x, int z) { return "s." + to_string(x) + "." + to_string(z) + ".surface"; }
+	
+		// empties the tile and gives it to the region (x, z)
+		void reset(int x, int z) {
+			m_x = x;
+			m_z = z;
+			fill(m_chunks.begin(), m_chunks.end(), 0);
+			fill(m_heights.begin(), m_heights.end(), 0);
+			fill(m_idLow.begin(), m_idLow.end(), 0);
+			fill(m_idHigh.begin(), m_idHigh.end(), 0);
+		}
+	
+		int x() const { return m_x; }
+		int z() const { return m_z; }
+	
+		// the column (x, z), relative to the region
+		uint8_t height(int x, int z) const { return m_heights[z * RegionWidth + x]; }
+		uint16_t id(int x, int z) const { return m_idLow[z * RegionWidth + x] | m_idHigh[z * RegionWidth + x] << 8; }
+		void setColumn(int x, int z, uint8_t height, uint16_t id) {
+			m_heights[z * RegionWidth + x] = height;
+			m_idLow[z * RegionWidth + x] = id & 0xFF;
+			m_idHigh[z * RegionWidth + x] = id >> 8;
+		}
+	
+		// the chunk (x, z), relative to the region, is present in the region file
+		bool hasChunk(int x, int z) const { return m_chunks[RegionHeader::chunkIndex(x, z)] != 0; }
+		void setChunk(int x, int z, bool present) { m_chunks[RegionHeader::chunkIndex(x, z)] = present; }
+	
+		bool save(const string &path) const {
+			
+			memblock body;
+			body.reserve(m_chunks.size() + m_heights.size() * 3);
+			body.insert(body.end(), m_chunks.begin(), m_chunks.end());
+			body.insert(body.end(), m_heights.begin(), m_heights.end());
+			body.insert(body.end(), m_idLow.begin(), m_idLow.end());
+			body.insert(body.end(), m_idHigh.begin(), m_idHigh.end());
+			
+			memblock data(16);
+			copy_n("NBTMSRF1", 8, data.begin());
+			writeBigEndian(&data[8], static_cast<uint32_t>(m_x), 4);
+			writeBigEndian(&data[12], static_cast<uint32_t>(m_z), 4);
+			memblock compressed;
+			if (!CodecRegistry::instance().codec(CompressionZlib)->compress(body.data(), body.size(), compressed))
+				return false;
+			data.insert(data.end(), compressed.begin(), compressed.end());
+			return atomicWriteFile(path, data);
+		}
+	
+		bool load(const string &path) {
+			
+			ifstream infile(path, ios::binary);
+			memblock data((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+			if (data.size() < 16 || string(data.data(), 8) != "NBTMSRF1") {
+				cerr << "[Error] " << path << " is not a surface tile" << endl;
+				return false;
+			}
+			
+			size_t columns = RegionWidth * RegionWidth;
+			memblock body;
+			if (!CodecRegistry::instance().codec(CompressionZlib)->decompress(&data[16], data.size() - 16, body, RegionChunkCount + columns * 3) ||
+				body.size() != RegionChunkCount + columns * 3) {
+				cerr << "[Error] the surface tile " << path << " is corrupted" << endl;
+				return false;
+			}
+			
+			m_x = static_cast<int32_t>(readBigEndian(&data[8], 4));
+			m_z = static_cast<int32_t>(readBigEndian(&data[12], 4));
+			const char *cursor = body.data();
+			m_chunks.assign(cursor, cursor + RegionChunkCount);
+			m_heights.assign(cursor + RegionChunkCount, cursor + RegionChunkCount + columns);
+			m_idLow.assign(cursor + RegionChunkCount + columns, cursor + RegionChunkCount + columns * 2);
+			m_idHigh.assign(cursor + RegionChunkCount + columns * 2, cursor + RegionChunkCount + columns * 3);
+			return true;
+		}
+	
+	private:
+		int m_x, m_z;
+		vector<uint8_t> m_chunks; // bytes rather than bits: the chunks are filled by several threads at once
+		vector<uint8_t> m_heights;
+		vector<uint8_t> m_idLow;
+		vector<uint8_t> m_idHigh;
+};
+
+// called for every surface tile extracted from a world
+typedef function<void(const SurfaceTile &tile)> SurfaceTileCallback;
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Computes the surface of regions from the blocks of their sections, rather than from the HeightMap
+ of the chunks (which may be stale or missing when the world was edited by a tool).
+ 
+ The chunks of a region are extracted in parallel: they are split into as many groups as there are
+ threads, following the order of the file, so that every thread still reads its chunks in big
+ contiguous runs (see Region::forEachChunk()). A chunk is walked with a TagReader (see forEachSection()),
+ then its sections are scanned from the top down, one layer at a time. For every row of 16 columns,
+ the blocks that are not air are found at once with SSE2 (see nonAirRow()), and only the columns that
+ have not been found yet are kept. The scan of a chunk stops as soon as every column has been found,
+ so only the top of the terrain is read.
+ */
+class SurfaceExtractor {
+	
+	public:
+		SurfaceExtractor(size_t threads = thread::hardware_concurrency()) : m_pool(threads), m_chunks(0), m_failedChunks(0) {}
+	
+		// extracts the surface of the region (x, z) from its file into 'tile'. Returns false if the file cannot be read
+		bool extract(const Region &region, int x, int z, SurfaceTile &tile) {
+			
+			tile.reset(x, z);
+			if (!region.good())
+				return false;
+			
+			// the chunks, in the order of the file, are split into contiguous groups
+			vector<pair<uint32_t, int>> chunks;
+			for (int index = 0; index < RegionChunkCount; index++) {
+				ChunkLocation loc = region.location(index);
+				if (!loc.empty())
+					chunks.push_back(make_pair(loc.offset, index));
+			}
+			sort(chunks.begin(), chunks.end());
+			
+			size_t groups = min(m_pool.threads(), max<size_t>(chunks.size(), 1));
+			shared_ptr<vector<int>> group = make_shared<vector<int>>(RegionChunkCount, -1);
+			for (size_t i = 0; i < chunks.size(); i++)
+				(*group)[chunks[i].second] = static_cast<int>(i * groups / chunks.size());
+			
+			for (size_t g = 0; g < groups; g++) {
+				m_pool.submit([this, &region, &tile, group, g] {
+					region.forEachChunk([this, &tile](int chunkX, int chunkZ, const memblock &data) {
+						tile.setChunk(chunkX, chunkZ, true);
+						if (extractChunk(data.data(), data.size(), tile, chunkX, chunkZ))
+							m_chunks++;
+						else
+							m_failedChunks++;
+					}, OrderSector, DefaultRunSectors, [group, g](int chunkX, int chunkZ) { return (*group)[RegionHeader::chunkIndex(chunkX, chunkZ)] == static_cast<int>(g); });
+				});
+			}
+			m_pool.wait();
+			return true;
+		}
+	
+		// extracts the surfaces of the region files of a directory one after the other, giving every
+		// tile to 'done'. Returns the number of tiles extracted
+		size_t extractWorld(const string &regionDirectory, const SurfaceTileCallback &done) {
+			
+			size_t tiles = 0;
+			SurfaceTile tile;
+			for (const RegionFile &file : listRegionFiles(regionDirectory)) {
+				Region region(file.path);
+				if (!extract(region, file.x, file.z, tile)) {
+					cerr << "[Warning] the region file " << file.path << " cannot be read, it has no surface" << endl;
+					continue;
+				}
+				done(tile);
+				tiles++;
+			}
+			return tiles;
+		}
+	
+		// fills the columns of the chunk (x, z) of 'tile' (x and z relative to the region) from its
+		// decompressed NBT data. Returns false if the chunk is malformed
+		static bool extractChunk(const char *data, size_t size, SurfaceTile &tile, int x, int z) {
+			
+			SectionArrays sections[SectionCount];
+			if (!forEachSection(data, size, [&sections](const SectionArrays &section) {
+				sections[section.y] = section;
+				return true;
+			}))
+				return false;
+			
+			uint16_t missing[ChunkWidth]; // the columns not found yet, a bit per column of every row
+			fill_n(missing, ChunkWidth, 0xFFFF);
+			int rowsLeft = ChunkWidth;
+			
+			for (int s = SectionCount - 1; s >= 0 && rowsLeft > 0; s--) {
+				const SectionArrays &section = sections[s];
+				if (!section.blocks)
+					continue;
+				for (int y = SectionHeight - 1; y >= 0 && rowsLeft > 0; y--) {
+					for (int row = 0; row < ChunkWidth; row++) {
+						if (!missing[row])
+							continue;
+						uint16_t found = nonAirRow(section, y, row) & missing[row];
+						if (!found)
+							continue;
+						missing[row] &= ~found;
+						if (!missing[row])
+							rowsLeft--;
+						
+						size_t begin = static_cast<size_t>(y) * ChunkWidth * ChunkWidth + row * ChunkWidth;
+						while (found) {
+							int column = __builtin_ctz(found);
+							found &= found - 1;
+							size_t i = begin + column;
+							uint16_t id = section.blocks[i] | (section.add ? ((section.add[i / 2] >> ((i & 1) * 4)) & 0x0F) << 8 : 0);
+							tile.setColumn(x * ChunkWidth + column, z * ChunkWidth + row, static_cast<uint8_t>(s * SectionHeight + y), id);
+						}
+					}
+				}
+			}
+			return true;
+		}
+	
+		size_t threads() const { return m_pool.threads(); }
+		size_t chunks() const { return m_chunks; } // the chunks extracted since the creation of the extractor
+		size_t failedChunks() const { return m_failedChunks; }
+	
+	private:
+		ThreadPool m_pool;
+		atomic<size_t> m_chunks;
+		atomic<size_t> m_failedChunks;
+	
+		// non-copyable: the pool is not
+		SurfaceExtractor(const SurfaceExtractor &);
+		SurfaceExtractor &operator=(const SurfaceExtractor &);
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // SURFACE_H
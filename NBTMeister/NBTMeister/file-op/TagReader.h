@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TAGREADER_H
+#define TAGREADER_H
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include "Parser.h"
+#include "../tags/TagTypes.h"
+#include "RegionHeader.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// the deepest nesting of lists and compounds a TagReader accepts (the one of Minecraft)
+const int TagReaderMaxDepth = 512;
+
+// the name of a tag, pointing into the data of a TagReader
+struct TagName {
+	TagName() : data(nullptr), size(0) {}
+	
+	const char *data;
+	size_t size;
+	
+	bool operator==(const char *name) const { return strlen(name) == size && memcmp(data, name, size) == 0; }
+	bool operator!=(const char *name) const { return !(*this == name); }
+	string str() const { return string(data, size); }
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ A cursor over NBT data held in one contiguous buffer (a decompressed chunk, for instance), for the
+ tools that only need a few tags: nothing is allocated and nothing is copied. The tags that are not
+ needed are skipped without being decoded, a byte array is skipped in one step whatever its size.
+ 
+ The reader is positioned in a compound. next() reads the type and the name of the next tag:
+ 	- to read its payload, call the read*() function of its type;
+ 	- to enter it if it is a compound, just call next() again: its own tags come next, until
+ 	  next() returns false on its TagEnd, the reader being then back in the parent compound;
+ 	- to enter it if it is a list, call readListHeader() then read the payloads one after the other;
+ 	- otherwise, call skip().
+ seek() skips the tags up to a given one: a path such as Level.Sections is a seek() per step.
+ 
+ Every call returns false on error, status() then saying why (null_iterator if the data is truncated,
+ malformed_stream if it is invalid). The arrays point into the data: they are valid as long as it is.
+ */
+class TagReader {
+	
+	public:
+		TagReader(const char *data, size_t size) : m_data(data), m_end(data + size), m_cursor(data), m_status(good) {}
+	
+		// enters the root compound (a chunk is a compound named ""). Returns false if the root is not a compound
+		bool enterRoot() {
+			TagType type;
+			TagName name;
+			if (!next(type, name))
+				return false;
+			if (type != TagTypeCompound) {
+				m_status = malformed_stream;
+				return false;
+			}
+			return true;
+		}
+	
+		// reads the type and the name of the next tag of the current compound.
+		// Returns false at its end (the TagEnd is consumed) or on error
+		bool next(TagType &type, TagName &name) {
+			
+			uint8_t rawType;
+			if (!m_value(rawType))
+				return false;
+			type = static_cast<TagType>(rawType);
+			if (type == TagTypeEnd)
+				return false;
+			if (type >= TagTypeCount) {
+				m_status = malformed_stream;
+				return false;
+			}
+			
+			uint16_t length;
+			if (!m_value(length) || !m_need(length))
+				return false;
+			name.data = m_cursor;
+			name.size = length;
+			m_cursor += length;
+			return true;
+		}
+	
+		// skips the payload of a tag of type 'type'
+		bool skip(TagType type) { return m_skip(type, 0); }
+	
+		// skips the tags of the current compound up to the tag 'name' of type 'type', whose payload comes next.
+		// Returns false if there is no such tag: the reader is then after the end of the compound
+		bool seek(const char *name, TagType type) {
+			TagType found;
+			TagName foundName;
+			while (next(found, foundName)) {
+				if (found == type && foundName == name)
+					return true;
+				if (!skip(found))
+					return false;
+			}
+			return false;
+		}
+	
+		// skips the rest of the current compound, its TagEnd included
+		bool leave() {
+			TagType type;
+			TagName name;
+			while (next(type, name))
+				if (!skip(type))
+					return false;
+			return m_status == good;
+		}
+	
+		template <typename T>
+		bool readValue(T &value) { return m_value(value); } // for the numeric types
+	
+		bool readString(TagName &value) {
+			uint16_t length;
+			if (!m_value(length) || !m_need(length))
+				return false;
+			value.data = m_cursor;
+			value.size = length;
+			m_cursor += length;
+			return true;
+		}
+	
+		// the bytes of a TAG_Byte_Array
+		bool readByteArray(const uint8_t *&bytes, int32_t &length) {
+			if (!m_length(length) || !m_need(length))
+				return false;
+			bytes = reinterpret_cast<const uint8_t *>(m_cursor);
+			m_cursor += length;
+			return true;
+		}
+	
+		// the raw, big-endian bytes of a TAG_Int_Array or a TAG_Long_Array: use elementAt() to read them
+		bool readArray(TagType type, const char *&bytes, int32_t &length) {
+			size_t width = type == TagTypeLongArray ? 8 : 4;
+			if (!m_length(length) || !m_need(static_cast<size_t>(length) * width))
+				return false;
+			bytes = m_cursor;
+			m_cursor += static_cast<size_t>(length) * width;
+			return true;
+		}
+	
+		// the element 'index' of an array returned by readArray()
+		template <typename T>
+		static T elementAt(const char *bytes, size_t index) { return decodeBigEndian<T>(bytes + index * sizeof(T)); }
+	
+		// the type and the number of the elements of a list. They follow, without type nor name
+		bool readListHeader(TagType &elementType, int32_t &length) {
+			uint8_t rawType;
+			if (!m_value(rawType) || !m_length(length))
+				return false;
+			elementType = static_cast<TagType>(rawType);
+			if (elementType >= TagTypeCount || (elementType == TagTypeEnd && length > 0)) {
+				m_status = malformed_stream;
+				return false;
+			}
+			return true;
+		}
+	
+		parser_status status() const { return m_status; }
+		size_t position() const { return m_cursor - m_data; }
+	
+	private:
+		const char *m_data;
+		const char *m_end;
+		const char *m_cursor;
+		parser_status m_status;
+	
+		// checks that 'size' more bytes are available
+		bool m_need(size_t size) {
+			if (m_status != good)
+				return false;
+			if (static_cast<size_t>(m_end - m_cursor) < size) {
+				m_status = null_iterator;
+				return false;
+			}
+			return true;
+		}
+	
+		template <typename T>
+		bool m_value(T &value) {
+			if (!m_need(sizeof(T)))
+				return false;
+			value = decodeBigEndian<T>(m_cursor);
+			m_cursor += sizeof(T);
+			return true;
+		}
+	
+		bool m_length(int32_t &length) {
+			if (!m_value(length))
+				return false;
+			if (length < 0) {
+				m_status = malformed_stream;
+				return false;
+			}
+			return true;
+		}
+	
+		// skips 'size' bytes
+		bool m_advance(size_t size) {
+			if (!m_need(size))
+				return false;
+			m_cursor += size;
+			return true;
+		}
+	
+		bool m_skip(TagType type, int depth) {
+			
+			if (depth > TagReaderMaxDepth) {
+				m_status = malformed_stream;
+				return false;
+			}
+			
+			switch (type) {
+				case TagTypeByte: return m_advance(1);
+				case TagTypeShort: return m_advance(2);
+				case TagTypeInt:
+				case TagTypeFloat: return m_advance(4);
+				case TagTypeLong:
+				case TagTypeDouble: return m_advance(8);
+					
+				case TagTypeString: {
+					uint16_t length;
+					return m_value(length) && m_advance(length);
+				}
+					
+				case TagTypeByteArray:
+				case TagTypeIntArray:
+				case TagTypeLongArray: {
+					int32_t length;
+					size_t width = type == TagTypeByteArray ? 1 : type == TagTypeIntArray ? 4 : 8;
+					return m_length(length) && m_advance(static_cast<size_t>(length) * width);
+				}
+					
+				case TagTypeList: {
+					TagType elementType;
+					int32_t length;
+					if (!readListHeader(elementType, length))
+						return false;
+					
+					// the elements of fixed size are skipped at once
+					size_t width = 0;
+					switch (elementType) {
+						case TagTypeByte: width = 1; break;
+						case TagTypeShort: width = 2; break;
+						case TagTypeInt: case TagTypeFloat: width = 4; break;
+						case TagTypeLong: case TagTypeDouble: width = 8; break;
+						default: break;
+					}
+					if (width || length == 0)
+						return m_advance(static_cast<size_t>(length) * width);
+					
+					for (int32_t i = 0; i < length; i++)
+						if (!m_skip(elementType, depth + 1))
+							return false;
+					return true;
+				}
+					
+				case TagTypeCompound: {
+					TagType childType;
+					TagName name;
+					while (next(childType, name))
+						if (!m_skip(childType, depth + 1))
+							return false;
+					return m_status == good;
+				}
+					
+				default:
+					m_status = what_the_fuck;
+					return false;
+			}
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // TAGREADER_H
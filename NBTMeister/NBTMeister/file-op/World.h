@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WORLD_H
+#define WORLD_H
+
+#include <list>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include "MinecraftRegion.h"
+#include "RegionFiles.h"
+#include "ChunkCache.h"
+#include "Codec.h"
+#include "StreamParser.h"
+#include "BufferPool.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// default number of region files a world keeps open
+const size_t DefaultWorldOpenRegions = 64;
+
+// number of missing region files a world remembers
+const size_t WorldMissingRegionMemory = 4096;
+
+// what happened in a world since its creation
+struct WorldCounters {
+	WorldCounters() : regionHits(0), regionMisses(0), regionMissing(0), regionEvictions(0) {}
+	
+	ChunkCacheCounters chunks;
+	uint64_t regionHits; // the region file was already open
+	uint64_t regionMisses; // the region file had to be opened
+	uint64_t regionMissing; // the region file was already known not to exist or not to open
+	uint64_t regionEvictions; // a region file was closed to respect the budget
+};
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ The chunks of a whole world, addressed by global chunk coordinates: the chunk (x, z) is in the
+ region file "r.<x >> 5>.<z >> 5>.mca" of the region directory.
+ 
+ Two caches avoid opening, inflating and parsing the same things again and again:
+ 	- the chunks, bounded by their memory. A cold chunk is demoted from its tree to its NBT data,
+ 	  then to its compressed bytes, and is decompressed or parsed again when it is used (see ChunkCache);
+ 	- the open region files, bounded by their number (each one holds a file descriptor).
+ 	  They are opened at their first use and closed in least-recently-used order. The region files
+ 	  that cannot be opened are remembered too, so that the chunks around a world are not looked
+ 	  for again and again; the memory is forgotten when it is full, or by invalidate() and clear().
+ 
+ Everything is shared: a chunk or a region that is evicted while someone is using it is destroyed
+ once it is not used anymore. A World can be used by several threads at once, the files are read
+ and the chunks parsed outside of the locks.
+ 
+ Modifying a chunk through region() does not update the cache: call invalidate() afterwards.
+ */
+class World {
+	
+	public:
+		World(const string &regionDirectory, size_t memoryBudget = DefaultChunkCacheBudget, size_t maxOpenRegions = DefaultWorldOpenRegions) :
+		m_directory(regionDirectory), m_chunks(memoryBudget), m_maxOpenRegions(maxOpenRegions) {}
+	
+		// the chunk (x, z), nullptr if it does not exist or cannot be parsed
+		ChunkTree chunk(int x, int z) {
+			CachedChunk cached;
+			return m_load(x, z, TierParsed, true, cached) ? cached.tree : ChunkTree();
+		}
+	
+		// brings the chunk (x, z) into the cache, in the form 'tier' at least, ahead of its use.
+		// Returns false if it does not exist or cannot be decoded
+		bool prefetch(int x, int z, ChunkTier tier = TierParsed) {
+			CachedChunk cached;
+			return m_load(x, z, tier, false, cached);
+		}
+	
+		// the form in which the chunk (x, z) is cached, ChunkTierCount if it is not
+		ChunkTier residency(int x, int z) const { return m_chunks.tier(x, z); }
+	
+		// the region (x, z) in region coordinates, opened if needed. nullptr if there is no such file
+		shared_ptr<Region> region(int x, int z) {
+			
+			uint64_t key = chunkKey(x, z);
+			{
+				lock_guard<mutex> lock(m_regionMutex);
+				auto found = m_regionIndex.find(key);
+				if (found != m_regionIndex.end()) {
+					m_counters.regionHits++;
+					m_regions.splice(m_regions.begin(), m_regions, found->second);
+					return found->second->second;
+				}
+				if (m_missingRegions.count(key)) {
+					m_counters.regionMissing++;
+					return shared_ptr<Region>();
+				}
+				m_counters.regionMisses++;
+			}
+			
+			// the file is opened outside of the lock
+			shared_ptr<Region> file(new Region(m_directory + "/" + regionFileName(x, z)));
+			if (!file->good()) {
+				lock_guard<mutex> lock(m_regionMutex);
+				if (m_missingRegions.size() >= WorldMissingRegionMemory)
+					m_missingRegions.clear(); // the files may have been created since
+				m_missingRegions.insert(key);
+				return shared_ptr<Region>();
+			}
+			
+			RegionList evicted; // closed once the lock is released: a region commits its writes when it is destroyed
+			lock_guard<mutex> lock(m_regionMutex);
+			auto found = m_regionIndex.find(key);
+			if (found != m_regionIndex.end())
+				return found->second->second; // opened by another thread in the meantime
+			
+			m_regions.push_front(make_pair(key, file));
+			m_regionIndex[key] = m_regions.begin();
+			m_closeRegions(evicted);
+			return file;
+		}
+	
+		// forgets the chunk (x, z), so that it is read again at its next use, even if its region file was missing
+		void invalidate(int x, int z) {
+			m_chunks.erase(x, z);
+			lock_guard<mutex> lock(m_regionMutex);
+			m_missingRegions.erase(chunkKey(chunkToRegion(x), chunkToRegion(z)));
+		}
+	
+		// forgets the parsed chunks and the missing region files, and closes the region files
+		void clear() {
+			m_chunks.clear();
+			RegionList closed; // closed once the lock is released
+			lock_guard<mutex> lock(m_regionMutex);
+			closed.swap(m_regions);
+			m_regionIndex.clear();
+			m_missingRegions.clear();
+		}
+	
+		void setMemoryBudget(size_t bytes) { m_chunks.setBudget(bytes); }
+		void setMemoryBudget(ChunkTier tier, size_t bytes) { m_chunks.setBudget(tier, bytes); }
+		void setMaxOpenRegions(size_t count) {
+			RegionList evicted;
+			lock_guard<mutex> lock(m_regionMutex);
+			m_maxOpenRegions = count;
+			m_closeRegions(evicted);
+		}
+	
+		const string &directory() const { return m_directory; }
+		size_t memoryUsed() const { return m_chunks.memory(); }
+		size_t memoryUsed(ChunkTier tier) const { return m_chunks.memory(tier); }
+		size_t cachedChunks() const { return m_chunks.size(); }
+		size_t cachedChunks(ChunkTier tier) const { return m_chunks.size(tier); }
+		size_t openRegions() const { lock_guard<mutex> lock(m_regionMutex); return m_regions.size(); }
+		WorldCounters counters() const {
+			lock_guard<mutex> lock(m_regionMutex);
+			WorldCounters counters = m_counters;
+			counters.chunks = m_chunks.counters();
+			return counters;
+		}
+	
+	private:
+		typedef list<pair<uint64_t, shared_ptr<Region>>> RegionList;
+	
+		string m_directory;
+		ChunkCache m_chunks;
+	
+		size_t m_maxOpenRegions;
+		RegionList m_regions; // the most recently used first
+		unordered_map<uint64_t, RegionList::iterator> m_regionIndex;
+		unordered_set<uint64_t> m_missingRegions; // the region files that could not be opened
+		WorldCounters m_counters;
+		mutable mutex m_regionMutex;
+	
+		// non-copyable: the caches are not
+		World(const World &);
+		World &operator=(const World &);
+	
+		// makes sure the chunk (x, z) is cached in the form 'tier' at least, and fills 'cached' with it.
+		// What is missing is built from the biggest form that is cached, outside of the locks
+		bool m_load(int x, int z, ChunkTier tier, bool use, CachedChunk &cached) {
+			
+			if (m_chunks.find(x, z, cached, use) && cached.tier <= tier)
+				return true;
+			
+			WorkerBuffers &buffers = workerBuffers();
+			if (!cached.compressed) {
+				shared_ptr<Region> file = region(chunkToRegion(x), chunkToRegion(z));
+				if (!file || !file->readChunk(x & 31, z & 31, buffers.compressed, cached.compressionType))
+					return false;
+				cached.compressed = make_shared<memblock>(buffers.compressed.begin(), buffers.compressed.end());
+			}
+			
+			if (!cached.decompressed && tier <= TierDecompressed) {
+				const Codec *codec = CodecRegistry::instance().codec(cached.compressionType);
+				if (!codec || !codec->decompress(cached.compressed->data(), cached.compressed->size(), buffers.decompressed))
+					return false;
+				cached.decompressed = make_shared<memblock>(buffers.decompressed.begin(), buffers.decompressed.end());
+			}
+			
+			if (tier == TierParsed) {
+				MemorySource source(cached.decompressed->data(), cached.decompressed->size());
+				cached.tree.reset(buffers.streamParser.build(source));
+				if (!cached.tree)
+					return false;
+			}
+			
+			cached.tree = m_chunks.insert(x, z, cached);
+			return true;
+		}
+	
+		// moves the least recently used regions to 'evicted' until the budget is respected. m_regionMutex must be
+		// locked, and 'evicted' destroyed after it is unlocked: the last owner of a region commits and syncs it
+		void m_closeRegions(RegionList &evicted) {
+			while (m_regions.size() > m_maxOpenRegions && m_regions.size() > 1) {
+				m_regionIndex.erase(m_regions.back().first);
+				evicted.splice(evicted.begin(), m_regions, prev(m_regions.end()));
+				m_counters.regionEvictions++;
+			}
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // WORLD_H
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WORLDPRUNER_H
+#define WORLDPRUNER_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+#include <algorithm>
+#include <zlib.h>
+#include "MinecraftRegion.h"
+#include "RegionHeader.h"
+#include "RegionFiles.h"
+#include "TagReader.h"
+#include "Codec.h"
+#include "BufferPool.h"
+#include "../ThreadPool.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// the first part of a chunk inflated to look for its InhabitedTime; it is doubled until the tag is found
+const size_t InhabitedTimeFirstBytes = 4096;
+
+// reads Level.InhabitedTime from the compressed payload of a chunk, inflating only the beginning of
+// it, as much as needed to reach the tag. 'data' is a buffer for the inflated bytes. Returns false if
+// the chunk cannot be read; 'found' says if it has the tag
+inline bool readInhabitedTime(const char *payload, size_t size, uint8_t compressionType, memblock &data, int64_t &inhabitedTime, bool &found) {
+	
+	found = false;
+	inhabitedTime = 0;
+	
+	// reads the tag from what has been inflated so far. Returns false if more bytes are needed
+	auto parse = [&](size_t available, bool &valid) {
+		TagReader reader(data.data(), available);
+		found = reader.enterRoot() && reader.seek("Level", TagTypeCompound) && reader.seek("InhabitedTime", TagTypeLong) &&
+				reader.readValue(inhabitedTime);
+		valid = reader.status() == good;
+		return found || reader.status() != null_iterator;
+	};
+	bool valid = false;
+	
+	if (compressionType != CompressionGZip && compressionType != CompressionZlib) {
+		const Codec *codec = CodecRegistry::instance().codec(compressionType);
+		if (!codec || !codec->decompress(payload, size, data))
+			return false;
+		parse(data.size(), valid);
+		return valid;
+	}
+	
+	z_stream stream = z_stream();
+	if (inflateInit2(&stream, compressionType == CompressionGZip ? 15 + 16 : 15) != Z_OK)
+		return false;
+	stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(payload));
+	stream.avail_in = static_cast<uInt>(size);
+	
+	data.resize(InhabitedTimeFirstBytes);
+	bool done = false;
+	while (!done) {
+		
+		stream.next_out = reinterpret_cast<Bytef *>(&data[stream.total_out]);
+		stream.avail_out = static_cast<uInt>(data.size() - stream.total_out);
+		int ret = inflate(&stream, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			break; // corrupted data
+		
+		done = parse(stream.total_out, valid);
+		if (!done && (ret == Z_STREAM_END || (stream.avail_in == 0 && stream.avail_out != 0)))
+			break; // the data ends before the tag
+		if (stream.avail_out == 0)
+			data.resize(data.size() * 2);
+	}
+	inflateEnd(&stream);
+	return done && valid;
+}
+
+// what a pruning predicate knows of a chunk
+struct PruneCandidate {
+	int x, z; // global chunk coordinates
+	uint32_t timestamp; // of its last save
+	int64_t inhabitedTime; // in ticks, 0 if unknown
+	bool hasInhabitedTime; // false if the chunk has no InhabitedTime, or if the predicate does not need it
+};
+
+// says if a chunk is to be deleted
+typedef function<bool(const PruneCandidate &chunk)> PrunePredicate;
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Deletes the chunks of a world for which a predicate is true, typically the ones the players barely
+ visited (see inhabitedBelow()) or the ones outside of a border (see outsideBorder()).
+ 
+ The region files are pruned in parallel, one task of a ThreadPool per file. When the predicate needs
+ the InhabitedTime of the chunks, a chunk is inflated only up to this tag, which comes early in the
+ chunks saved by the game (see readInhabitedTime()); otherwise, the chunks are not read at all. A chunk
+ is deleted by zeroing its entries in the header of its region file: its payload is not touched, and
+ every region file is committed once, when all its chunks have been examined.
+ 
+ The sectors of the deleted chunks are only given back with compaction (see Region::compact()),
+ which rewrites the region files that lost chunks. A region file that loses all its chunks is kept,
+ with an empty header.
+ */
+class WorldPruner {
+	
+	public:
+		// 'needsInhabitedTime' says if 'predicate' looks at the InhabitedTime of the chunks
+		WorldPruner(const PrunePredicate &predicate, bool needsInhabitedTime = true) :
+		m_predicate(predicate), m_needsInhabitedTime(needsInhabitedTime), m_compaction(false), m_dryRun(false),
+		m_regions(0), m_examined(0), m_pruned(0), m_failed(0), m_bytesFreed(0) {}
+	
+		// the chunks never inhabited for 'ticks' ticks (20 per second)
+		static PrunePredicate inhabitedBelow(int64_t ticks) {
+			return [ticks](const PruneCandidate &chunk) { return chunk.hasInhabitedTime && chunk.inhabitedTime < ticks; };
+		}
+	
+		// the chunks outside of the box from (minX, minZ) to (maxX, maxZ) included, in global chunk coordinates
+		static PrunePredicate outsideBorder(int minX, int minZ, int maxX, int maxZ) {
+			return [=](const PruneCandidate &chunk) { return chunk.x < minX || chunk.x > maxX || chunk.z < minZ || chunk.z > maxZ; };
+		}
+	
+		// rewrites the region files that lost chunks, to give their sectors back
+		void setCompaction(bool compaction) { m_compaction = compaction; }
+		// only counts the chunks that would be deleted
+		void setDryRun(bool dryRun) { m_dryRun = dryRun; }
+	
+		// prunes the region files of a directory on 'threads' threads. Returns the number of chunks deleted
+		size_t run(const string &regionDirectory, size_t threads = thread::hardware_concurrency()) {
+			
+			m_regions = m_examined = m_pruned = m_failed = m_bytesFreed = 0;
+			vector<RegionFile> files = listRegionFiles(regionDirectory);
+			ThreadPool pool(min(threads ? threads : 1, max<size_t>(files.size(), 1)));
+			for (const RegionFile &file : files)
+				pool.submit([this, file] { m_pruneRegion(file); });
+			pool.wait();
+			return m_pruned;
+		}
+	
+		// the counters of the last run
+		size_t regions() const { return m_regions; } // the region files that lost chunks
+		size_t examined() const { return m_examined; }
+		size_t pruned() const { return m_pruned; }
+		size_t failed() const { return m_failed; } // the chunks that could not be read or removed, kept
+		size_t bytesFreed() const { return m_bytesFreed; } // by the compaction
+	
+	private:
+		PrunePredicate m_predicate;
+		bool m_needsInhabitedTime;
+		bool m_compaction;
+		bool m_dryRun;
+		size_t m_regions, m_examined, m_pruned, m_failed, m_bytesFreed;
+		mutex m_mutex; // guards the counters while the tasks merge
+	
+		// non-copyable: the tasks of a run point to the pruner
+		WorldPruner(const WorldPruner &);
+		WorldPruner &operator=(const WorldPruner &);
+	
+		void m_pruneRegion(const RegionFile &file) {
+			
+			Region region(file.path);
+			if (!region.good()) {
+				cerr << "[Warning] the region file " << file.path << " cannot be opened, it is not pruned" << endl;
+				return;
+			}
+			
+			WorkerBuffers &buffers = workerBuffers();
+			size_t examined = 0, pruned = 0, failed = 0, bytesFreed = 0;
+			for (int index = 0; index < RegionChunkCount; index++) {
+				
+				ChunkLocation loc = region.location(index);
+				if (loc.empty())
+					continue;
+				
+				PruneCandidate chunk;
+				chunk.x = file.x * 32 + index % 32;
+				chunk.z = file.z * 32 + index / 32;
+				chunk.timestamp = loc.timestamp;
+				chunk.inhabitedTime = 0;
+				chunk.hasInhabitedTime = false;
+				
+				uint8_t compressionType;
+				if (m_needsInhabitedTime && (!region.readChunk(index % 32, index / 32, buffers.compressed, compressionType) ||
+											 !readInhabitedTime(buffers.compressed.data(), buffers.compressed.size(), compressionType,
+																buffers.decompressed, chunk.inhabitedTime, chunk.hasInhabitedTime))) {
+					cerr << "[Warning] chunk " << index << " of " << file.path << " cannot be read, it is kept" << endl;
+					failed++;
+					continue;
+				}
+				examined++;
+				
+				if (!m_predicate(chunk))
+					continue;
+				if (!m_dryRun && !region.removeChunk(index % 32, index / 32)) {
+					cerr << "[Warning] chunk " << index << " of " << file.path << " cannot be removed, it is kept" << endl;
+					failed++;
+					continue;
+				}
+				pruned++;
+			}
+			
+			if (pruned && !m_dryRun) {
+				if (!region.commit()) { // the removals are lost with the header
+					cerr << "[Error] cannot commit the pruned region " << file.path << endl;
+					failed += pruned;
+					pruned = 0;
+				}
+				else if (m_compaction) {
+					size_t before = region.fileSize();
+					if (region.compact())
+						bytesFreed = before > region.fileSize() ? before - region.fileSize() : 0;
+					else
+						cerr << "[Error] cannot compact the pruned region " << file.path << endl;
+				}
+			}
+			
+			lock_guard<mutex> lock(m_mutex);
+			m_regions += pruned ? 1 : 0;
+			m_examined += examined;
+			m_pruned += pruned;
+			m_failed += failed;
+			m_bytesFreed += bytesFreed;
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // WORLDPRUNER_H
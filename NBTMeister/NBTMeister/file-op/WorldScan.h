@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WORLDSCAN_H
+#define WORLDSCAN_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include "AsyncIO.h"
+#include "RegionHeader.h"
+#include "RegionFiles.h"
+#include "Codec.h"
+#include "../config.h"
+
+using namespace std;
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+namespace Minecraft {
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+
+// called for every chunk of a scan, with its decompressed NBT data. The chunk coordinates are global
+typedef function<void(const RegionFile &region, int x, int z, const memblock &data)> ChunkVisitor;
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Visits every chunk of a world through an AsyncReader, so that the reads of all the region files
+ are in flight together instead of one file and one chunk at a time.
+ 
+ The header of every region file is read first. Once a header is in memory, the reads of the chunks
+ it lists are issued, and once a chunk is in memory, it is inflated and visited: the three stages
+ overlap, on the threads of the reader. The visitor is called by several threads at once, in no
+ particular order. The data it receives is only valid during the call.
+ 
+ In OrderSector, the chunks of a region are read in the order of the file, and the ones that follow
+ each other are read at once (see sectorRuns()): fewer and bigger reads, which matters on spinning
+ disks and network filesystems. The chunks are still reported with their coordinates.
+ */
+class WorldScan {
+	
+	public:
+		WorldScan(AsyncReader &reader, ChunkOrder order = OrderIndex, uint32_t maxRunSectors = DefaultRunSectors) :
+		m_reader(reader), m_order(order), m_maxRunSectors(maxRunSectors), m_regions(0), m_visited(0), m_failed(0), m_bytesRead(0), m_reads(0) {}
+	
+		// visits the chunks of the region files of a directory. Returns the number of chunks visited
+		size_t run(const string &regionDirectory, const ChunkVisitor &visitor) {
+			
+			m_regions = m_visited = m_failed = m_bytesRead = m_reads = 0;
+			for (const RegionFile &file : listRegionFiles(regionDirectory)) {
+				
+				shared_ptr<FileHandle> handle(new FileHandle(file.path));
+				if (!handle->good()) {
+					cerr << "[Warning] cannot open " << file.path << endl;
+					continue;
+				}
+				
+				m_reader.read(handle, 0, RegionHeaderSize, [this, file, &visitor](AsyncRead &read) {
+					m_readChunks(file, read, visitor);
+				});
+			}
+			
+			m_reader.wait();
+			return m_visited;
+		}
+	
+		size_t regions() const { return m_regions; }
+		size_t visited() const { return m_visited; }
+		size_t failed() const { return m_failed; } // chunks that could not be read or decompressed
+		uint64_t bytesRead() const { return m_bytesRead; }
+		size_t reads() const { return m_reads; } // headers included
+	
+	private:
+		AsyncReader &m_reader;
+		ChunkOrder m_order;
+		uint32_t m_maxRunSectors;
+		atomic<size_t> m_regions;
+		atomic<size_t> m_visited;
+		atomic<size_t> m_failed;
+		atomic<uint64_t> m_bytesRead;
+		atomic<size_t> m_reads;
+	
+		// the header of 'file' has been read: we read its chunks
+		void m_readChunks(const RegionFile &file, AsyncRead &read, const ChunkVisitor &visitor) {
+			
+			m_bytesRead += read.data.size();
+			m_reads++;
+			RegionHeader header;
+			if (!read.good() || !header.parse(read.data.data(), read.data.size())) {
+				cerr << "[Warning] cannot read the header of " << file.path << endl;
+				return;
+			}
+			m_regions++;
+			
+			if (m_order == OrderSector) {
+				for (const SectorRun &run : sectorRuns(header, m_maxRunSectors)) {
+					
+					vector<uint32_t> begins, lengths; // where each chunk starts in the run and the size of its sectors, in bytes
+					for (int index : run.chunks) {
+						begins.push_back((header.location(index).offset - run.offset) * RegionSectorSize);
+						lengths.push_back(header.location(index).sectorCount * RegionSectorSize);
+					}
+					
+					off_t offset = static_cast<off_t>(run.offset) * RegionSectorSize;
+					size_t length = static_cast<size_t>(run.sectorCount) * RegionSectorSize;
+					vector<int> chunks = run.chunks;
+					m_reader.read(read.file, offset, length, [this, file, chunks, begins, lengths, &visitor](AsyncRead &sectors) {
+						m_bytesRead += sectors.data.size();
+						m_reads++;
+						for (size_t i = 0; i < chunks.size(); i++) {
+							if (begins[i] < sectors.data.size())
+								m_visit(file, chunks[i], &sectors.data[begins[i]], min<size_t>(sectors.data.size() - begins[i], lengths[i]), visitor);
+							else m_visit(file, chunks[i], nullptr, 0, visitor);
+						}
+					});
+				}
+				return;
+			}
+			
+			for (int index = 0; index < RegionChunkCount; index++) {
+				
+				const ChunkLocation &loc = header.location(index);
+				if (loc.empty())
+					continue;
+				
+				off_t offset = static_cast<off_t>(loc.offset) * RegionSectorSize;
+				size_t length = static_cast<size_t>(loc.sectorCount) * RegionSectorSize;
+				m_reader.read(read.file, offset, length, [this, file, index, &visitor](AsyncRead &chunk) {
+					m_bytesRead += chunk.data.size();
+					m_reads++;
+					m_visit(file, index, chunk.data.data(), chunk.data.size(), visitor);
+				});
+			}
+		}
+	
+		// the sectors of the chunk 'index' of 'file' have been read: we inflate and visit it
+		void m_visit(const RegionFile &file, int index, const char *sectors, size_t size, const ChunkVisitor &visitor) {
+			
+			const char *payload;
+			size_t payloadSize;
+			uint8_t compressionType;
+			memblock data; // not a buffer of workerBuffers(): the visitor may parse or load with them
+			const Codec *codec = nullptr;
+			
+			if (!locateChunkPayload(sectors, size, payload, payloadSize, compressionType) ||
+				!(codec = CodecRegistry::instance().codec(compressionType)) ||
+				!codec->decompress(payload, payloadSize, data)) {
+				cerr << "[Warning] cannot read chunk " << index << " of " << file.path << endl;
+				m_failed++;
+				return;
+			}
+			
+			visitor(file, file.x * 32 + index % 32, file.z * 32 + index / 32, data);
+			m_visited++;
+		}
+};
+
+#ifdef NBTMEISTER_USE_MINECRAFT_NAMESPACE
+};
+#endif // NBTMEISTER_USE_MINECRAFT_NAMESPACE
+#endif // WORLDSCAN_H
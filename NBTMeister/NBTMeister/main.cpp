@@ -27,6 +27,7 @@
 
 #include <iostream>
 #include <sstream>
+#include <memory>
 #include "file-op/MinecraftRegion.h"
 #include "tags/Single.h"
 #include "tags/Array.h"
@@ -44,7 +45,12 @@ int main(int argc, const char * argv[]) {
 		return EXIT_FAILURE;
 	}
 	
-	reg.mapChunks();
+	// we print the tree of one of the chunks
+	unique_ptr<Tag> chunk(reg.parseChunk(8, 0));
+	if (chunk)
+		static_cast<Array *>(chunk.get())->print();
+	else
+		cerr << "[Error] cannot parse the chunk" << endl;
 	
 //	cout << "Test zlib...\nDecompressing file..." << endl;
 //	
@@ -159,6 +159,7 @@ class Array : public Tag, private vector<Tag *> {
 					case TagTypeDouble: cout << "Double" << flush; break;
 					case TagTypeByteArray: cout << "ByteArray" << flush; break;
 					case TagTypeIntArray: cout << "IntArray" << flush; break;
+					case TagTypeLongArray: cout << "LongArray" << flush; break;
 					case TagTypeString: cout << "String" << flush; break;
 					case TagTypeList: cout << "List" << flush; break;
 					case TagTypeCompound: cout << "Compound" << flush; break;
@@ -208,6 +209,14 @@ class Array : public Tag, private vector<Tag *> {
 								cout << static_cast<Single *>(t)->toIntArray()[i] << ", " << flush;
 							cout << static_cast<Single *>(t)->toIntArray()[static_cast<Single *>(t)->toIntArray().size() - 1] << endl;
 							break;
+						case TagTypeLongArray: {
+							const vector<SINGLE_GETLONG> &longs = static_cast<Single *>(t)->toLongArray();
+							cout << "LongArray(\"" << t->name() << "\"): " << flush;
+							for (size_t i = 0; i < longs.size(); i++)
+								cout << static_cast<int64_t>(longs[i]) << (i + 1 < longs.size() ? ", " : "") << flush;
+							cout << endl;
+							break;
+						}
 						case TagTypeString:
 							cout << "String(\"" << t->name() << "\"): " << static_cast<Single *>(t)->toString() << endl;
 							break;
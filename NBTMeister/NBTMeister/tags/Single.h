@@ -52,7 +52,8 @@ typedef var::variant<
 	LittleEndian<double>,			// 5- TagTypeDouble
 	vector<LittleEndian<int8_t>>,	// 6- TagTypeByteArray
 	vector<LittleEndian<int32_t>>,	// 7- TagTypeIntArray
-	string							// 8- TagTypeString
+	string,							// 8- TagTypeString
+	vector<LittleEndian<int64_t>>	// 9- TagTypeLongArray
 > payload_type;
 
 // some defines to help code lisibility & versatility
@@ -80,7 +81,8 @@ typedef var::variant<
 	double,				// 5- TagTypeDouble
 	vector<int8_t>,		// 6- TagTypeByteArray
 	vector<int32_t>,	// 7- TagTypeIntArray
-	string				// 8- TagTypeString
+	string,				// 8- TagTypeString
+	vector<int64_t>		// 9- TagTypeLongArray
 > payload_type;
 
 #define SINGLE_BYTE(v) static_cast<int8_t>(v)
@@ -198,6 +200,8 @@ class Single : public Tag {
 					return TagTypeIntArray;
 				case 8:
 					return TagTypeString;
+				case 9:
+					return TagTypeLongArray;
 					
 				default:
 					cerr << "[Error] tag type is not of a valid type, cannot return it" << endl;
@@ -215,6 +219,7 @@ class Single : public Tag {
 		const SINGLE_GETDOUBLE &toDouble() { return get<SINGLE_GETDOUBLE>(m_payload); }
 		const vector<SINGLE_GETBYTE> &toByteArray() { return get<vector<SINGLE_GETBYTE>>(m_payload); }
 		const vector<SINGLE_GETINT> &toIntArray() { return get<vector<SINGLE_GETINT>>(m_payload); }
+		const vector<SINGLE_GETLONG> &toLongArray() { return get<vector<SINGLE_GETLONG>>(m_payload); }
 		const string &toString() { return get<string>(m_payload); }
 	
 	
@@ -227,7 +232,7 @@ class Single : public Tag {
 	//************
 	private:
 		// the payload specified when creating the single-tag.
-		// When the single-tag is of type ByteArray or IntArray,
+		// When the single-tag is of type ByteArray, IntArray or LongArray,
 		// the payload is not the lenght but actually the array
 		payload_type m_payload;
 };
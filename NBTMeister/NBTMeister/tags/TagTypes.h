@@ -50,6 +50,7 @@ enum TagType {
 	TagTypeList			= 9,
 	TagTypeCompound		= 10,
 	TagTypeIntArray		= 11,
+	TagTypeLongArray	= 12,
 	TagTypeCount				// the number of tag types
 };
 
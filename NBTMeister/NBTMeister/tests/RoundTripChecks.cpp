@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2013, Marc-André Brochu AKA Mister Guacamole
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ ------------------------------------------------------
+ ------------------------------------------------------
+ ABOUT THE IMPLEMENTATION
+ ------------------------------------------------------
+ Round-trip checks of the code that writes files, run on the data of this directory. The region
+ files are copied to a scratch directory first, the originals are never modified.
+ 
+ This is a program of its own, not part of the NBTMeister target. From this directory:
+ 
+ 	g++ -std=gnu++0x -O2 -pthread -I.. RoundTripChecks.cpp ../libs/zlib-contrib/zfstream.cpp -lz -o RoundTripChecks
+ 	./RoundTripChecks [tests directory, "." by default]
+ 
+ Every failed check is reported on cerr; the exit status is EXIT_FAILURE if there was one.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <memory>
+#include <cstdlib>
+#include <unistd.h>
+#include "../file-op/MinecraftRegion.h"
+#include "../file-op/RegionFiles.h"
+#include "../file-op/NbtFile.h"
+#include "../file-op/IncrementalParser.h"
+#include "../file-op/BlockStates.h"
+#include "../file-op/WorldPruner.h"
+#include "../file-op/EntityIndex.h"
+#include "../file-op/ItemIndex.h"
+
+using namespace std;
+
+static size_t failures = 0;
+
+// reports a failed check
+static bool check(bool condition, const string &what) {
+	if (!condition) {
+		cerr << "[Error] " << what << endl;
+		failures++;
+	}
+	return condition;
+}
+
+static memblock readFile(const string &path) {
+	ifstream infile(path, ios::binary);
+	return memblock((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+}
+
+// copies the region files of 'from' to the empty directory 'to'
+static bool copyRegions(const string &from, const string &to) {
+	for (const RegionFile &file : listRegionFiles(from)) {
+		memblock data = readFile(file.path);
+		ofstream outfile(to + "/" + regionFileName(file.x, file.z), ios::binary);
+		outfile.write(data.data(), data.size());
+		if (!outfile.good())
+			return false;
+	}
+	return true;
+}
+
+// the text printed for a tree, to compare two trees
+static string dump(Tag *root) {
+	if (!root)
+		return string();
+	stringstream text;
+	streambuf *previous = cout.rdbuf(text.rdbuf());
+	static_cast<Array *>(root)->print();
+	cout.rdbuf(previous);
+	return text.str();
+}
+
+// the decompressed data of every chunk of a region, by index
+static map<int, memblock> chunksOf(const Region &region) {
+	map<int, memblock> chunks;
+	for (int index = 0; index < RegionChunkCount; index++) {
+		memblock data;
+		if (region.chunkData(index % 32, index / 32, data))
+			chunks[index] = data;
+	}
+	return chunks;
+}
+
+// no two chunks share a sector, and none overlaps the header
+static bool sectorsDisjoint(const RegionHeader &header) {
+	vector<bool> used;
+	for (int index = 0; index < RegionChunkCount; index++) {
+		const ChunkLocation &loc = header.location(index);
+		if (loc.empty())
+			continue;
+		if (loc.offset < RegionHeaderSize / RegionSectorSize)
+			return false;
+		if (used.size() < loc.offset + loc.sectorCount)
+			used.resize(loc.offset + loc.sectorCount, false);
+		for (uint32_t sector = loc.offset; sector < loc.offset + loc.sectorCount; sector++) {
+			if (used[sector])
+				return false;
+			used[sector] = true;
+		}
+	}
+	return true;
+}
+
+// bigtest.nbt decodes to the same tree through every parser, and survives a gzip round trip
+static void checkNbtFile(const string &tests) {
+	
+	string path = tests + "/bigtest.nbt";
+	unique_ptr<Tag> loaded(loadNbtFile(path));
+	if (!check(loaded != nullptr, "cannot load " + path))
+		return;
+	string expected = dump(loaded.get());
+	
+	memblock file = readFile(path), inflated, deflated;
+	const Codec *gzip = CodecRegistry::instance().codec(CompressionGZip);
+	check(gzip->decompress(file.data(), file.size(), inflated), "cannot inflate " + path);
+	
+	Parser parser;
+	unique_ptr<Tag> parsed(parser.build(inflated.begin(), inflated.end()));
+	check(dump(parsed.get()) == expected, "Parser and loadNbtFile() disagree on " + path);
+	
+	IncrementalParser incremental;
+	parser_status status = need_more_data;
+	for (size_t i = 0; i < inflated.size() && status == need_more_data; i++)
+		status = incremental.feed(&inflated[i], 1); // one byte at a time
+	unique_ptr<Tag> fed(incremental.release());
+	check(status == good && dump(fed.get()) == expected, "IncrementalParser and loadNbtFile() disagree on " + path);
+	
+	check(gzip->compress(inflated.data(), inflated.size(), deflated), "cannot deflate " + path);
+	unique_ptr<Tag> decoded(decodeNbt(deflated.data(), deflated.size()));
+	check(dump(decoded.get()) == expected, "the gzip round trip of " + path + " changes its tree");
+}
+
+// chunks rewritten and removed through a Region are found as they were written once the file is reopened
+static void checkRegionWrites(const string &world) {
+	
+	for (const RegionFile &file : listRegionFiles(world)) {
+		
+		map<int, memblock> expected;
+		int removed = -1;
+		{
+			Region region(file.path);
+			expected = chunksOf(region);
+			check(!expected.empty(), "no chunk read in " + file.path);
+			
+			// every third chunk is rewritten: recompressed, it may not fit in its sectors any more
+			size_t rewritten = 0;
+			for (const pair<const int, memblock> &chunk : expected) {
+				if (rewritten++ % 3 == 0)
+					check(region.writeChunk(chunk.first % 32, chunk.first / 32, chunk.second, 1234, CompressionGZip),
+						  "cannot rewrite a chunk of " + file.path);
+			}
+			removed = expected.rbegin()->first;
+			check(region.removeChunk(removed % 32, removed / 32), "cannot remove a chunk of " + file.path);
+			expected.erase(removed);
+			check(region.commit(), "cannot commit " + file.path);
+		}
+		
+		Region reopened(file.path);
+		check(reopened.good(), "cannot reopen " + file.path);
+		check(chunksOf(reopened) == expected, "the chunks of " + file.path + " differ after a write and a commit");
+		check(reopened.location(removed).empty(), "a removed chunk is back in " + file.path);
+		check(sectorsDisjoint(reopened.header()), "chunks share sectors in " + file.path);
+	}
+}
+
+// compact() removes every hole of a region without changing any chunk
+static void checkCompaction(const string &world) {
+	
+	for (const RegionFile &file : listRegionFiles(world)) {
+		
+		Region region(file.path);
+		map<int, memblock> expected = chunksOf(region);
+		size_t before = region.fileSize();
+		check(region.compact(), "cannot compact " + file.path);
+		RegionFragmentation fragmentation = region.fragmentation();
+		check(fragmentation.freeSectors == 0 && fragmentation.holes == 0 && fragmentation.misplacedChunks == 0,
+			  "holes are left after compacting " + file.path);
+		check(region.fileSize() <= before, "compacting " + file.path + " makes it grow");
+		check(chunksOf(region) == expected, "the chunks of " + file.path + " differ after compact()");
+		check(chunksOf(Region(file.path)) == expected, "the chunks of " + file.path + " differ once compacted and reopened");
+	}
+}
+
+// indices packed then unpacked come back unchanged, for every width and both layouts
+static void checkBlockStates() {
+	
+	mt19937 random(42);
+	const size_t count = 4096; // a section
+	for (PackedLayout layout : {LayoutSpanning, LayoutNonSpanning}) {
+		for (int bits = 1; bits <= 16; bits++) {
+			
+			vector<uint16_t> indices(count), unpacked(count);
+			for (uint16_t &index : indices)
+				index = static_cast<uint16_t>(random() & ((1u << bits) - 1));
+			
+			vector<uint64_t> longs;
+			stringstream what;
+			what << "block states of " << bits << " bits, " << (layout == LayoutSpanning ? "spanning" : "non-spanning");
+			check(packIndices(indices.data(), count, bits, longs, layout), "cannot pack the " + what.str());
+			check(longs.size() == packedLongs(count, bits, layout), "wrong number of longs for the " + what.str());
+			check(unpackIndices(longs.data(), longs.size(), bits, unpacked.data(), count, layout) && unpacked == indices,
+				  "the " + what.str() + " differ once unpacked");
+		}
+	}
+	
+	// with 5 bits, the 13th index starts in the first long when spanning, in the second one otherwise
+	vector<uint16_t> indices(count, 0);
+	indices[12] = 31;
+	vector<uint64_t> spanning, nonSpanning;
+	packIndices(indices.data(), count, 5, spanning, LayoutSpanning);
+	packIndices(indices.data(), count, 5, nonSpanning, LayoutNonSpanning);
+	check(spanning[0] >> 60 == 15 && spanning[1] == 1, "the 13th index of 5 bits does not span two longs");
+	check(nonSpanning[0] == 0 && nonSpanning[1] == 31, "the 13th index of 5 bits is not alone in the second long");
+}
+
+// a dry run announces the chunks a real run removes, and leaves the files as they are
+static void checkPruner(const string &world) {
+	
+	vector<int64_t> times;
+	for (const RegionFile &file : listRegionFiles(world)) {
+		Region region(file.path);
+		for (int index = 0; index < RegionChunkCount; index++) {
+			memblock payload, data;
+			uint8_t compressionType;
+			int64_t time;
+			bool found;
+			if (region.readChunk(index % 32, index / 32, payload, compressionType) &&
+				readInhabitedTime(payload.data(), payload.size(), compressionType, data, time, found) && found)
+				times.push_back(time);
+		}
+	}
+	if (!check(!times.empty(), "no InhabitedTime found in " + world))
+		return;
+	sort(times.begin(), times.end());
+	int64_t threshold = times[times.size() / 2];
+	size_t below = lower_bound(times.begin(), times.end(), threshold) - times.begin();
+	
+	map<string, memblock> files;
+	for (const RegionFile &file : listRegionFiles(world))
+		files[file.path] = readFile(file.path);
+	
+	WorldPruner dryRun(WorldPruner::inhabitedBelow(threshold));
+	dryRun.setDryRun(true);
+	size_t announced = dryRun.run(world);
+	check(announced == below, "the dry run does not announce the chunks below the threshold");
+	for (const pair<const string, memblock> &file : files)
+		check(readFile(file.first) == file.second, "the dry run modifies " + file.first);
+	
+	WorldPruner pruner(WorldPruner::inhabitedBelow(threshold));
+	pruner.setCompaction(true);
+	check(pruner.run(world) == announced && pruner.failed() == 0, "the real run does not remove what the dry run announced");
+	
+	size_t left = 0;
+	for (const RegionFile &file : listRegionFiles(world)) {
+		Region region(file.path);
+		region.forEachChunk([&](int x, int z, const memblock &) {
+			memblock payload, data;
+			uint8_t compressionType;
+			int64_t time = 0;
+			bool found = false;
+			region.readChunk(x, z, payload, compressionType);
+			readInhabitedTime(payload.data(), payload.size(), compressionType, data, time, found);
+			check(found && time >= threshold, "a chunk below the threshold is left in " + file.path);
+			left++;
+		});
+	}
+	check(left == times.size() - announced, "the pruned world does not hold the chunks that were kept");
+}
+
+// an entity index saved then loaded gives the same file when saved again
+static void checkEntityIndex(const string &world, const string &scratch) {
+	
+	EntityIndex entities;
+	size_t records = entities.build(world);
+	check(records > 0, "no entity indexed in " + world);
+	check(entities.save(scratch + "/entities.idx"), "cannot save the entity index");
+	
+	EntityIndex loadedEntities;
+	check(loadedEntities.load(scratch + "/entities.idx") && loadedEntities.size() == records && loadedEntities.idCount() == entities.idCount(),
+		  "the entity index differs once loaded");
+	for (size_t i = 0; i < records && i < loadedEntities.size(); i++) {
+		const EntityRecord &a = entities.record(i), &b = loadedEntities.record(i);
+		if (!check(a.x == b.x && a.y == b.y && a.z == b.z && a.chunkX == b.chunkX && a.chunkZ == b.chunkZ && a.kind == b.kind &&
+				   entities.idName(a.id) == loadedEntities.idName(b.id), "a record of the entity index differs once loaded"))
+			break;
+	}
+	check(loadedEntities.save(scratch + "/entities2.idx") && readFile(scratch + "/entities.idx") == readFile(scratch + "/entities2.idx"),
+		  "the entity index is not saved the same once loaded");
+	
+	unlink((scratch + "/entities.idx").c_str());
+	unlink((scratch + "/entities2.idx").c_str());
+}
+
+// an item index saved then loaded gives the same file when saved again
+static void checkItemIndex(const string &world, const string &scratch) {
+	
+	ItemIndex items;
+	items.update(world);
+	check(items.containerCount() > 0, "no container indexed in " + world);
+	check(items.save(scratch + "/items.idx"), "cannot save the item index");
+	
+	ItemIndex loadedItems;
+	check(loadedItems.load(scratch + "/items.idx") && loadedItems.containerCount() == items.containerCount() &&
+		  loadedItems.itemCount() == items.itemCount() && loadedItems.chunkCount() == items.chunkCount(), "the item index differs once loaded");
+	check(loadedItems.save(scratch + "/items2.idx") && readFile(scratch + "/items.idx") == readFile(scratch + "/items2.idx"),
+		  "the item index is not saved the same once loaded");
+	
+	// a loaded index is up to date: an update reads nothing
+	check(loadedItems.update(world) == 0, "a loaded item index reads chunks again");
+	
+	unlink((scratch + "/items.idx").c_str());
+	unlink((scratch + "/items2.idx").c_str());
+}
+
+// a scratch directory holding a copy of the region files of the test world
+static string makeScratchWorld(const string &tests) {
+	char pattern[] = "/tmp/NBTMeisterChecks.XXXXXX";
+	if (!mkdtemp(pattern))
+		return string();
+	string scratch(pattern);
+	if (!copyRegions(tests + "/NBTMeisterTestWorld/region", scratch))
+		return string();
+	return scratch;
+}
+
+static void removeScratchWorld(const string &scratch) {
+	for (const RegionFile &file : listRegionFiles(scratch))
+		unlink(file.path.c_str());
+	rmdir(scratch.c_str());
+}
+
+int main(int argc, const char * argv[]) {
+	
+	string tests = argc > 1 ? argv[1] : ".";
+	
+	cout << "NBT files..." << endl;
+	checkNbtFile(tests);
+	cout << "Block states..." << endl;
+	checkBlockStates();
+	
+	string scratch = makeScratchWorld(tests);
+	if (scratch.empty()) {
+		cerr << "[Error] cannot copy the test world from " << tests << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "Entity index..." << endl;
+	checkEntityIndex(scratch, scratch);
+	cout << "Item index..." << endl;
+	checkItemIndex(scratch, scratch);
+	cout << "Region writes..." << endl;
+	checkRegionWrites(scratch);
+	cout << "Compaction..." << endl;
+	checkCompaction(scratch);
+	removeScratchWorld(scratch);
+	
+	// the pruner gets a fresh copy, with the original timestamps
+	scratch = makeScratchWorld(tests);
+	cout << "Pruner..." << endl;
+	checkPruner(scratch);
+	removeScratchWorld(scratch);
+	
+	if (failures) {
+		cerr << failures << " check(s) failed" << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "All checks passed" << endl;
+	return EXIT_SUCCESS;
+}